@@ -3,15 +3,640 @@
 #include<linux/fs.h>
 #include<linux/cdev.h>
 #include<linux/uaccess.h>
+#include<linux/log2.h>
+#include<linux/mm.h>
+#include<linux/mutex.h>
+#include<linux/percpu.h>
+#include<linux/poll.h>
+#include<linux/slab.h>
+#include<linux/uio.h>
+#include<linux/version.h>
+#include<linux/vmalloc.h>
+#include<linux/wait.h>
+
+#include "cdd_ioctl.h"
 
 #define DEVICE_NAME "my_char_device"
-#define BUFFER_SIZE 1024
+#define PRIVATE_NAME "my_char_device_private"
+#define CLASS_NAME "my_char_class"
+#define BUFFER_SIZE (1 << 20)   /* default ring size in bytes */
+#define BUFFER_SIZE_MAX (64 << 20)
+#define BATCH_CHUNK 32          /* batch entries copied in per step */
+#define STAGING_SIZE (64 << 10)
+
+#ifndef ITER_SOURCE
+#define ITER_SOURCE WRITE       /* before 6.1 */
+#define ITER_DEST READ
+#endif
+
+/* Minor 0 is the shared stream, minor 1 hands each open its own */
+#define SHARED_MINOR 0
+#define PRIVATE_MINOR 1
+#define NR_MINORS 2
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Ring-buffered byte stream character device");
+
+static unsigned int buffer_size = BUFFER_SIZE;
+module_param(buffer_size, uint, 0444);
+MODULE_PARM_DESC(buffer_size, "Ring size in bytes, rounded up to a power of two");
+
+static bool staging;
+module_param(staging, bool, 0444);
+MODULE_PARM_DESC(staging, "Copy writes into per-CPU staging buffers outside the ring lock");
 
 static int majorNumber;
-static char message[BUFFER_SIZE]={0};
-static short size_of_message;
 static struct class* mycharClass = NULL;
 static struct device* mycharDevice = NULL;
+static struct device* myprivateDevice = NULL;
 static struct cdev my_cdev;
 
+/*
+ * A channel is one byte stream, like a pipe: writers append to a
+ * power-of-two ring and readers consume from it. Its head and tail indices
+ * live on a control page that can be mapped along with the data area (see
+ * cdd_ioctl.h), so a mapped producer or consumer moves data with no
+ * syscall at all and read()/write() work on the same ring. The ring needs
+ * no locking with exactly one reader and one writer, so readers serialize
+ * among themselves on read_lock and writers on write_lock, and a producer
+ * and a consumer never contend with each other. Each side sleeps on its
+ * own wait queue and is woken by the other after it moves data.
+ *
+ * /dev/my_char_device is one channel shared by everybody who opens it.
+ * Every open of /dev/my_char_device_private creates a new channel that
+ * belongs to that file alone (pass the fd on with fork() or SCM_RIGHTS to
+ * talk to another process) and goes away with it, so unrelated clients
+ * share no locks or cache lines and throughput scales with their number.
+ *
+ * Mapped users can store anything into head and tail, so the kernel never
+ * trusts them to be consistent: a ring that claims to hold more than its
+ * size fails with -EIO.
+ */
+struct cdd_channel {
+    void *mem;                  /* control page + data area, vmalloc_user() */
+    struct cdd_ring_ctrl *ctrl;
+    char *data;
+    unsigned int size;
+    struct mutex read_lock;
+    struct mutex write_lock;
+    wait_queue_head_t readq;
+    wait_queue_head_t writeq;
+};
+
+static struct cdd_channel *shared_channel;
+
+/*
+ * With staging enabled, write() first copies user data into a buffer of
+ * the CPU it runs on, where page faults and cache misses on the source
+ * cost nothing to anyone else, and holds the ring's write_lock only for a
+ * memcpy. That keeps concurrent writers to one channel from queueing
+ * behind each other's copy from user memory. The mutex covers a task that
+ * migrates or faults while using the buffer; it is never held while
+ * waiting for room in a ring, which would stall every other channel's
+ * writers on that CPU.
+ */
+struct cdd_staging {
+    struct mutex lock;
+    char buf[STAGING_SIZE];
+};
+
+static DEFINE_PER_CPU(struct cdd_staging *, cdd_staging);
+
+static struct cdd_channel *channel_create(unsigned int size)
+{
+    struct cdd_channel *ch = kzalloc(sizeof(*ch), GFP_KERNEL);
+
+    if (!ch)
+        return NULL;
+    /* Zeroed and mappable; large rings need not be physically contiguous */
+    ch->mem = vmalloc_user(PAGE_SIZE + size);
+    if (!ch->mem) {
+        kfree(ch);
+        return NULL;
+    }
+    ch->ctrl = ch->mem;
+    ch->data = ch->mem + PAGE_SIZE;
+    ch->size = size;
+    ch->ctrl->size = size;
+    ch->ctrl->data_offset = PAGE_SIZE;
+    mutex_init(&ch->read_lock);
+    mutex_init(&ch->write_lock);
+    init_waitqueue_head(&ch->readq);
+    init_waitqueue_head(&ch->writeq);
+    return ch;
+}
+
+static void channel_destroy(struct cdd_channel *ch)
+{
+    if (!ch)
+        return;
+    vfree(ch->mem);
+    kfree(ch);
+}
+
+static bool ring_readable(struct cdd_channel *ch)
+{
+    return READ_ONCE(ch->ctrl->head) != READ_ONCE(ch->ctrl->tail);
+}
+
+/* Also true for a corrupted ring, so the caller gets to see -EIO */
+static bool ring_writable(struct cdd_channel *ch)
+{
+    return READ_ONCE(ch->ctrl->head) - READ_ONCE(ch->ctrl->tail) != ch->size;
+}
+
+/*
+ * Copy out up to len buffered bytes into any kind of iov_iter; read_lock
+ * held. A fault part way consumes what was copied, unless whole is set,
+ * in which case nothing is consumed. Returns the count.
+ */
+static ssize_t ring_get(struct cdd_channel *ch, struct iov_iter *to, size_t len, bool whole)
+{
+    unsigned int tail = READ_ONCE(ch->ctrl->tail);
+    unsigned int used = smp_load_acquire(&ch->ctrl->head) - tail;
+    unsigned int n, pos, first;
+    size_t copied;
+
+    if (used > ch->size)
+        return -EIO;
+    n = min_t(size_t, len, used);
+    pos = tail & (ch->size - 1);
+    first = min(n, ch->size - pos);
+    copied = copy_to_iter(ch->data + pos, first, to);
+    if (copied == first)
+        copied += copy_to_iter(ch->data, n - first, to);
+    if (copied < n && (whole || !copied))
+        return -EFAULT;
+    /* The copy must be done before the producer may reuse the space */
+    smp_store_release(&ch->ctrl->tail, tail + copied);
+    return copied;
+}
+
+/* Copy in as much of len bytes as fits; write_lock held. As ring_get(). */
+static ssize_t ring_put(struct cdd_channel *ch, struct iov_iter *from, size_t len, bool whole)
+{
+    unsigned int head = READ_ONCE(ch->ctrl->head);
+    unsigned int used = head - smp_load_acquire(&ch->ctrl->tail);
+    unsigned int n, pos, first;
+    size_t copied;
+
+    if (used > ch->size)
+        return -EIO;
+    n = min_t(size_t, len, ch->size - used);
+    pos = head & (ch->size - 1);
+    first = min(n, ch->size - pos);
+    copied = copy_from_iter(ch->data + pos, first, from);
+    if (copied == first)
+        copied += copy_from_iter(ch->data, n - first, from);
+    if (copied < n && (whole || !copied))
+        return -EFAULT;
+    /* Publish the data before the index that makes it visible */
+    smp_store_release(&ch->ctrl->head, head + copied);
+    return copied;
+}
+
+/*
+ * IOCB_NOWAIT (RWF_NOWAIT, io_uring's first attempt) must not sleep at
+ * all, not even on a contended lock.
+ */
+static int channel_lock(struct mutex *lock, bool nowait)
+{
+    if (nowait)
+        return mutex_trylock(lock) ? 0 : -EAGAIN;
+    return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+static int my_open(struct inode *inode, struct file *filp)
+{
+    struct cdd_channel *ch = shared_channel;
+
+    if (iminor(inode) == PRIVATE_MINOR) {
+        ch = channel_create(buffer_size);
+        if (!ch)
+            return -ENOMEM;
+    }
+    filp->private_data = ch;
+    filp->f_mode |= FMODE_NOWAIT;
+    /* A stream: no file position, reads and writes never take f_pos_lock */
+    return stream_open(inode, filp);
+}
+
+static int my_release(struct inode *inode, struct file *filp)
+{
+    /* Mappings hold the file, so nothing can still reach a private ring */
+    if (iminor(inode) == PRIVATE_MINOR)
+        channel_destroy(filp->private_data);
+    return 0;
+}
+
+/*
+ * read(), readv(), preadv2() and io_uring all land here. Returns whatever
+ * is buffered, up to the size of the iterator (every segment of it is
+ * filled in one pass); blocks only while the ring is empty, unless
+ * O_NONBLOCK or IOCB_NOWAIT.
+ */
+static ssize_t my_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct cdd_channel *ch = filp->private_data;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    ssize_t ret;
+
+    if (!iov_iter_count(to))
+        return 0;
+
+    ret = channel_lock(&ch->read_lock, nowait);
+    if (ret)
+        return ret;
+    while (!ring_readable(ch)) {
+        mutex_unlock(&ch->read_lock);
+        if (nowait || (filp->f_flags & O_NONBLOCK))
+            return -EAGAIN;
+        if (wait_event_interruptible(ch->readq, ring_readable(ch)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&ch->read_lock))
+            return -ERESTARTSYS;
+    }
+    ret = ring_get(ch, to, iov_iter_count(to), false);
+    mutex_unlock(&ch->read_lock);
+
+    if (ret > 0)
+        wake_up_interruptible(&ch->writeq);
+    return ret;
+}
+
+/*
+ * Blocking writes finish the whole iterator, sleeping whenever the ring is
+ * full; O_NONBLOCK and IOCB_NOWAIT writes, and callers that pass !block,
+ * take what fits and fail with -EAGAIN only if nothing does. A signal
+ * after a partial write returns the partial count.
+ */
+static ssize_t channel_write(struct cdd_channel *ch, struct kiocb *iocb, struct iov_iter *from,
+                             bool block)
+{
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    size_t done = 0;
+    ssize_t ret;
+
+    ret = channel_lock(&ch->write_lock, nowait);
+    if (ret)
+        return ret;
+    while (iov_iter_count(from)) {
+        if (!ring_writable(ch)) {
+            if (!block || nowait || (iocb->ki_filp->f_flags & O_NONBLOCK)) {
+                ret = -EAGAIN;
+                break;
+            }
+            mutex_unlock(&ch->write_lock);
+            if (wait_event_interruptible(ch->writeq, ring_writable(ch)))
+                return done ? done : -ERESTARTSYS;
+            if (mutex_lock_interruptible(&ch->write_lock))
+                return done ? done : -ERESTARTSYS;
+            continue;
+        }
+        ret = ring_put(ch, from, iov_iter_count(from), false);
+        if (ret < 0)
+            break;
+        done += ret;
+        wake_up_interruptible(&ch->readq);
+    }
+    mutex_unlock(&ch->write_lock);
+    return done ? done : ret;
+}
+
+/*
+ * With staging, each chunk is pushed without sleeping on a full ring;
+ * whatever did not fit is handed back to the source iterator and staged
+ * again once the ring has room, with the staging buffer released while
+ * waiting.
+ */
+static ssize_t my_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct cdd_channel *ch = iocb->ki_filp->private_data;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    bool nonblock = nowait || (iocb->ki_filp->f_flags & O_NONBLOCK);
+    struct cdd_staging *st;
+    size_t done = 0;
+    ssize_t ret = 0;
+
+    if (!staging)
+        return channel_write(ch, iocb, from, true);
+
+    while (iov_iter_count(from)) {
+        size_t n = min_t(size_t, iov_iter_count(from), STAGING_SIZE);
+        struct iov_iter staged;
+        struct kvec kv;
+
+        st = per_cpu(cdd_staging, raw_smp_processor_id());
+        ret = channel_lock(&st->lock, nowait);
+        if (ret)
+            break;
+        kv.iov_base = st->buf;
+        kv.iov_len = copy_from_iter(st->buf, n, from);
+        if (!kv.iov_len) {
+            mutex_unlock(&st->lock);
+            ret = -EFAULT;
+            break;
+        }
+        iov_iter_kvec(&staged, ITER_SOURCE, &kv, 1, kv.iov_len);
+        ret = channel_write(ch, iocb, &staged, false);
+        mutex_unlock(&st->lock);
+
+        if (ret > 0)
+            done += ret;
+        if (ret < (ssize_t)kv.iov_len)
+            iov_iter_revert(from, kv.iov_len - max_t(ssize_t, ret, 0));
+        if (ret == -EAGAIN && !nonblock) {
+            if (wait_event_interruptible(ch->writeq, ring_writable(ch))) {
+                ret = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+        if (ret < 0 || (ret < (ssize_t)kv.iov_len && nonblock))
+            break;
+    }
+    return done ? done : ret;
+}
+
+static __poll_t my_poll(struct file *filp, poll_table *wait)
+{
+    struct cdd_channel *ch = filp->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &ch->readq, wait);
+    poll_wait(filp, &ch->writeq, wait);
+    if (ring_readable(ch))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (ring_writable(ch))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+/* Whether a whole len-byte entry can move now; true for a corrupted ring */
+static bool batch_ready(struct cdd_channel *ch, bool write, unsigned int len)
+{
+    unsigned int used = READ_ONCE(ch->ctrl->head) - READ_ONCE(ch->ctrl->tail);
+
+    if (used > ch->size)
+        return true;
+    return write ? ch->size - used >= len : used >= len;
+}
+
+/* CDD_IOC_WRITE_BATCH / CDD_IOC_READ_BATCH, see cdd_ioctl.h */
+static long my_ioctl_batch(struct file *filp, struct cdd_batch __user *arg, bool write)
+{
+    struct cdd_channel *ch = filp->private_data;
+    struct mutex *lock = write ? &ch->write_lock : &ch->read_lock;
+    wait_queue_head_t *wq = write ? &ch->writeq : &ch->readq;
+    struct cdd_batch_entry e[BATCH_CHUNK];
+    struct cdd_batch_entry __user *ue;
+    struct cdd_batch b;
+    struct iovec iov;
+    struct iov_iter iter;
+    unsigned int done = 0;
+    bool nonblock, stop = false;
+    long ret = 0;
+
+    if (copy_from_user(&b, arg, sizeof(b)))
+        return -EFAULT;
+    if ((b.flags & ~CDD_BATCH_NONBLOCK) || b.count > CDD_BATCH_MAX)
+        return -EINVAL;
+    nonblock = (filp->f_flags & O_NONBLOCK) || (b.flags & CDD_BATCH_NONBLOCK);
+    ue = u64_to_user_ptr(b.entries);
+
+    if (mutex_lock_interruptible(lock))
+        return -ERESTARTSYS;
+    while (done < b.count && !stop) {
+        unsigned int n = min_t(unsigned int, b.count - done, BATCH_CHUNK);
+        unsigned int i;
+
+        if (copy_from_user(e, ue + done, n * sizeof(e[0]))) {
+            ret = -EFAULT;
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            ssize_t r;
+
+            if (e[i].len > ch->size) {
+                e[i].result = -EMSGSIZE;
+                continue;
+            }
+            /* Only the first entry waits; later ones end the batch */
+            while (!batch_ready(ch, write, e[i].len)) {
+                if (done + i || nonblock) {
+                    ret = -EAGAIN;
+                    stop = true;
+                    break;
+                }
+                mutex_unlock(lock);
+                if (wait_event_interruptible(*wq, batch_ready(ch, write, e[i].len)))
+                    return -ERESTARTSYS;
+                if (mutex_lock_interruptible(lock))
+                    return -ERESTARTSYS;
+            }
+            if (stop)
+                break;
+            iov.iov_base = u64_to_user_ptr(e[i].buf);
+            iov.iov_len = e[i].len;
+            iov_iter_init(&iter, write ? ITER_SOURCE : ITER_DEST, &iov, 1, e[i].len);
+            if (write)
+                r = ring_put(ch, &iter, e[i].len, true);
+            else
+                r = ring_get(ch, &iter, e[i].len, true);
+            if (r == -EIO) {
+                ret = r;
+                stop = true;
+                break;
+            }
+            e[i].result = r;
+        }
+        if (i && copy_to_user(ue + done, e, i * sizeof(e[0]))) {
+            ret = -EFAULT;
+            stop = true;
+        }
+        done += i;
+    }
+    mutex_unlock(lock);
+
+    if (done)
+        wake_up_interruptible(write ? &ch->readq : &ch->writeq);
+    return done ? done : ret;
+}
+
+static long my_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct cdd_channel *ch = filp->private_data;
+
+    switch (cmd) {
+    case CDD_IOC_WRITE_BATCH:
+        return my_ioctl_batch(filp, (struct cdd_batch __user *)arg, true);
+    case CDD_IOC_READ_BATCH:
+        return my_ioctl_batch(filp, (struct cdd_batch __user *)arg, false);
+    /*
+     * Mapped producers and consumers only enter the kernel to wake the
+     * other side, and only when the ring changes between empty/full and not.
+     */
+    case CDD_IOC_KICK_READERS:
+        wake_up_interruptible(&ch->readq);
+        return 0;
+    case CDD_IOC_KICK_WRITERS:
+        wake_up_interruptible(&ch->writeq);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static int my_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct cdd_channel *ch = filp->private_data;
+
+    if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE + ch->size)
+        return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+    return remap_vmalloc_range(vma, ch->mem, 0);
+}
+
+static const struct file_operations fops = {
+    .owner = THIS_MODULE,
+    .open = my_open,
+    .release = my_release,
+    .read_iter = my_read_iter,
+    .write_iter = my_write_iter,
+    /*
+     * splice() and sendfile() to and from pipes and files: both directions
+     * run the pipe's pages through read_iter/write_iter as a bvec
+     * iterator, so the data is copied once, straight between the page
+     * cache and the ring, and never passes through userspace.
+     */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
+    .poll = my_poll,
+    .unlocked_ioctl = my_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .mmap = my_mmap,
+};
+
+static void staging_free(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        kvfree(per_cpu(cdd_staging, cpu));
+        per_cpu(cdd_staging, cpu) = NULL;
+    }
+}
+
+/* Each CPU's buffer comes from its own node */
+static int staging_alloc(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct cdd_staging *st = kvmalloc_node(sizeof(*st), GFP_KERNEL, cpu_to_node(cpu));
+
+        if (!st) {
+            staging_free();
+            return -ENOMEM;
+        }
+        mutex_init(&st->lock);
+        per_cpu(cdd_staging, cpu) = st;
+    }
+    return 0;
+}
+
+static int __init my_char_init(void)
+{
+    dev_t dev;
+    int ret;
+
+    BUILD_BUG_ON(sizeof(struct cdd_ring_ctrl) > PAGE_SIZE);
+    buffer_size = roundup_pow_of_two(clamp_t(unsigned int, buffer_size, PAGE_SIZE, BUFFER_SIZE_MAX));
+    shared_channel = channel_create(buffer_size);
+    if (!shared_channel)
+        return -ENOMEM;
+    if (staging) {
+        ret = staging_alloc();
+        if (ret)
+            goto fail_channel;
+    }
+
+    ret = alloc_chrdev_region(&dev, 0, NR_MINORS, DEVICE_NAME);
+    if (ret < 0) {
+        printk(KERN_ALERT "my_char_device: failed to allocate a major number\n");
+        goto fail_staging;
+    }
+    majorNumber = MAJOR(dev);
+
+    cdev_init(&my_cdev, &fops);
+    my_cdev.owner = THIS_MODULE;
+    ret = cdev_add(&my_cdev, dev, NR_MINORS);
+    if (ret < 0)
+        goto fail_region;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    mycharClass = class_create(CLASS_NAME);
+#else
+    mycharClass = class_create(THIS_MODULE, CLASS_NAME);
+#endif
+    if (IS_ERR(mycharClass)) {
+        ret = PTR_ERR(mycharClass);
+        goto fail_cdev;
+    }
+    mycharDevice = device_create(mycharClass, NULL, MKDEV(majorNumber, SHARED_MINOR), NULL,
+                                 DEVICE_NAME);
+    if (IS_ERR(mycharDevice)) {
+        ret = PTR_ERR(mycharDevice);
+        goto fail_class;
+    }
+    myprivateDevice = device_create(mycharClass, NULL, MKDEV(majorNumber, PRIVATE_MINOR), NULL,
+                                    PRIVATE_NAME);
+    if (IS_ERR(myprivateDevice)) {
+        ret = PTR_ERR(myprivateDevice);
+        goto fail_device;
+    }
+
+    printk(KERN_INFO "my_char_device: major %d, %u byte rings%s\n", majorNumber, buffer_size,
+           staging ? ", per-CPU staging" : "");
+    return 0;
+
+fail_device:
+    device_destroy(mycharClass, MKDEV(majorNumber, SHARED_MINOR));
+fail_class:
+    class_destroy(mycharClass);
+fail_cdev:
+    cdev_del(&my_cdev);
+fail_region:
+    unregister_chrdev_region(dev, NR_MINORS);
+fail_staging:
+    staging_free();
+fail_channel:
+    channel_destroy(shared_channel);
+    return ret;
+}
+
+static void __exit my_char_exit(void)
+{
+    dev_t dev = MKDEV(majorNumber, 0);
+
+    device_destroy(mycharClass, MKDEV(majorNumber, PRIVATE_MINOR));
+    device_destroy(mycharClass, MKDEV(majorNumber, SHARED_MINOR));
+    class_destroy(mycharClass);
+    cdev_del(&my_cdev);
+    unregister_chrdev_region(dev, NR_MINORS);
+    staging_free();
+    channel_destroy(shared_channel);
+    printk(KERN_INFO "my_char_device: unloaded\n");
+}
 
+module_init(my_char_init);
+module_exit(my_char_exit);
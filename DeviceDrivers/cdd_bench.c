@@ -0,0 +1,716 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "cdd_ioctl.h"
+
+// Throughput benchmark for my_char_device (cdd1.c). N writer and M reader
+// threads move fixed-size messages through the device for a few seconds
+// per run, once for every combination of I/O mode and message size:
+//
+//   rw     one write()/read() per message
+//   readv  writev()/readv() of -b messages per call
+//   batch  CDD_IOC_WRITE_BATCH/CDD_IOC_READ_BATCH of -b messages per call
+//   mmap   the shared ring, copied in and out directly; the kernel is only
+//          entered to sleep in poll() or to kick the other side
+//
+// By default every thread opens the shared device, so all writers feed one
+// ring that all readers drain. With -p each writer gets a private channel
+// of its own, drained by one reader (so -w and -r must match); this is how
+// the device scales across cores, since channels share no locks.
+//
+// Writers stamp the first 8 bytes of every message with the time it was
+// sent. When a ring has exactly one writer and one reader the stream keeps
+// its message boundaries and latency is measured from that stamp to the
+// moment the reader has the whole message. With several threads on one
+// ring the boundaries are lost, so latency is the time spent in each I/O
+// call instead. The mmap mode needs one writer and one reader per ring.
+//
+// Usage: cdd_bench [-w writers] [-r readers] [-p] [-m modes] [-s sizes]
+//                  [-t seconds] [-b batch] [-a] [-d device]
+
+#define DEFAULT_DEVICE "/dev/my_char_device"
+#define DEFAULT_PRIVATE_DEVICE "/dev/my_char_device_private"
+#define DEFAULT_SIZES "64,512,4096,32768"
+#define DEFAULT_SECONDS 2.0
+#define DEFAULT_BATCH 16
+#define MAX_SIZES 16
+#define STAMP_BYTES 8
+#define SAMPLE_CAP (1 << 18)             // per thread, decimated when full
+#define DRAIN_TIMEOUT_NS 5000000000ULL
+
+enum { MODE_RW, MODE_READV, MODE_BATCH, MODE_MMAP, MODE_COUNT };
+static const char *mode_names[MODE_COUNT] = { "rw", "readv", "batch", "mmap" };
+
+// Latency samples. When the buffer fills up every other sample is dropped
+// and only every second one is kept from then on, so a long run is sampled
+// evenly instead of only at the start.
+typedef struct {
+    uint64_t *v;
+    size_t count;
+    unsigned int stride;
+    unsigned int skip;
+} Samples;
+
+typedef struct {
+    _Alignas(64) pthread_t thread;
+    int fd;
+    int writer;
+    int cpu;                      // -1 when not pinned
+    int error;                    // errno of the failure that stopped it
+    atomic_int done;
+    atomic_uint_fast64_t bytes;   // written only by the owning thread
+    Samples lat;
+    size_t pos;                   // reader: offset into the current message
+    uint64_t stamp;               // reader: stamp of the current message
+} Worker;
+
+// Parameters of the run in progress, read by every thread
+static struct {
+    int mode;
+    size_t msg;
+    int batch;
+    int framed;                   // one writer and one reader per ring
+    uint64_t deadline;
+} run;
+
+static atomic_int stop_flag;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(Samples *s, uint64_t v) {
+    if (++s->skip < s->stride) {
+        return;
+    }
+    s->skip = 0;
+    if (s->count == SAMPLE_CAP) {
+        for (size_t i = 0; i < SAMPLE_CAP / 2; i++) {
+            s->v[i] = s->v[2 * i];
+        }
+        s->count = SAMPLE_CAP / 2;
+        s->stride *= 2;
+    }
+    s->v[s->count++] = v;
+}
+
+static void add_bytes(Worker *w, size_t n) {
+    atomic_store_explicit(&w->bytes, atomic_load_explicit(&w->bytes, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+// Walk n received bytes of the message stream, timing each message that
+// completes in them.
+static void consume(Worker *w, const char *p, size_t n, uint64_t now) {
+    add_bytes(w, n);
+    while (n) {
+        if (w->pos < STAMP_BYTES) {
+            size_t k = n < STAMP_BYTES - w->pos ? n : STAMP_BYTES - w->pos;
+            memcpy((char *)&w->stamp + w->pos, p, k);
+        }
+        size_t k = n < run.msg - w->pos ? n : run.msg - w->pos;
+        w->pos += k;
+        p += k;
+        n -= k;
+        if (w->pos == run.msg) {
+            if (run.framed) {
+                record(&w->lat, now - w->stamp);
+            }
+            w->pos = 0;
+        }
+    }
+}
+
+static void stamp(char *buf, int count) {
+    uint64_t t = now_ns();
+    for (int i = 0; i < count; i++) {
+        memcpy(buf + i * run.msg, &t, STAMP_BYTES);
+    }
+}
+
+// Call latency, for rings whose stream has no message boundaries
+static void record_call(Worker *w, uint64_t start) {
+    if (!run.framed) {
+        record(&w->lat, now_ns() - start);
+    }
+}
+
+static int write_full(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR && !atomic_load(&stop_flag)) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Map the whole ring: the control page first, to learn its geometry
+static int map_ring(int fd, struct cdd_ring_ctrl **ctrl, char **data, size_t *map_len) {
+    long page = sysconf(_SC_PAGESIZE);
+    struct cdd_ring_ctrl *c = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+    if (c == MAP_FAILED) {
+        return -1;
+    }
+    *map_len = c->data_offset + (size_t)c->size;
+    size_t offset = c->data_offset;
+    munmap(c, page);
+
+    char *base = mmap(NULL, *map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    *ctrl = (struct cdd_ring_ctrl *)base;
+    *data = base + offset;
+    return 0;
+}
+
+static int ring_size(int fd) {
+    struct cdd_ring_ctrl *ctrl;
+    char *data;
+    size_t len;
+    if (map_ring(fd, &ctrl, &data, &len) < 0) {
+        return -1;
+    }
+    int size = ctrl->size;
+    munmap(ctrl, len);
+    return size;
+}
+
+static int writer_mmap(Worker *w, char *buf) {
+    struct cdd_ring_ctrl *ctrl;
+    char *data;
+    size_t len;
+    if (map_ring(w->fd, &ctrl, &data, &len) < 0) {
+        return -1;
+    }
+    uint32_t size = ctrl->size;
+    uint32_t head = __atomic_load_n(&ctrl->head, __ATOMIC_RELAXED);
+    int err = 0;
+
+    while (now_ns() < run.deadline && !atomic_load(&stop_flag)) {
+        stamp(buf, 1);
+        size_t done = 0;
+        while (done < run.msg) {
+            uint32_t tail = __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE);
+            uint32_t space = size - (head - tail);
+            if (!space) {
+                struct pollfd pfd = { w->fd, POLLOUT, 0 };
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                    err = -1;
+                    break;
+                }
+                if (atomic_load(&stop_flag)) {
+                    break;
+                }
+                continue;
+            }
+            uint32_t n = run.msg - done < space ? run.msg - done : space;
+            uint32_t pos = head & (size - 1);
+            uint32_t first = n < size - pos ? n : size - pos;
+            memcpy(data + pos, buf + done, first);
+            memcpy(data, buf + done + first, n - first);
+            __atomic_store_n(&ctrl->head, head + n, __ATOMIC_RELEASE);
+
+            // A reader that saw the ring empty may be asleep in poll(). The
+            // fence orders our publish before the re-check of its index.
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ctrl->tail, __ATOMIC_RELAXED) == head &&
+                ioctl(w->fd, CDD_IOC_KICK_READERS) < 0) {
+                err = -1;
+                break;
+            }
+            head += n;
+            done += n;
+            add_bytes(w, n);
+        }
+        if (err || done < run.msg) {
+            break;
+        }
+    }
+    munmap(ctrl, len);
+    return err;
+}
+
+static int reader_mmap(Worker *w) {
+    struct cdd_ring_ctrl *ctrl;
+    char *data;
+    size_t len;
+    if (map_ring(w->fd, &ctrl, &data, &len) < 0) {
+        return -1;
+    }
+    uint32_t size = ctrl->size;
+    uint32_t tail = __atomic_load_n(&ctrl->tail, __ATOMIC_RELAXED);
+    int err = 0;
+
+    while (!atomic_load(&stop_flag)) {
+        uint32_t head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            struct pollfd pfd = { w->fd, POLLIN, 0 };
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                err = -1;
+                break;
+            }
+            continue;
+        }
+        uint64_t now = now_ns();
+        uint32_t n = head - tail;
+        uint32_t pos = tail & (size - 1);
+        uint32_t first = n < size - pos ? n : size - pos;
+        consume(w, data + pos, first, now);
+        consume(w, data, n - first, now);
+        __atomic_store_n(&ctrl->tail, head, __ATOMIC_RELEASE);
+
+        // Same for a writer that saw the ring full
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ctrl->head, __ATOMIC_RELAXED) - tail == size &&
+            ioctl(w->fd, CDD_IOC_KICK_WRITERS) < 0) {
+            err = -1;
+            break;
+        }
+        tail = head;
+    }
+    munmap(ctrl, len);
+    return err;
+}
+
+static int writer_loop(Worker *w, char *buf, struct iovec *iov, struct cdd_batch_entry *e) {
+    size_t total = run.msg * run.batch;
+
+    while (now_ns() < run.deadline && !atomic_load(&stop_flag)) {
+        uint64_t start = now_ns();
+        switch (run.mode) {
+        case MODE_RW:
+            stamp(buf, 1);
+            if (write_full(w->fd, buf, run.msg) < 0) {
+                return -1;
+            }
+            add_bytes(w, run.msg);
+            break;
+        case MODE_READV: {
+            stamp(buf, run.batch);
+            ssize_t n = writev(w->fd, iov, run.batch);
+            if (n < 0 || write_full(w->fd, buf + n, total - n) < 0) {
+                return -1;
+            }
+            add_bytes(w, total);
+            break;
+        }
+        case MODE_BATCH: {
+            stamp(buf, run.batch);
+            for (int first = 0; first < run.batch;) {
+                struct cdd_batch b = { (uintptr_t)(e + first), run.batch - first, 0 };
+                int n = ioctl(w->fd, CDD_IOC_WRITE_BATCH, &b);
+                if (n < 0) {
+                    if (errno == EINTR && !atomic_load(&stop_flag)) {
+                        continue;
+                    }
+                    return -1;
+                }
+                for (int i = first; i < first + n; i++) {
+                    if (e[i].result < 0) {
+                        errno = -e[i].result;
+                        return -1;
+                    }
+                }
+                first += n;
+            }
+            add_bytes(w, total);
+            break;
+        }
+        }
+        record_call(w, start);
+    }
+    return 0;
+}
+
+static int reader_loop(Worker *w, char *buf, struct iovec *iov, struct cdd_batch_entry *e) {
+    while (!atomic_load(&stop_flag)) {
+        uint64_t start = now_ns();
+        ssize_t n;
+        switch (run.mode) {
+        case MODE_RW:
+            n = read(w->fd, buf, run.msg);
+            break;
+        case MODE_READV:
+            n = readv(w->fd, iov, run.batch);
+            break;
+        default: {
+            struct cdd_batch b = { (uintptr_t)e, run.batch, 0 };
+            n = ioctl(w->fd, CDD_IOC_READ_BATCH, &b);
+            break;
+        }
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        uint64_t now = now_ns();
+        if (run.mode == MODE_BATCH) {
+            for (int i = 0; i < n; i++) {
+                if (e[i].result < 0) {
+                    errno = -e[i].result;
+                    return -1;
+                }
+                consume(w, buf + i * run.msg, e[i].result, now);
+            }
+        } else {
+            consume(w, buf, n, now);
+        }
+        record_call(w, start);
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    char *buf = malloc(run.msg * run.batch);
+    struct iovec *iov = calloc(run.batch, sizeof(*iov));
+    struct cdd_batch_entry *e = calloc(run.batch, sizeof(*e));
+    int ret = -1;
+    if (buf && iov && e) {
+        memset(buf, 0x5a, run.msg * run.batch);
+        for (int i = 0; i < run.batch; i++) {
+            iov[i].iov_base = buf + i * run.msg;
+            iov[i].iov_len = run.msg;
+            e[i].buf = (uintptr_t)(buf + i * run.msg);
+            e[i].len = run.msg;
+        }
+        if (run.mode == MODE_MMAP) {
+            ret = w->writer ? writer_mmap(w, buf) : reader_mmap(w);
+        } else {
+            ret = w->writer ? writer_loop(w, buf, iov, e) : reader_loop(w, buf, iov, e);
+        }
+    }
+    // Being interrupted by stop_workers() is not a failure
+    if (ret < 0 && !(errno == EINTR && atomic_load(&stop_flag))) {
+        w->error = errno ? errno : ENOMEM;
+    }
+    free(buf);
+    free(iov);
+    free(e);
+    atomic_store(&w->done, 1);
+    return NULL;
+}
+
+static void on_wake(int sig) {
+    (void)sig;
+}
+
+// Interrupt threads blocked in the device until they notice stop_flag. The
+// signal may land just before a thread blocks, so it is repeated.
+static void stop_workers(Worker *ws, int count) {
+    atomic_store(&stop_flag, 1);
+    for (int i = 0; i < count; i++) {
+        while (!atomic_load(&ws[i].done)) {
+            pthread_kill(ws[i].thread, SIGUSR1);
+            usleep(1000);
+        }
+        pthread_join(ws[i].thread, NULL);
+    }
+}
+
+static uint64_t total_bytes(Worker *ws, int count) {
+    uint64_t sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += atomic_load(&ws[i].bytes);
+    }
+    return sum;
+}
+
+static int any_failed(Worker *ws, int count) {
+    for (int i = 0; i < count; i++) {
+        if (atomic_load(&ws[i].done) && ws[i].error) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *v, size_t count, double p) {
+    if (!count) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (count - 1));
+    return v[i] / 1e3;
+}
+
+static int run_one(const char *device, int private_rings, int writers, int readers,
+                   int pin, double seconds) {
+    int count = writers + readers;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    Worker *ws = aligned_alloc(64, count * sizeof(Worker));
+    if (!ws) {
+        return -1;
+    }
+    memset(ws, 0, count * sizeof(Worker));
+
+    int ret = 0;
+    for (int i = 0; i < count; i++) {
+        Worker *w = &ws[i];
+        w->writer = i < writers;
+        w->cpu = pin ? i % cpus : -1;
+        w->lat.stride = 1;
+        w->lat.v = malloc(SAMPLE_CAP * sizeof(uint64_t));
+        // A private ring is shared by writer i and reader i through one open
+        if (private_rings && !w->writer) {
+            w->fd = ws[i - writers].fd;
+        } else {
+            w->fd = open(device, O_RDWR);
+        }
+        if (w->fd < 0 || !w->lat.v) {
+            perror("Error opening device");
+            for (int j = 0; j <= i; j++) {
+                if (ws[j].fd >= 0 && !(private_rings && !ws[j].writer)) {
+                    close(ws[j].fd);
+                }
+                free(ws[j].lat.v);
+            }
+            free(ws);
+            return -1;
+        }
+    }
+
+    atomic_store(&stop_flag, 0);
+    uint64_t start = now_ns();
+    run.deadline = start + (uint64_t)(seconds * 1e9);
+    int started = 0;
+    for (; started < count; started++) {
+        if (pthread_create(&ws[started].thread, NULL, worker_main, &ws[started]) != 0) {
+            fprintf(stderr, "Error creating thread\n");
+            ret = -1;
+            break;
+        }
+    }
+
+    // Let the writers finish, then the readers drain what they sent
+    uint64_t end = 0;
+    if (!ret) {
+        for (;;) {
+            int writing = 0;
+            for (int i = 0; i < writers; i++) {
+                writing += !atomic_load(&ws[i].done);
+            }
+            uint64_t sent = total_bytes(ws, writers);
+            uint64_t now = now_ns();
+            if (!writing && total_bytes(ws + writers, readers) == sent) {
+                end = now;
+                break;
+            }
+            if (any_failed(ws, count) ||
+                (!writing && now > run.deadline + DRAIN_TIMEOUT_NS)) {
+                break;
+            }
+            usleep(200);
+        }
+    }
+    stop_workers(ws, started);
+
+    for (int i = 0; i < count; i++) {
+        if (ws[i].error) {
+            fprintf(stderr, "%s %d: %s\n", ws[i].writer ? "writer" : "reader",
+                    ws[i].writer ? i : i - writers, strerror(ws[i].error));
+            ret = -1;
+        }
+    }
+    if (!ret && !end) {
+        fprintf(stderr, "Readers did not drain the ring in time\n");
+        ret = -1;
+    }
+
+    if (!ret) {
+        size_t samples = 0;
+        for (int i = 0; i < count; i++) {
+            samples += ws[i].lat.count;
+        }
+        uint64_t *all = malloc((samples ? samples : 1) * sizeof(uint64_t));
+        size_t n = 0;
+        for (int i = 0; all && i < count; i++) {
+            memcpy(all + n, ws[i].lat.v, ws[i].lat.count * sizeof(uint64_t));
+            n += ws[i].lat.count;
+        }
+        if (all) {
+            qsort(all, n, sizeof(uint64_t), cmp_u64);
+        }
+
+        double secs = (end - start) / 1e9;
+        uint64_t bytes = total_bytes(ws + writers, readers);
+        printf("%-6s %8zu %10.1f %12.0f %9.1f %9.1f %9.1f %9.1f\n",
+               mode_names[run.mode], run.msg, bytes / secs / 1e6,
+               bytes / (double)run.msg / secs, percentile_us(all, n, 0.50),
+               percentile_us(all, n, 0.99), percentile_us(all, n, 0.999),
+               n ? all[n - 1] / 1e3 : 0);
+        fflush(stdout);
+        free(all);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!(private_rings && !ws[i].writer)) {
+            close(ws[i].fd);
+        }
+        free(ws[i].lat.v);
+    }
+    free(ws);
+    return ret;
+}
+
+static int parse_modes(char *list, int *modes) {
+    int count = 0;
+    for (char *tok = strtok(list, ","); tok && count < MODE_COUNT; tok = strtok(NULL, ",")) {
+        int m;
+        for (m = 0; m < MODE_COUNT && strcmp(tok, mode_names[m]); m++) {
+        }
+        if (m == MODE_COUNT) {
+            fprintf(stderr, "Unknown mode %s\n", tok);
+            return -1;
+        }
+        modes[count++] = m;
+    }
+    return count;
+}
+
+static int parse_sizes(char *list, size_t *sizes) {
+    int count = 0;
+    for (char *tok = strtok(list, ","); tok && count < MAX_SIZES; tok = strtok(NULL, ",")) {
+        long size = atol(tok);
+        sizes[count++] = size < STAMP_BYTES ? STAMP_BYTES : size;
+    }
+    return count;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-w writers] [-r readers] [-p] [-m rw,readv,batch,mmap] "
+            "[-s sizes] [-t seconds] [-b batch] [-a] [-d device]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    const char *device = NULL;
+    char mode_list[64] = "rw,readv,batch,mmap";
+    char size_list[256] = DEFAULT_SIZES;
+    double seconds = DEFAULT_SECONDS;
+    int writers = 1, readers = 1, batch = DEFAULT_BATCH;
+    int private_rings = 0, pin = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:r:pm:s:t:b:ad:")) != -1) {
+        switch (opt) {
+        case 'w': writers = atoi(optarg); break;
+        case 'r': readers = atoi(optarg); break;
+        case 'p': private_rings = 1; break;
+        case 'm': snprintf(mode_list, sizeof(mode_list), "%s", optarg); break;
+        case 's': snprintf(size_list, sizeof(size_list), "%s", optarg); break;
+        case 't': seconds = atof(optarg); break;
+        case 'b': batch = atoi(optarg); break;
+        case 'a': pin = 1; break;
+        case 'd': device = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc || writers < 1 || readers < 1 || batch < 1 || batch > CDD_BATCH_MAX ||
+        seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (private_rings && writers != readers) {
+        fprintf(stderr, "Private channels pair each writer with one reader: -w and -r must match\n");
+        return 1;
+    }
+    if (!device) {
+        device = private_rings ? DEFAULT_PRIVATE_DEVICE : DEFAULT_DEVICE;
+    }
+
+    int modes[MODE_COUNT];
+    size_t sizes[MAX_SIZES];
+    int mode_count = parse_modes(mode_list, modes);
+    int size_count = parse_sizes(size_list, sizes);
+    if (mode_count <= 0 || size_count <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = open(device, O_RDWR);
+    if (fd < 0) {
+        perror("Error opening device");
+        return 1;
+    }
+    int ring = ring_size(fd);
+    close(fd);
+    if (ring < 0) {
+        perror("Error mapping ring");
+        return 1;
+    }
+
+    // Wakes threads blocked in the device at the end of a run
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_wake;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    run.framed = private_rings || (writers == 1 && readers == 1);
+    printf("%s: %d writer(s), %d reader(s), %s, %d KB ring, %.1f s per run, batch %d%s\n",
+           device, writers, readers, private_rings ? "one private channel per pair" : "one shared ring",
+           ring >> 10, seconds, batch, pin ? ", pinned" : "");
+    printf("Latency: %s\n", run.framed ? "write to read, per message" : "per I/O call");
+    printf("%-6s %8s %10s %12s %9s %9s %9s %9s\n", "mode", "size", "MB/s", "msgs/s",
+           "p50 us", "p99 us", "p99.9 us", "max us");
+
+    int failed = 0;
+    for (int m = 0; m < mode_count; m++) {
+        if (modes[m] == MODE_MMAP && !run.framed) {
+            printf("%-6s skipped: needs one writer and one reader per ring (-p)\n",
+                   mode_names[MODE_MMAP]);
+            continue;
+        }
+        for (int s = 0; s < size_count; s++) {
+            if (modes[m] == MODE_BATCH && sizes[s] > (size_t)ring) {
+                printf("%-6s %8zu skipped: larger than the ring\n", mode_names[MODE_BATCH], sizes[s]);
+                continue;
+            }
+            run.mode = modes[m];
+            run.msg = sizes[s];
+            run.batch = modes[m] == MODE_READV || modes[m] == MODE_BATCH ? batch : 1;
+            if (run_one(device, private_rings, writers, readers, pin, seconds) < 0) {
+                failed = 1;
+            }
+        }
+    }
+    return failed;
+}
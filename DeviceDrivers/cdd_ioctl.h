@@ -0,0 +1,69 @@
+#ifndef CDD_IOCTL_H
+#define CDD_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Userspace interface of my_char_device (cdd1.c), shared by the driver and
+ * the programs that use it.
+ *
+ * Mapped ring: the first page of the device is struct cdd_ring_ctrl; map
+ * it to learn size and data_offset, then map data_offset + size bytes at
+ * offset 0 to get the data area as well. head and tail are free-running
+ * byte counts; head - tail bytes starting at data[tail & (size - 1)] are
+ * readable and the rest of the area is free. The producer fills the area then publishes
+ * with a release store to head, the consumer reads then frees with a
+ * release store to tail, and each loads the other's index with acquire.
+ *
+ * Nothing else needs the kernel. A side that finds the ring empty (or
+ * full) sleeps in poll(); the other side kicks it with CDD_IOC_KICK_READERS
+ * when its publish took the ring from empty to non-empty, or
+ * CDD_IOC_KICK_WRITERS when it took it from full to non-full. read() and
+ * write() use the same ring, so a mapped producer can feed a read()
+ * consumer and the other way round, but each side must have one user at a
+ * time.
+ */
+
+struct cdd_ring_ctrl {
+    __u32 head;                 /* written by the producer only */
+    __u32 pad0[15];             /* keep head and tail on separate cache lines */
+    __u32 tail;                 /* written by the consumer only */
+    __u32 pad1[15];
+    __u32 size;                 /* data area bytes, a power of two; read-only */
+    __u32 data_offset;          /* offset of the data area in the mapping */
+};
+
+/*
+ * Batched I/O, in the spirit of sendmmsg()/recvmmsg(): one ioctl moves an
+ * array of messages. Each entry is all or nothing, exactly len bytes or
+ * none, so fixed-size messages keep their boundaries in the byte stream;
+ * an entry larger than the ring fails alone with -EMSGSIZE. The call
+ * blocks (unless O_NONBLOCK or CDD_BATCH_NONBLOCK) until the first entry
+ * can move, then moves entries in order until the next one would have to
+ * wait. It returns how many entries were handled, each with its result
+ * (len, or -errno) filled in, or -errno if none was.
+ */
+struct cdd_batch_entry {
+    __u64 buf;                  /* user pointer */
+    __u32 len;
+    __s32 result;               /* out */
+};
+
+struct cdd_batch {
+    __u64 entries;              /* user pointer to struct cdd_batch_entry[count] */
+    __u32 count;                /* at most CDD_BATCH_MAX */
+    __u32 flags;
+};
+
+#define CDD_BATCH_NONBLOCK 0x1
+#define CDD_BATCH_MAX 4096
+
+#define CDD_IOC_MAGIC 'c'
+
+#define CDD_IOC_KICK_READERS _IO(CDD_IOC_MAGIC, 1)
+#define CDD_IOC_KICK_WRITERS _IO(CDD_IOC_MAGIC, 2)
+#define CDD_IOC_WRITE_BATCH _IOW(CDD_IOC_MAGIC, 3, struct cdd_batch)
+#define CDD_IOC_READ_BATCH _IOW(CDD_IOC_MAGIC, 4, struct cdd_batch)
+
+#endif /* CDD_IOCTL_H */
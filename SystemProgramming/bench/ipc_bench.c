@@ -0,0 +1,489 @@
+//IPC benchmark: pipe vs fifo vs POSIX message queue vs shared memory
+//
+//Built on the same calls as the one-shot demos (pipe/2-1.c, fifo/3-*.c,
+//message_queue/4-1-*.c, process/1.c), but moving many messages instead of
+//one string, to pick the transport for moving PCM between processes.
+//
+//Throughput: 1..P producer processes (fork) each send their share of -n MB
+//in fixed-size messages to the parent, which receives them all. Reported
+//as MB/s and messages/s from the first fork to the last message.
+//
+//Round trip: one child echoes every message back to the parent over a
+//second channel of the same kind; the parent times each send + receive.
+//
+//Every transport buffers about the same amount: pipes and fifos have the
+//kernel's default 64 KB, the shared memory ring is sized to 64 KB, and the
+//message queue gets MQ_MAXMSG messages (sizes above
+///proc/sys/fs/mqueue/msgsize_max are skipped unless run as root).
+//
+//usage: ipc_bench [-s sizes] [-p producer counts] [-n MB] [-r round trips]
+//build: gcc -O2 -o ipc_bench ipc_bench.c -lrt -lpthread
+
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<mqueue.h>
+#include<sched.h>
+#include<semaphore.h>
+#include<stdatomic.h>
+#include<time.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/types.h>
+#include<sys/wait.h>
+
+#define DEFAULT_SIZES "64,512,4096,65536"
+#define DEFAULT_PRODUCERS "1,2,4"
+#define DEFAULT_MB 64
+#define DEFAULT_ROUNDS 10000
+#define MAX_LIST 16
+#define MQ_MAXMSG 10
+#define SHM_RING_BYTES 65536
+
+enum { PIPE, FIFO, MQ, SHM, TRANSPORTS };
+static const char *names[TRANSPORTS]={ "pipe", "fifo", "mq", "shm" };
+
+//Shared memory ring: any number of producers, one consumer. A producer
+//waits for a free slot, claims the next sequence number, copies its
+//message in and marks the slot with seq+1; the consumer takes slots in
+//order, waiting for that mark in case a later producer finished first.
+struct shm_ring
+{
+	sem_t items;
+	sem_t spaces;
+	atomic_ulong head;
+	unsigned long tail;
+	unsigned long slots;
+	atomic_ulong seq[];
+};
+
+struct chan
+{
+	int type;
+	size_t size;
+	int rfd, wfd;
+	char path[64];
+	mqd_t mq;
+	struct shm_ring *ring;
+	char *data;
+	size_t map_len;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static int read_full(int fd, char *buf, size_t len)
+{
+	while(len>0)
+	{
+		ssize_t n=read(fd, buf, len);
+		if(n<0 && errno==EINTR)
+			continue;
+		if(n<=0)
+			return -1;
+		buf+=n;
+		len-=n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const char *buf, size_t len)
+{
+	while(len>0)
+	{
+		ssize_t n=write(fd, buf, len);
+		if(n<0 && errno==EINTR)
+			continue;
+		if(n<0)
+			return -1;
+		buf+=n;
+		len-=n;
+	}
+	return 0;
+}
+
+static int sem_wait_full(sem_t *sem)
+{
+	while(sem_wait(sem)<0)
+	{
+		if(errno!=EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+//Create a channel in the parent, before forking; names are unlinked as
+//soon as nothing needs to open them any more
+static int chan_open(struct chan *c, int type, size_t size)
+{
+	static int serial;
+	memset(c, 0, sizeof(*c));
+	c->type=type;
+	c->size=size;
+	c->rfd=c->wfd=-1;
+	c->mq=(mqd_t)-1;
+	snprintf(c->path, sizeof(c->path), "/ipc_bench_%d_%d", getpid(), serial++);
+
+	if(type==PIPE)
+	{
+		int fd[2];
+		if(pipe(fd)<0)
+			return -1;
+		c->rfd=fd[0];
+		c->wfd=fd[1];
+	}
+	else if(type==FIFO)
+	{
+		//The fifo lives in /tmp. The parent holds a write end too, so the
+		//reader never sees end of file between one producer and the next.
+		snprintf(c->path, sizeof(c->path), "/tmp/ipc_bench_%d_%d", getpid(), serial++);
+		if(mkfifo(c->path, 0600)<0)
+			return -1;
+		c->rfd=open(c->path, O_RDONLY|O_NONBLOCK);
+		c->wfd=open(c->path, O_WRONLY);
+		if(c->rfd<0 || c->wfd<0)
+			return -1;
+		fcntl(c->rfd, F_SETFL, 0);
+	}
+	else if(type==MQ)
+	{
+		struct mq_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.mq_maxmsg=MQ_MAXMSG;
+		attr.mq_msgsize=size;
+		c->mq=mq_open(c->path, O_CREAT|O_EXCL|O_RDWR, 0600, &attr);
+		if(c->mq==(mqd_t)-1)
+			return -1;
+		mq_unlink(c->path);
+	}
+	else
+	{
+		unsigned long slots=SHM_RING_BYTES/size<2 ? 2 : SHM_RING_BYTES/size;
+		size_t header=sizeof(struct shm_ring)+slots*sizeof(atomic_ulong);
+		header=(header+63)&~(size_t)63;
+		c->map_len=header+slots*size;
+
+		int fd=shm_open(c->path, O_CREAT|O_EXCL|O_RDWR, 0600);
+		if(fd<0)
+			return -1;
+		shm_unlink(c->path);
+		if(ftruncate(fd, c->map_len)<0)
+		{
+			close(fd);
+			return -1;
+		}
+		void *p=mmap(NULL, c->map_len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(p==MAP_FAILED)
+			return -1;
+		c->ring=p;
+		c->data=(char *)p+header;
+		c->ring->slots=slots;
+		for(unsigned long i=0; i<slots; i++)
+			atomic_init(&c->ring->seq[i], 0);
+		atomic_init(&c->ring->head, 0);
+		if(sem_init(&c->ring->items, 1, 0)<0 || sem_init(&c->ring->spaces, 1, slots)<0)
+			return -1;
+	}
+	return 0;
+}
+
+//Called in a child that only sends on c
+static int chan_attach_producer(struct chan *c)
+{
+	if(c->type==PIPE)
+	{
+		close(c->rfd);
+		c->rfd=-1;
+	}
+	else if(c->type==FIFO)
+	{
+		close(c->rfd);
+		close(c->wfd);
+		c->rfd=-1;
+		c->wfd=open(c->path, O_WRONLY);
+		if(c->wfd<0)
+			return -1;
+	}
+	return 0;
+}
+
+static int chan_send(struct chan *c, const char *buf)
+{
+	if(c->type==PIPE || c->type==FIFO)
+		return write_full(c->wfd, buf, c->size);
+	if(c->type==MQ)
+	{
+		while(mq_send(c->mq, buf, c->size, 0)<0)
+		{
+			if(errno!=EINTR)
+				return -1;
+		}
+		return 0;
+	}
+
+	struct shm_ring *r=c->ring;
+	if(sem_wait_full(&r->spaces)<0)
+		return -1;
+	unsigned long seq=atomic_fetch_add(&r->head, 1);
+	unsigned long slot=seq%r->slots;
+	memcpy(c->data+slot*c->size, buf, c->size);
+	atomic_store_explicit(&r->seq[slot], seq+1, memory_order_release);
+	return sem_post(&r->items);
+}
+
+static int chan_recv(struct chan *c, char *buf)
+{
+	if(c->type==PIPE || c->type==FIFO)
+		return read_full(c->rfd, buf, c->size);
+	if(c->type==MQ)
+	{
+		while(mq_receive(c->mq, buf, c->size, NULL)<0)
+		{
+			if(errno!=EINTR)
+				return -1;
+		}
+		return 0;
+	}
+
+	struct shm_ring *r=c->ring;
+	if(sem_wait_full(&r->items)<0)
+		return -1;
+	unsigned long seq=r->tail++;
+	unsigned long slot=seq%r->slots;
+	while(atomic_load_explicit(&r->seq[slot], memory_order_acquire)!=seq+1)
+		sched_yield();
+	memcpy(buf, c->data+slot*c->size, c->size);
+	return sem_post(&r->spaces);
+}
+
+static void chan_close(struct chan *c)
+{
+	if(c->rfd>=0)
+		close(c->rfd);
+	if(c->wfd>=0)
+		close(c->wfd);
+	if(c->type==FIFO)
+		unlink(c->path);
+	if(c->mq!=(mqd_t)-1)
+		mq_close(c->mq);
+	if(c->ring)
+	{
+		sem_destroy(&c->ring->items);
+		sem_destroy(&c->ring->spaces);
+		munmap(c->ring, c->map_len);
+	}
+}
+
+static int wait_children(int count)
+{
+	int failed=0;
+	for(int i=0; i<count; i++)
+	{
+		int status;
+		if(wait(&status)<0 || !WIFEXITED(status) || WEXITSTATUS(status)!=0)
+			failed=1;
+	}
+	return failed;
+}
+
+static void throughput(int type, size_t size, int producers, long mb)
+{
+	struct chan c;
+	long count=(mb<<20)/size/producers;
+	if(count<1)
+		count=1;
+
+	if(chan_open(&c, type, size)<0)
+	{
+		printf("%-5s %8zu %9d   skipped: %s\n", names[type], size, producers, strerror(errno));
+		chan_close(&c);
+		return;
+	}
+	char *buf=malloc(size);
+	memset(buf, 0x5a, size);
+
+	double start=now_sec();
+	int forked=0;
+	for(; forked<producers; forked++)
+	{
+		pid_t pid=fork();
+		if(pid<0)
+		{
+			perror("error creating fork");
+			break;
+		}
+		if(pid==0)
+		{
+			int ret=chan_attach_producer(&c);
+			for(long i=0; i<count && ret==0; i++)
+				ret=chan_send(&c, buf);
+			if(ret<0)
+				perror("producer");
+			_exit(ret<0);
+		}
+	}
+
+	long total=count*forked;
+	long got=0;
+	for(; got<total; got++)
+	{
+		if(chan_recv(&c, buf)<0)
+		{
+			perror("consumer");
+			break;
+		}
+	}
+	double elapsed=now_sec()-start;
+	int failed=wait_children(forked);
+
+	if(failed || got<total)
+		printf("%-5s %8zu %9d   failed\n", names[type], size, producers);
+	else
+		printf("%-5s %8zu %9d %10.1f %12.0f\n", names[type], size, producers,
+			total*(double)size/elapsed/1e6, total/elapsed);
+	fflush(stdout);
+	free(buf);
+	chan_close(&c);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x=*(const double *)a, y=*(const double *)b;
+	return x<y ? -1 : x>y;
+}
+
+static void round_trip(int type, size_t size, int rounds)
+{
+	struct chan req, resp;
+	int ok_req=chan_open(&req, type, size)==0;
+	int ok_resp=ok_req && chan_open(&resp, type, size)==0;
+	if(!ok_resp)
+	{
+		printf("%-5s %8zu   skipped: %s\n", names[type], size, strerror(errno));
+		chan_close(&req);
+		if(ok_req)
+			chan_close(&resp);
+		return;
+	}
+	char *buf=malloc(size);
+	double *rtt=malloc(rounds*sizeof(double));
+	memset(buf, 0x5a, size);
+
+	pid_t pid=fork();
+	if(pid<0)
+	{
+		perror("error creating fork");
+		free(buf);
+		free(rtt);
+		chan_close(&req);
+		chan_close(&resp);
+		return;
+	}
+	if(pid==0)
+	{
+		//echo server
+		int ret=chan_attach_producer(&resp);
+		for(int i=0; i<rounds && ret==0; i++)
+		{
+			ret=chan_recv(&req, buf);
+			if(ret==0)
+				ret=chan_send(&resp, buf);
+		}
+		_exit(ret<0);
+	}
+
+	int done=0;
+	for(; done<rounds; done++)
+	{
+		double start=now_sec();
+		if(chan_send(&req, buf)<0 || chan_recv(&resp, buf)<0)
+		{
+			perror("round trip");
+			break;
+		}
+		rtt[done]=(now_sec()-start)*1e6;
+	}
+	int failed=wait_children(1);
+
+	if(failed || done<rounds)
+		printf("%-5s %8zu   failed\n", names[type], size);
+	else
+	{
+		qsort(rtt, rounds, sizeof(double), cmp_double);
+		printf("%-5s %8zu %9.1f %9.1f %9.1f %9.1f\n", names[type], size,
+			rtt[rounds/2], rtt[(int)(rounds*0.99)], rtt[(int)(rounds*0.999)], rtt[rounds-1]);
+	}
+	fflush(stdout);
+	free(buf);
+	free(rtt);
+	chan_close(&req);
+	chan_close(&resp);
+}
+
+static int parse_list(char *list, long *out)
+{
+	int count=0;
+	for(char *tok=strtok(list, ","); tok && count<MAX_LIST; tok=strtok(NULL, ","))
+	{
+		out[count]=atol(tok);
+		if(out[count]<1)
+			return -1;
+		count++;
+	}
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	char size_list[256]=DEFAULT_SIZES;
+	char producer_list[256]=DEFAULT_PRODUCERS;
+	long mb=DEFAULT_MB;
+	int rounds=DEFAULT_ROUNDS;
+	long sizes[MAX_LIST], producers[MAX_LIST];
+	int opt;
+
+	while((opt=getopt(argc, argv, "s:p:n:r:"))!=-1)
+	{
+		switch(opt)
+		{
+		case 's': snprintf(size_list, sizeof(size_list), "%s", optarg); break;
+		case 'p': snprintf(producer_list, sizeof(producer_list), "%s", optarg); break;
+		case 'n': mb=atol(optarg); break;
+		case 'r': rounds=atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-s sizes] [-p producer counts] [-n MB] [-r round trips]\n", argv[0]);
+			return 1;
+		}
+	}
+	int size_count=parse_list(size_list, sizes);
+	int producer_count=parse_list(producer_list, producers);
+	if(size_count<=0 || producer_count<=0 || mb<1 || rounds<1)
+	{
+		fprintf(stderr, "usage: %s [-s sizes] [-p producer counts] [-n MB] [-r round trips]\n", argv[0]);
+		return 1;
+	}
+
+	printf("throughput, %ld MB per run\n", mb);
+	printf("%-5s %8s %9s %10s %12s\n", "ipc", "size", "producers", "MB/s", "msgs/s");
+	for(int t=0; t<TRANSPORTS; t++)
+		for(int s=0; s<size_count; s++)
+			for(int p=0; p<producer_count; p++)
+				throughput(t, sizes[s], producers[p], mb);
+
+	printf("\nround trip, %d per run (us)\n", rounds);
+	printf("%-5s %8s %9s %9s %9s %9s\n", "ipc", "size", "p50", "p99", "p99.9", "max");
+	for(int t=0; t<TRANSPORTS; t++)
+		for(int s=0; s<size_count; s++)
+			round_trip(t, sizes[s], rounds);
+
+	return 0;
+}
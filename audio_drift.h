@@ -0,0 +1,224 @@
+#ifndef AUDIO_DRIFT_H
+#define AUDIO_DRIFT_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Drift compensation helpers shared by the programs that drive more than
+// one USB audio device at once. Two independent sound cards never run at
+// exactly the same rate, so anything that feeds several of them from one
+// clock has to stretch or squeeze its stream by a few hundred ppm.
+
+#define DRIFT_MAX_CHANNELS 8
+
+// Fine-ratio resampler for interleaved S16 audio (4-point cubic Hermite).
+// ratio is input frames consumed per output frame, so ratio > 1.0 drains
+// the input faster and ratio < 1.0 drains it slower.
+typedef struct {
+    int channels;
+    double ratio;
+    double frac;                              // position between hist[1] and hist[2]
+    float hist[4][DRIFT_MAX_CHANNELS];        // x[-1], x[0], x[1], x[2]
+} FracResampler;
+
+// PI controller turning a position error (in frames) into a ratio.
+typedef struct {
+    double kp;
+    double ki;
+    double integral;
+    double max_adjust;                        // clamp, e.g. 0.005 = 5000 ppm
+    double filtered_error;
+    double smoothing;                         // EMA factor for the raw error
+    int primed;
+} RateController;
+
+static inline void resampler_init(FracResampler *rs, int channels) {
+    memset(rs, 0, sizeof(*rs));
+    rs->channels = channels;
+    rs->ratio = 1.0;
+    // Start with one full frame of pending input so the history fills up
+    // before the first output frame is produced.
+    rs->frac = 3.0;
+}
+
+static inline void resampler_push(FracResampler *rs, const int16_t *frame) {
+    memmove(rs->hist[0], rs->hist[1], sizeof(rs->hist[0]) * 3);
+    for (int c = 0; c < rs->channels; c++) {
+        rs->hist[3][c] = frame[c];
+    }
+}
+
+static inline int16_t resampler_clip(float v) {
+    if (v > 32767.0f) return 32767;
+    if (v < -32768.0f) return -32768;
+    return (int16_t)(v < 0 ? v - 0.5f : v + 0.5f);
+}
+
+// Produce up to out_frames frames from in_frames input frames.
+// Returns the number of output frames written; *consumed receives the
+// number of input frames taken. Unused input must be offered again.
+static inline size_t resampler_process(FracResampler *rs,
+                                       const int16_t *in, size_t in_frames, size_t *consumed,
+                                       int16_t *out, size_t out_frames) {
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    int ch = rs->channels;
+
+    while (out_pos < out_frames) {
+        while (rs->frac >= 1.0) {
+            if (in_pos >= in_frames) {
+                goto done;
+            }
+            resampler_push(rs, in + in_pos * ch);
+            in_pos++;
+            rs->frac -= 1.0;
+        }
+
+        float t = (float)rs->frac;
+        for (int c = 0; c < ch; c++) {
+            float xm1 = rs->hist[0][c];
+            float x0 = rs->hist[1][c];
+            float x1 = rs->hist[2][c];
+            float x2 = rs->hist[3][c];
+            float a = (-xm1 + 3.0f * x0 - 3.0f * x1 + x2) * 0.5f;
+            float b = xm1 - 2.5f * x0 + 2.0f * x1 - 0.5f * x2;
+            float cc = (x1 - xm1) * 0.5f;
+            out[out_pos * ch + c] = resampler_clip(((a * t + b) * t + cc) * t + x0);
+        }
+        out_pos++;
+        rs->frac += rs->ratio;
+    }
+
+done:
+    *consumed = in_pos;
+    return out_pos;
+}
+
+// Input frames that have been pushed but not yet played out, i.e. how far
+// the resampler's output lags behind the input it has consumed.
+static inline double resampler_latency(const FracResampler *rs) {
+    return 2.0 - rs->frac;
+}
+
+static inline void rate_controller_init(RateController *pi, double kp, double ki, double max_adjust) {
+    memset(pi, 0, sizeof(*pi));
+    pi->kp = kp;
+    pi->ki = ki;
+    pi->max_adjust = max_adjust;
+    pi->smoothing = 0.05;
+}
+
+// error > 0 means the consumer is ahead of where it should be, so the
+// returned ratio slows it down (< 1.0). Call once per period.
+static inline double rate_controller_update(RateController *pi, double error) {
+    if (!pi->primed) {
+        pi->filtered_error = error;
+        pi->primed = 1;
+    } else {
+        pi->filtered_error += pi->smoothing * (error - pi->filtered_error);
+    }
+
+    double e = pi->filtered_error;
+    double adjust = pi->kp * e + pi->ki * (pi->integral + e);
+
+    // Only integrate while the output is not saturated (anti-windup)
+    if (adjust < pi->max_adjust && adjust > -pi->max_adjust) {
+        pi->integral += e;
+    }
+
+    if (adjust > pi->max_adjust) adjust = pi->max_adjust;
+    if (adjust < -pi->max_adjust) adjust = -pi->max_adjust;
+
+    return 1.0 - adjust;
+}
+
+static inline void rate_controller_reset(RateController *pi) {
+    pi->integral = 0;
+    pi->primed = 0;
+}
+
+// Rate of one device's sample clock as seen from CLOCK_MONOTONIC, from
+// (timestamp, hardware frame position) pairs taken out of snd_pcm_status.
+// The slope is measured over a long baseline so that the period-sized
+// jitter of individual readings averages out; the baseline is re-anchored
+// every window seconds so slow temperature drift is still followed.
+typedef struct {
+    double nominal_rate;
+    double window;
+    double anchor_time;
+    double anchor_pos;
+    double rate;                  // smoothed measured frames per second
+    int anchored;
+    int valid;                    // rate has been measured at least once
+} ClockTracker;
+
+// Relative drift between a capture and a playback clock.
+typedef struct {
+    ClockTracker capture;
+    ClockTracker playback;
+} DriftEstimator;
+
+static inline void clock_tracker_init(ClockTracker *ct, double nominal_rate, double window) {
+    memset(ct, 0, sizeof(*ct));
+    ct->nominal_rate = nominal_rate;
+    ct->window = window;
+    ct->rate = nominal_rate;
+}
+
+// Forget the anchor after anything that breaks frame continuity (xrun)
+static inline void clock_tracker_reset(ClockTracker *ct) {
+    ct->anchored = 0;
+}
+
+static inline void clock_tracker_update(ClockTracker *ct, double time, double pos) {
+    if (!ct->anchored) {
+        ct->anchor_time = time;
+        ct->anchor_pos = pos;
+        ct->anchored = 1;
+        return;
+    }
+
+    double span = time - ct->anchor_time;
+    if (span < 1.0) {
+        return;
+    }
+
+    double measured = (pos - ct->anchor_pos) / span;
+    // Reject readings that are obviously not a running clock (> 1% off)
+    if (fabs(measured - ct->nominal_rate) > ct->nominal_rate * 0.01) {
+        clock_tracker_reset(ct);
+        return;
+    }
+
+    if (!ct->valid) {
+        ct->rate = measured;
+        ct->valid = 1;
+    } else {
+        // Longer baselines are more trustworthy, weight accordingly
+        double weight = span / (span + ct->window);
+        ct->rate += weight * (measured - ct->rate);
+    }
+
+    if (span >= ct->window) {
+        ct->anchor_time = time;
+        ct->anchor_pos = pos;
+    }
+}
+
+static inline void drift_estimator_init(DriftEstimator *de, double nominal_rate) {
+    clock_tracker_init(&de->capture, nominal_rate, 10.0);
+    clock_tracker_init(&de->playback, nominal_rate, 10.0);
+}
+
+// Input frames to consume per output frame to keep up with the capture
+// clock; this is the feed-forward term the resampler runs at.
+static inline double drift_estimator_ratio(const DriftEstimator *de) {
+    if (!de->capture.valid || !de->playback.valid) {
+        return 1.0;
+    }
+    return de->capture.rate / de->playback.rate;
+}
+
+#endif
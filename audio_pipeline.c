@@ -0,0 +1,283 @@
+#include <alsa/asoundlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "audio_stats.h"
+#include "pcm_reconnect.h"
+#include "pipeline.h"
+#include "vad.h"
+
+// Capture -> gain -> VAD -> analysis -> writer, each stage on its own
+// thread(s) using pipeline.h. Capture never waits on the disk or on DSP:
+// it only needs a free block from the pool, and the analysis stage can be
+// spread over several cores with -w. If the device is unplugged, capture
+// waits for it to come back and carries on; audio from the gap is missing.
+//
+// Usage: audio_pipeline [-d device] [-t seconds] [-g gain] [-w workers] [-o file.raw]
+
+#define SAMPLE_RATE   44100
+#define CHANNELS      2
+#define PERIOD_FRAMES 1024
+#define POOL_BLOCKS   64     // ~1.5 s of audio in flight before capture is held back
+#define VAD_PREROLL_MS  250
+#define VAD_HANGOVER_MS 400
+#define RECONNECT_TIMEOUT_MS 10000  // how long to wait for an unplugged device to return
+
+typedef struct {
+    snd_pcm_t *handle;
+    PcmReconnect rc;
+    unsigned long long frames_left;
+    unsigned long long overruns;
+} CaptureStage;
+
+typedef struct {
+    FILE *file;
+    Vad preroll;             // only the pre-roll ring is used here
+    int16_t *preroll_buf;
+    AudioStatsAccumulator preroll_stats; // analysis skips idle blocks, so pre-roll is counted here
+    unsigned long long frames_written;
+} WriterStage;
+
+// One per analysis worker, each on its own cache line so workers updating
+// neighbouring slots do not keep stealing the line from each other
+typedef struct {
+    _Alignas(64) AudioStatsAccumulator acc;
+} WorkerStats;
+
+static Pipeline *running_pipeline = NULL;
+
+static void handle_sigint(int sig) {
+    (void)sig;
+    if (running_pipeline) {
+        pipeline_stop(running_pipeline);
+    }
+}
+
+void apply_volume(short *buffer, int size, float volume) {
+    for (int i = 0; i < size / sizeof(short); i++) {
+        int sample = (int)(buffer[i] * volume);
+        if (sample > 32767) sample = 32767;
+        if (sample < -32768) sample = -32768;
+        buffer[i] = (short)sample;
+    }
+}
+
+int capture_stage(PipelineStage *stage, PipelineBlock *block, int worker) {
+    CaptureStage *cap = stage->ctx;
+    size_t want = stage->pipeline->block_frames;
+    (void)worker;
+
+    if (cap->frames_left == 0) {
+        return 1;
+    }
+    if (want > cap->frames_left) {
+        want = cap->frames_left;
+    }
+    while (block->frames < want) {
+        int err = snd_pcm_readi(cap->handle, block->data + block->frames * CHANNELS, want - block->frames);
+        if (err == -EPIPE) {
+            cap->overruns++;
+            snd_pcm_prepare(cap->handle);
+            continue;
+        } else if (pcm_reconnect_lost(err)) {
+            fprintf(stderr, "Device lost, waiting for it to come back...\n");
+            if ((err = pcm_reconnect_reopen(&cap->rc, &cap->handle, RECONNECT_TIMEOUT_MS)) < 0) {
+                fprintf(stderr, "Device did not come back: %s\n", snd_strerror(err));
+                return err;
+            }
+            fprintf(stderr, "Reconnected in %.0f ms\n", cap->rc.last_recovery_ms);
+            continue;
+        } else if (err < 0) {
+            fprintf(stderr, "Read error: %s\n", snd_strerror(err));
+            return err;
+        }
+        block->frames += err;
+    }
+    cap->frames_left -= block->frames;
+    return 0;
+}
+
+int gain_stage(PipelineStage *stage, PipelineBlock *block, int worker) {
+    float *gain = stage->ctx;
+    (void)worker;
+    apply_volume(block->data, block->frames * CHANNELS * sizeof(short), *gain);
+    return 0;
+}
+
+int vad_stage(PipelineStage *stage, PipelineBlock *block, int worker) {
+    Vad *vad = stage->ctx;
+    (void)worker;
+    switch (vad_process(vad, block->data, block->frames)) {
+    case VAD_SILENT:
+        block->flags |= PIPELINE_BLOCK_IDLE;
+        break;
+    case VAD_ONSET:
+        block->flags |= PIPELINE_BLOCK_ONSET;
+        break;
+    case VAD_ACTIVE:
+        break;
+    }
+    return 0;
+}
+
+// Each worker accumulates into its own slot; slots are merged at the end
+int analysis_stage(PipelineStage *stage, PipelineBlock *block, int worker) {
+    WorkerStats *slot = &((WorkerStats *)stage->ctx)[worker];
+    audio_stats_accumulate(&slot->acc, block->data, block->frames * CHANNELS);
+    return 0;
+}
+
+int writer_stage(PipelineStage *stage, PipelineBlock *block, int worker) {
+    WriterStage *w = stage->ctx;
+    (void)worker;
+
+    if (block->flags & PIPELINE_BLOCK_IDLE) {
+        vad_preroll_push(&w->preroll, block->data, block->frames);
+        return 0;
+    }
+    if (block->flags & PIPELINE_BLOCK_ONSET) {
+        size_t n = vad_take_preroll(&w->preroll, w->preroll_buf);
+        fwrite(w->preroll_buf, sizeof(int16_t), n * CHANNELS, w->file);
+        audio_stats_accumulate(&w->preroll_stats, w->preroll_buf, n * CHANNELS);
+        w->frames_written += n;
+    }
+    if (fwrite(block->data, sizeof(int16_t), block->frames * CHANNELS, w->file) != block->frames * CHANNELS) {
+        fprintf(stderr, "Write error\n");
+        return -1;
+    }
+    w->frames_written += block->frames;
+    return 0;
+}
+
+int setup_capture(snd_pcm_t **handle, const char *device) {
+    snd_pcm_hw_params_t *params;
+    unsigned int rate = SAMPLE_RATE;
+    int err;
+
+    if ((err = snd_pcm_open(handle, device, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+        printf("Recording open error: %s\n", snd_strerror(err));
+        return err;
+    }
+
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(*handle, params);
+    snd_pcm_hw_params_set_access(*handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    snd_pcm_hw_params_set_format(*handle, params, SND_PCM_FORMAT_S16_LE);
+    snd_pcm_hw_params_set_channels(*handle, params, CHANNELS);
+    snd_pcm_hw_params_set_rate_near(*handle, params, &rate, 0);
+    snd_pcm_uframes_t period = PERIOD_FRAMES;
+    snd_pcm_hw_params_set_period_size_near(*handle, params, &period, 0);
+
+    if ((err = snd_pcm_hw_params(*handle, params)) < 0) {
+        printf("Hardware parameter setting failed: %s\n", snd_strerror(err));
+        snd_pcm_close(*handle);
+        return err;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *device = "default";
+    const char *output = "pipeline_recording.raw";
+    int seconds = 10;
+    float gain = 1.0f;
+    int workers = 2;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:t:g:w:o:")) != -1) {
+        switch (opt) {
+        case 'd': device = optarg; break;
+        case 't': seconds = atoi(optarg); break;
+        case 'g': gain = atof(optarg); break;
+        case 'w': workers = atoi(optarg); break;
+        case 'o': output = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-d device] [-t seconds] [-g gain] [-w workers] [-o file.raw]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (workers < 1) workers = 1;
+    if (workers > PIPELINE_MAX_WORKERS) workers = PIPELINE_MAX_WORKERS;
+
+    CaptureStage cap = {0};
+    if (setup_capture(&cap.handle, device) < 0) {
+        return 1;
+    }
+    pcm_reconnect_save(&cap.rc, cap.handle, device, SND_PCM_STREAM_CAPTURE);
+    cap.frames_left = (unsigned long long)SAMPLE_RATE * seconds;
+
+    Vad vad;
+    WriterStage writer = {0};
+    static WorkerStats acc[PIPELINE_MAX_WORKERS];
+    if (vad_init(&vad, CHANNELS, SAMPLE_RATE, VAD_PREROLL_MS, VAD_HANGOVER_MS) < 0 ||
+        vad_init(&writer.preroll, CHANNELS, SAMPLE_RATE, VAD_PREROLL_MS, VAD_HANGOVER_MS) < 0) {
+        fprintf(stderr, "Failed to allocate VAD\n");
+        snd_pcm_close(cap.handle);
+        return 1;
+    }
+    vad.use_zcr = 1;
+    writer.preroll_buf = malloc(writer.preroll.preroll_capacity * CHANNELS * sizeof(int16_t));
+    writer.file = fopen(output, "wb");
+    if (!writer.file) {
+        printf("Error opening %s\n", output);
+        snd_pcm_close(cap.handle);
+        return 1;
+    }
+
+    Pipeline *p = pipeline_create(CHANNELS, PERIOD_FRAMES, POOL_BLOCKS);
+    if (!p) {
+        fprintf(stderr, "Failed to allocate pipeline\n");
+        return 1;
+    }
+    pipeline_add_stage(p, "capture", capture_stage, &cap, 1);
+    pipeline_add_stage(p, "gain", gain_stage, &gain, 1);
+    pipeline_add_stage(p, "vad", vad_stage, &vad, 1);
+    pipeline_add_stage(p, "analysis", analysis_stage, acc, workers)->skip_idle = 1;
+    pipeline_add_stage(p, "writer", writer_stage, &writer, 1);
+
+    running_pipeline = p;
+    signal(SIGINT, handle_sigint);
+
+    printf("Recording %d seconds from %s through %d stages (%d analysis workers)...\n",
+           seconds, device, p->stage_count, workers);
+    int err = pipeline_run(p);
+    running_pipeline = NULL;
+
+    fclose(writer.file);
+    if (cap.handle) {
+        snd_pcm_drop(cap.handle);
+        snd_pcm_close(cap.handle);
+    }
+
+    // Merge per-worker analysis with the pre-roll the writer stored, so the
+    // results describe exactly the audio in the output file
+    AudioStatsAccumulator total = writer.preroll_stats;
+    for (int i = 0; i < workers; i++) {
+        audio_stats_merge(&total, &acc[i].acc);
+    }
+
+    printf("\nPipeline statistics:\n");
+    pipeline_report(p, stdout);
+    printf("Capture overruns: %llu, reconnects: %ld\n", cap.overruns, cap.rc.reconnects);
+    printf("Stored %.1f of %.1f seconds to %s\n", (double)writer.frames_written / SAMPLE_RATE,
+           (double)vad.frames_in / SAMPLE_RATE, output);
+
+    if (total.count) {
+        AudioStats stats = audio_stats_result(&total);
+        printf("\nAudio Analysis Results (stored audio):\n");
+        printf("Peak Level: %.2f dB\n", 20 * log10(stats.peak_amplitude));
+        printf("Average Level: %.2f dB\n", 20 * log10(stats.average_amplitude));
+        printf("RMS Level: %.2f dB\n", 20 * log10(stats.rms_level));
+        printf("Clipping Detected: %d instances\n", stats.clipping_count);
+    }
+
+    pipeline_destroy(p);
+    vad_free(&vad);
+    vad_free(&writer.preroll);
+    free(writer.preroll_buf);
+    return err < 0 ? 1 : 0;
+}
@@ -0,0 +1,107 @@
+#ifndef AUDIO_STATS_H
+#define AUDIO_STATS_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Level statistics for 16-bit PCM, shared by test2.c and the batch tools
+
+typedef struct {
+    double peak_amplitude;
+    double average_amplitude;
+    int clipping_count;
+    double rms_level;
+} AudioStats;
+
+// Analyze recorded audio
+static inline AudioStats analyze_audio(const int16_t *buffer, size_t buffer_size) {
+    AudioStats stats = {0};
+    double sum = 0;
+    double squared_sum = 0;
+    
+    for (size_t i = 0; i < buffer_size; i++) {
+        double amplitude = fabs((double)buffer[i] / 32768.0);
+        sum += amplitude;
+        squared_sum += amplitude * amplitude;
+        
+        if (amplitude > stats.peak_amplitude) {
+            stats.peak_amplitude = amplitude;
+        }
+        
+        if (abs(buffer[i]) >= 32767) {
+            stats.clipping_count++;
+        }
+    }
+    
+    stats.average_amplitude = sum / buffer_size;
+    stats.rms_level = sqrt(squared_sum / buffer_size);
+    
+    return stats;
+}
+
+// Mergeable form of AudioStats for analyzing a recording in pieces (per
+// period while capturing, per chunk across threads). Averages are kept as
+// running means rather than raw sums: combining two means weighted by
+// their counts never builds up a huge sum that small chunks get lost in,
+// so the result does not depend on how the file was split.
+typedef struct {
+    unsigned long long count;
+    double mean_abs;
+    double mean_square;
+    double peak_amplitude;
+    int clipping_count;
+} AudioStatsAccumulator;
+
+static inline void audio_stats_merge(AudioStatsAccumulator *into, const AudioStatsAccumulator *from) {
+    if (from->count == 0) {
+        return;
+    }
+    unsigned long long count = into->count + from->count;
+    double weight = (double)from->count / count;
+    into->mean_abs += (from->mean_abs - into->mean_abs) * weight;
+    into->mean_square += (from->mean_square - into->mean_square) * weight;
+    into->count = count;
+    into->clipping_count += from->clipping_count;
+    if (from->peak_amplitude > into->peak_amplitude) {
+        into->peak_amplitude = from->peak_amplitude;
+    }
+}
+
+// Fold buffer_size samples into the accumulator
+static inline void audio_stats_accumulate(AudioStatsAccumulator *acc, const int16_t *buffer, size_t buffer_size) {
+    // Plain sums are exact enough within one 64K-sample block
+    const size_t block = 65536;
+    for (size_t start = 0; start < buffer_size; start += block) {
+        size_t end = start + block < buffer_size ? start + block : buffer_size;
+        AudioStatsAccumulator part = {0};
+        double sum = 0;
+        double squared_sum = 0;
+        for (size_t i = start; i < end; i++) {
+            double amplitude = fabs((double)buffer[i] / 32768.0);
+            sum += amplitude;
+            squared_sum += amplitude * amplitude;
+            if (amplitude > part.peak_amplitude) {
+                part.peak_amplitude = amplitude;
+            }
+            if (abs(buffer[i]) >= 32767) {
+                part.clipping_count++;
+            }
+        }
+        part.count = end - start;
+        part.mean_abs = sum / part.count;
+        part.mean_square = squared_sum / part.count;
+        audio_stats_merge(acc, &part);
+    }
+}
+
+static inline AudioStats audio_stats_result(const AudioStatsAccumulator *acc) {
+    AudioStats stats = {0};
+    stats.peak_amplitude = acc->peak_amplitude;
+    stats.average_amplitude = acc->mean_abs;
+    stats.clipping_count = acc->clipping_count;
+    stats.rms_level = sqrt(acc->mean_square);
+    return stats;
+}
+
+#endif
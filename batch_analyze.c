@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "audio_stats.h"
+
+// Re-analyze a whole archive of raw recordings. The directory tree is
+// walked once to collect every matching file, then the files are analyzed
+// on a work-stealing thread pool: each worker starts with its own slice of
+// the list, takes jobs from the back of its own deque and, once it runs
+// dry, steals from the front of another worker's deque. Recording lengths
+// vary a lot, so this keeps every core busy until the very end. Inputs are
+// folded into an AudioStatsAccumulator with audio_stats_accumulate();
+// results for all files go to one tab-separated file instead of one .meta
+// per recording.
+//
+// Files are read in fixed 16 MB chunks that are mapped one at a time, so
+// memory stays flat no matter how long a recording is. Large files (and a
+// single file given on the command line) are analyzed by all threads at
+// once: each takes chunks from a shared counter, reduces them into its own
+// accumulator, and the per-thread results are merged at the end.
+//
+// Usage: batch_analyze [-j threads] [-o results.tsv] [-e extension] directory|file
+
+#define SAMPLE_RATE 44100
+#define CHANNELS    2
+#define DEFAULT_EXTENSION ".raw"
+#define DEFAULT_RESULTS "analysis_results.tsv"
+#define CHUNK_BYTES (16L << 20)          // page and frame aligned
+#define LARGE_FILE_BYTES (4 * CHUNK_BYTES) // split across all threads above this
+
+typedef struct {
+    char *path;
+    off_t size;
+    int status;                   // 0 ok, otherwise errno
+    AudioStats stats;
+} BatchJob;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *items;                // job indices
+    size_t top;                   // thieves take from here
+    size_t bottom;                // owner pushes/pops here
+} WorkDeque;
+
+typedef struct {
+    BatchJob *jobs;
+    size_t job_count;
+    WorkDeque *deques;
+    int workers;
+} BatchPool;
+
+typedef struct {
+    BatchPool *pool;
+    int id;
+    size_t done;
+    size_t stolen;
+} BatchWorker;
+
+// Files collected by the nftw() callback
+static BatchJob *collected = NULL;
+static size_t collected_count = 0;
+static size_t collected_capacity = 0;
+static const char *extension = DEFAULT_EXTENSION;
+
+static int collect_file(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F) {
+        return 0;
+    }
+    size_t len = strlen(path);
+    size_t ext_len = strlen(extension);
+    if (len < ext_len || strcmp(path + len - ext_len, extension) != 0) {
+        return 0;
+    }
+    if (collected_count == collected_capacity) {
+        collected_capacity = collected_capacity ? collected_capacity * 2 : 1024;
+        BatchJob *grown = realloc(collected, collected_capacity * sizeof(BatchJob));
+        if (!grown) {
+            return -1;
+        }
+        collected = grown;
+    }
+    BatchJob *job = &collected[collected_count++];
+    memset(job, 0, sizeof(*job));
+    job->path = strdup(path);
+    job->size = sb->st_size;
+    return job->path ? 0 : -1;
+}
+
+static int deque_pop(WorkDeque *dq, size_t *job) {
+    int ok = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *job = dq->items[--dq->bottom];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static int deque_steal(WorkDeque *dq, size_t *job) {
+    int ok = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *job = dq->items[dq->top++];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+// Analyze one chunk of an open file. Only the chunk is mapped, so memory
+// use does not grow with the file size.
+static int analyze_chunk(int fd, off_t file_size, size_t chunk, AudioStatsAccumulator *acc) {
+    off_t offset = (off_t)chunk * CHUNK_BYTES;
+    size_t length = file_size - offset < CHUNK_BYTES ? file_size - offset : CHUNK_BYTES;
+    length -= length % sizeof(int16_t);
+    if (length == 0) {
+        return 0;
+    }
+
+    const int16_t *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, offset);
+    if (data == MAP_FAILED) {
+        return errno;
+    }
+    madvise((void *)data, length, MADV_SEQUENTIAL);
+    audio_stats_accumulate(acc, data, length / sizeof(int16_t));
+    munmap((void *)data, length);
+    return 0;
+}
+
+void analyze_file(BatchJob *job) {
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0) {
+        job->status = errno;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        job->status = errno;
+        close(fd);
+        return;
+    }
+    job->size = st.st_size;
+
+    AudioStatsAccumulator acc = {0};
+    size_t chunks = (st.st_size + CHUNK_BYTES - 1) / CHUNK_BYTES;
+    for (size_t c = 0; c < chunks && !job->status; c++) {
+        job->status = analyze_chunk(fd, st.st_size, c, &acc);
+    }
+    close(fd);
+    job->stats = audio_stats_result(&acc);
+}
+
+typedef struct {
+    int fd;
+    off_t size;
+    size_t chunk_count;
+    atomic_size_t next_chunk;
+    pthread_mutex_t lock;
+    AudioStatsAccumulator total;
+    int status;
+} ChunkedFile;
+
+void *chunk_worker(void *arg) {
+    ChunkedFile *cf = arg;
+    AudioStatsAccumulator acc = {0};
+    int status = 0;
+    size_t chunk;
+
+    while (!status && (chunk = atomic_fetch_add(&cf->next_chunk, 1)) < cf->chunk_count) {
+        status = analyze_chunk(cf->fd, cf->size, chunk, &acc);
+    }
+
+    // Each worker reduces its own chunks; only the final merge is shared
+    pthread_mutex_lock(&cf->lock);
+    audio_stats_merge(&cf->total, &acc);
+    if (status && !cf->status) {
+        cf->status = status;
+    }
+    pthread_mutex_unlock(&cf->lock);
+    return NULL;
+}
+
+// Analyze one large file with every thread working on its chunks
+void analyze_file_parallel(BatchJob *job, long threads) {
+    ChunkedFile cf;
+    memset(&cf, 0, sizeof(cf));
+
+    cf.fd = open(job->path, O_RDONLY);
+    if (cf.fd < 0) {
+        job->status = errno;
+        return;
+    }
+    struct stat st;
+    if (fstat(cf.fd, &st) < 0) {
+        job->status = errno;
+        close(cf.fd);
+        return;
+    }
+    cf.size = job->size = st.st_size;
+    cf.chunk_count = (st.st_size + CHUNK_BYTES - 1) / CHUNK_BYTES;
+    atomic_init(&cf.next_chunk, 0);
+    pthread_mutex_init(&cf.lock, NULL);
+
+    if (threads > (long)cf.chunk_count) {
+        threads = cf.chunk_count ? cf.chunk_count : 1;
+    }
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    if (!tids) {
+        job->status = ENOMEM;
+        close(cf.fd);
+        return;
+    }
+    for (long i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, chunk_worker, &cf);
+    }
+    for (long i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    job->status = cf.status;
+    job->stats = audio_stats_result(&cf.total);
+    pthread_mutex_destroy(&cf.lock);
+    close(cf.fd);
+    free(tids);
+}
+
+void *batch_worker(void *arg) {
+    BatchWorker *w = arg;
+    BatchPool *pool = w->pool;
+    size_t job;
+
+    for (;;) {
+        if (deque_pop(&pool->deques[w->id], &job)) {
+            analyze_file(&pool->jobs[job]);
+            w->done++;
+            continue;
+        }
+
+        // Own deque is empty: try every other worker once, starting next door
+        int found = 0;
+        for (int i = 1; i < pool->workers && !found; i++) {
+            found = deque_steal(&pool->deques[(w->id + i) % pool->workers], &job);
+        }
+        if (!found) {
+            // Jobs are never added after start, so empty everywhere means done
+            return NULL;
+        }
+        analyze_file(&pool->jobs[job]);
+        w->done++;
+        w->stolen++;
+    }
+}
+
+static double level_db(double value) {
+    return value > 0 ? 20 * log10(value) : -INFINITY;
+}
+
+int write_results(const char *filename, const BatchJob *jobs, size_t count) {
+    FILE *f = fopen(filename, "w");
+    if (!f) {
+        printf("Error opening %s\n", filename);
+        return -1;
+    }
+    fprintf(f, "# Sample Rate: %d Hz, Channels: %d\n", SAMPLE_RATE, CHANNELS);
+    fprintf(f, "path\tduration_s\tpeak_db\taverage_db\trms_db\tclipping\n");
+    for (size_t i = 0; i < count; i++) {
+        const BatchJob *job = &jobs[i];
+        if (job->status) {
+            fprintf(f, "%s\terror: %s\n", job->path, strerror(job->status));
+            continue;
+        }
+        fprintf(f, "%s\t%.3f\t%.2f\t%.2f\t%.2f\t%d\n", job->path,
+                (double)job->size / (CHANNELS * sizeof(int16_t)) / SAMPLE_RATE,
+                level_db(job->stats.peak_amplitude), level_db(job->stats.average_amplitude),
+                level_db(job->stats.rms_level), job->stats.clipping_count);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int compare_jobs(const void *a, const void *b) {
+    return strcmp(((const BatchJob *)a)->path, ((const BatchJob *)b)->path);
+}
+
+int main(int argc, char **argv) {
+    const char *results = DEFAULT_RESULTS;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:o:e:")) != -1) {
+        switch (opt) {
+        case 'j': threads = atoi(optarg); break;
+        case 'o': results = optarg; break;
+        case 'e': extension = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-j threads] [-o results.tsv] [-e extension] directory|file\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-j threads] [-o results.tsv] [-e extension] directory|file\n", argv[0]);
+        return 1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    struct stat target;
+    if (stat(argv[optind], &target) < 0) {
+        perror("Error opening input");
+        return 1;
+    }
+    if (S_ISREG(target.st_mode)) {
+        BatchJob job = {0};
+        job.path = argv[optind];
+        printf("Analyzing %s in %ld MB chunks on %ld threads...\n",
+               job.path, CHUNK_BYTES >> 20, threads);
+        analyze_file_parallel(&job, threads);
+        if (job.status) {
+            printf("Error analyzing %s: %s\n", job.path, strerror(job.status));
+            return 1;
+        }
+        printf("\nAudio Analysis Results:\n");
+        printf("Peak Level: %.2f dB\n", level_db(job.stats.peak_amplitude));
+        printf("Average Level: %.2f dB\n", level_db(job.stats.average_amplitude));
+        printf("RMS Level: %.2f dB\n", level_db(job.stats.rms_level));
+        printf("Clipping Detected: %d instances\n", job.stats.clipping_count);
+        return write_results(results, &job, 1) < 0 ? 1 : 0;
+    }
+
+    if (nftw(argv[optind], collect_file, 64, FTW_PHYS) < 0) {
+        perror("Error walking directory");
+        return 1;
+    }
+    if (collected_count == 0) {
+        printf("No %s files found under %s\n", extension, argv[optind]);
+        return 0;
+    }
+    // Stable output order regardless of directory or scheduling order
+    qsort(collected, collected_count, sizeof(BatchJob), compare_jobs);
+
+    BatchPool pool;
+    pool.jobs = collected;
+    pool.job_count = collected_count;
+    pool.workers = threads;
+    pool.deques = calloc(threads, sizeof(WorkDeque));
+    BatchWorker *workers = calloc(threads, sizeof(BatchWorker));
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    size_t *items = malloc(collected_count * sizeof(size_t));
+    if (!pool.deques || !workers || !tids || !items) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("Analyzing %zu files on %ld threads...\n", collected_count, threads);
+
+    // Large files first, each spread over the whole pool; the rest are
+    // one file per worker. Slices cover only the files still to do.
+    size_t small_count = 0;
+    for (size_t i = 0; i < collected_count; i++) {
+        if (collected[i].size >= LARGE_FILE_BYTES) {
+            analyze_file_parallel(&collected[i], threads);
+        } else {
+            items[small_count++] = i;
+        }
+    }
+
+    // Deal contiguous slices so each worker starts on its own part of the tree
+    size_t per_worker = (small_count + threads - 1) / threads;
+    for (long w = 0; w < threads; w++) {
+        WorkDeque *dq = &pool.deques[w];
+        size_t first = w * per_worker < small_count ? w * per_worker : small_count;
+        size_t last = first + per_worker < small_count ? first + per_worker : small_count;
+        pthread_mutex_init(&dq->lock, NULL);
+        dq->items = items + first;
+        dq->top = 0;
+        dq->bottom = last - first;
+        // Owner pops from the back, so reverse to process its slice in order
+        for (size_t i = 0; i < dq->bottom / 2; i++) {
+            size_t tmp = dq->items[i];
+            dq->items[i] = dq->items[dq->bottom - 1 - i];
+            dq->items[dq->bottom - 1 - i] = tmp;
+        }
+    }
+
+    for (long w = 0; w < threads; w++) {
+        workers[w].pool = &pool;
+        workers[w].id = w;
+        pthread_create(&tids[w], NULL, batch_worker, &workers[w]);
+    }
+    size_t stolen = 0;
+    for (long w = 0; w < threads; w++) {
+        pthread_join(tids[w], NULL);
+        stolen += workers[w].stolen;
+    }
+
+    size_t failed = 0;
+    for (size_t i = 0; i < collected_count; i++) {
+        if (collected[i].status) {
+            failed++;
+        }
+    }
+
+    int err = write_results(results, collected, collected_count);
+    if (err == 0) {
+        printf("Results for %zu files (%zu failed, %zu stolen jobs) saved to %s\n",
+               collected_count, failed, stolen, results);
+    }
+
+    for (long w = 0; w < threads; w++) {
+        pthread_mutex_destroy(&pool.deques[w].lock);
+    }
+    for (size_t i = 0; i < collected_count; i++) {
+        free(collected[i].path);
+    }
+    free(collected);
+    free(items);
+    free(pool.deques);
+    free(workers);
+    free(tids);
+    return err < 0 ? 1 : 0;
+}
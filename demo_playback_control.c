@@ -2,11 +2,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "pcm_reconnect.h"
 
 #define PCM_DEVICE "default"
 #define DEFAULT_SAMPLE_RATE 44100
 #define DEFAULT_DURATION 5 // Default duration for recording
 #define MAX_CHANNELS 2
+#define PERIOD_FRAMES 512  // Playback period; controls how fast commands take effect
+#define PERIODS 4
+#define XFADE_MS 10        // Crossfade at loop boundaries and seeks
+#define RAMP_MS 5          // Fade out/in around pause
+#define RECONNECT_TIMEOUT_MS 10000 // How long to wait for an unplugged device to return
 
 int setup_pcm(snd_pcm_t **pcm_handle, int stream, int channels, unsigned int rate) {
     snd_pcm_hw_params_t *params;
@@ -29,6 +38,14 @@ int setup_pcm(snd_pcm_t **pcm_handle, int stream, int channels, unsigned int rat
     snd_pcm_hw_params_set_channels(*pcm_handle, params, channels);
     snd_pcm_hw_params_set_rate_near(*pcm_handle, params, &rate, 0);
 
+    // Small periods for playback so transport commands are responsive
+    if (stream == SND_PCM_STREAM_PLAYBACK) {
+        snd_pcm_uframes_t period = PERIOD_FRAMES;
+        snd_pcm_uframes_t buffer = PERIOD_FRAMES * PERIODS;
+        snd_pcm_hw_params_set_period_size_near(*pcm_handle, params, &period, 0);
+        snd_pcm_hw_params_set_buffer_size_near(*pcm_handle, params, &buffer);
+    }
+
     // Write parameters
     if (snd_pcm_hw_params(*pcm_handle, params) < 0) {
         fprintf(stderr, "Error setting PCM parameters\n");
@@ -48,6 +65,360 @@ void apply_volume(short *buffer, int size, float volume) {
     }
 }
 
+// Transport engine: a playback thread keeps the PCM running for the whole
+// session and renders one period at a time from the recorded buffer, while
+// the main thread takes commands from stdin. Commands are posted under a
+// lock and picked up at the next period boundary, so nothing ever waits on
+// user input and the device is never reopened.
+typedef enum {
+    TRANSPORT_PLAYING,
+    TRANSPORT_PAUSED,
+    TRANSPORT_QUIT
+} TransportState;
+
+typedef struct {
+    snd_pcm_t *handle;
+    const short *buffer;
+    int channels;
+    unsigned int rate;
+    long frames;
+    snd_pcm_uframes_t period_size;
+    int can_pause;
+    int xfade_frames;
+
+    // Shared with the command thread, protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    TransportState state;
+    long seek_to;           // -1 when no seek is pending
+    long loop_a;
+    long loop_b;
+    int loop_enabled;
+    long reported_pos;
+
+    // Owned by the playback thread
+    long pos;
+    long fade_from;         // position of the outgoing audio during a crossfade
+    int fade_left;
+    int fade_total;
+    short *period_buf;
+    PcmReconnect rc;
+} Transport;
+
+static float sample_at(const Transport *t, long frame, int ch) {
+    if (frame < 0 || frame >= t->frames) {
+        return 0.0f;
+    }
+    return t->buffer[frame * t->channels + ch];
+}
+
+// Start an equal-power crossfade from the current position to 'to'
+static void start_crossfade(Transport *t, long to, int length) {
+    t->fade_from = t->pos;
+    t->fade_total = length > 0 ? length : 1;
+    t->fade_left = t->fade_total;
+    t->pos = to;
+}
+
+// Render one period. Returns 1 if the end was reached without looping.
+static int render_period(Transport *t, long loop_a, long loop_b, int loop_enabled) {
+    short *out = t->period_buf;
+
+    for (snd_pcm_uframes_t i = 0; i < t->period_size; i++) {
+        if (t->fade_left == 0 && loop_enabled) {
+            if (t->pos >= loop_b) {
+                start_crossfade(t, loop_a, t->xfade_frames);
+            } else if (t->pos >= loop_b - t->xfade_frames) {
+                // Fade so that the outgoing side ends exactly at B
+                start_crossfade(t, loop_a, (int)(loop_b - t->pos));
+            }
+        }
+
+        if (t->fade_left == 0 && !loop_enabled && t->pos >= t->frames) {
+            memset(out + i * t->channels, 0, (t->period_size - i) * t->channels * sizeof(short));
+            return 1;
+        }
+
+        if (t->fade_left > 0) {
+            float x = (float)(t->fade_total - t->fade_left) / t->fade_total;
+            float gain_in = sqrtf(x);
+            float gain_out = sqrtf(1.0f - x);
+            for (int c = 0; c < t->channels; c++) {
+                float v = sample_at(t, t->fade_from, c) * gain_out + sample_at(t, t->pos, c) * gain_in;
+                if (v > 32767.0f) v = 32767.0f;
+                if (v < -32768.0f) v = -32768.0f;
+                out[i * t->channels + c] = (short)v;
+            }
+            t->fade_from++;
+            t->fade_left--;
+        } else {
+            for (int c = 0; c < t->channels; c++) {
+                out[i * t->channels + c] = (short)sample_at(t, t->pos, c);
+            }
+        }
+        t->pos++;
+    }
+    return 0;
+}
+
+// Linear ramp over the start (fade in) or end (fade out) of the period
+static void apply_ramp(Transport *t, int fade_in) {
+    int ramp = t->rate * RAMP_MS / 1000;
+    if (ramp > (int)t->period_size) {
+        ramp = t->period_size;
+    }
+    for (snd_pcm_uframes_t i = 0; i < t->period_size; i++) {
+        float g;
+        if (fade_in) {
+            g = i < (snd_pcm_uframes_t)ramp ? (float)i / ramp : 1.0f;
+        } else {
+            long from_end = t->period_size - i;
+            g = from_end <= ramp ? (float)(from_end - 1) / ramp : 1.0f;
+        }
+        for (int c = 0; c < t->channels; c++) {
+            t->period_buf[i * t->channels + c] = (short)(t->period_buf[i * t->channels + c] * g);
+        }
+    }
+}
+
+// The device went away mid-write: reopen it and move the position back over
+// everything it had queued, plus the unwritten rest of this period, so
+// playback resumes where the listener last heard it.
+static int reconnect(Transport *t, snd_pcm_uframes_t left) {
+    long unheard = t->rc.last_delay + (long)left;
+    int err;
+
+    fprintf(stderr, "\nDevice lost, waiting for it to come back...\n");
+    if ((err = pcm_reconnect_reopen(&t->rc, &t->handle, RECONNECT_TIMEOUT_MS)) < 0) {
+        fprintf(stderr, "Device did not come back: %s\n", snd_strerror(err));
+        return err;
+    }
+    t->pos = t->pos > unheard ? t->pos - unheard : 0;
+    t->fade_left = 0;
+    fprintf(stderr, "Reconnected in %.0f ms, resuming at %.2f s\n",
+            t->rc.last_recovery_ms, (float)t->pos / t->rate);
+    return 0;
+}
+
+// Returns 1 if the period was dropped because the device was reconnected
+static int write_period(Transport *t) {
+    snd_pcm_uframes_t left = t->period_size;
+    short *ptr = t->period_buf;
+    while (left > 0) {
+        int frames_written = snd_pcm_writei(t->handle, ptr, left);
+        if (frames_written < 0) {
+            if (frames_written == -EPIPE) {
+                fprintf(stderr, "Buffer underrun occurred, preparing the device...\n");
+                snd_pcm_prepare(t->handle);
+                continue;
+            }
+            if (pcm_reconnect_lost(frames_written)) {
+                int err = reconnect(t, left);
+                return err < 0 ? err : 1;
+            }
+            fprintf(stderr, "Error writing audio: %s\n", snd_strerror(frames_written));
+            return frames_written;
+        }
+        left -= frames_written;
+        ptr += frames_written * t->channels;
+        pcm_reconnect_track(&t->rc, t->handle);
+    }
+    return 0;
+}
+
+// Sleep until no more than 'frames' are queued ahead of the speaker
+static void wait_queued(Transport *t, snd_pcm_sframes_t frames) {
+    snd_pcm_sframes_t delay;
+    while (snd_pcm_delay(t->handle, &delay) == 0 && delay > frames) {
+        usleep((delay - frames) * 1000000LL / t->rate);
+    }
+}
+
+// Queue one period of silence; returns what write_period() returns
+static int write_silence(Transport *t) {
+    memset(t->period_buf, 0, t->period_size * t->channels * sizeof(short));
+    return write_period(t);
+}
+
+void *transport_thread(void *arg) {
+    Transport *t = arg;
+    int ramp_in = 0;
+    int faded_out = 0;      // the last period written ends in silence
+
+    for (;;) {
+        pthread_mutex_lock(&t->lock);
+        TransportState state = t->state;
+        if (t->seek_to >= 0) {
+            start_crossfade(t, t->seek_to, t->xfade_frames);
+            t->seek_to = -1;
+        }
+        long loop_a = t->loop_a;
+        long loop_b = t->loop_b;
+        int loop_enabled = t->loop_enabled;
+        pthread_mutex_unlock(&t->lock);
+
+        if (state == TRANSPORT_QUIT) {
+            break;
+        }
+
+        if (state == TRANSPORT_PAUSED) {
+            if (!faded_out) {
+                // The pause came in while the last period was being written:
+                // fade the next one out before stopping
+                render_period(t, loop_a, loop_b, loop_enabled);
+                apply_ramp(t, 0);
+                faded_out = 1;
+                if (write_period(t) < 0) {
+                    break;
+                }
+                continue;
+            }
+            if (t->can_pause && snd_pcm_state(t->handle) == SND_PCM_STATE_RUNNING) {
+                // Hardware pause stops wherever the hardware pointer is, so
+                // follow the fade with silence and let the queue play out
+                // up to it: the device then freezes on silence, and on
+                // resume only that silence is left ahead of the fade-in.
+                if (write_silence(t) < 0) {
+                    break;
+                }
+                wait_queued(t, t->period_size);
+                snd_pcm_pause(t->handle, 1);
+                pthread_mutex_lock(&t->lock);
+                while (t->state == TRANSPORT_PAUSED) {
+                    pthread_cond_wait(&t->cond, &t->lock);
+                }
+                pthread_mutex_unlock(&t->lock);
+                snd_pcm_pause(t->handle, 0);
+            } else {
+                // No hardware pause: keep the stream alive with silence
+                if (write_silence(t) < 0) {
+                    break;
+                }
+            }
+            ramp_in = 1;
+            continue;
+        }
+
+        int ended = render_period(t, loop_a, loop_b, loop_enabled);
+        if (ramp_in) {
+            apply_ramp(t, 1);
+            ramp_in = 0;
+        }
+
+        // If a pause arrived while rendering, fade this period out
+        pthread_mutex_lock(&t->lock);
+        int pausing = t->state == TRANSPORT_PAUSED;
+        if (ended && t->state == TRANSPORT_PLAYING) {
+            t->state = TRANSPORT_PAUSED;
+            t->pos = 0;
+            printf("\nPlayback completed, paused at start ('p' to replay)\n");
+        }
+        t->reported_pos = t->pos;
+        pthread_mutex_unlock(&t->lock);
+        if (pausing) {
+            apply_ramp(t, 0);
+        }
+        faded_out = pausing || ended;
+
+        if (write_period(t) < 0) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static long seconds_to_frame(const Transport *t, float seconds) {
+    long frame = (long)(seconds * t->rate);
+    if (frame < 0) frame = 0;
+    if (frame > t->frames) frame = t->frames;
+    return frame;
+}
+
+static void print_help(void) {
+    printf("Commands:\n");
+    printf("  p          pause / resume\n");
+    printf("  s <sec>    seek\n");
+    printf("  a <sec>    set loop start (A)\n");
+    printf("  b <sec>    set loop end (B)\n");
+    printf("  l          toggle looping\n");
+    printf("  t          show position\n");
+    printf("  q          quit\n");
+}
+
+// Read commands from stdin and post them to the transport
+void transport_commands(Transport *t) {
+    char line[64];
+
+    print_help();
+    while (fgets(line, sizeof(line), stdin)) {
+        char cmd;
+        float seconds = 0;
+        int args = sscanf(line, " %c %f", &cmd, &seconds);
+        if (args < 1) {
+            continue;
+        }
+
+        pthread_mutex_lock(&t->lock);
+        switch (cmd) {
+        case 'p':
+            if (t->state == TRANSPORT_PAUSED) {
+                t->state = TRANSPORT_PLAYING;
+                pthread_cond_signal(&t->cond);
+            } else {
+                t->state = TRANSPORT_PAUSED;
+            }
+            printf("%s\n", t->state == TRANSPORT_PAUSED ? "Paused" : "Playing");
+            break;
+        case 's':
+            if (args == 2) {
+                t->seek_to = seconds_to_frame(t, seconds);
+                printf("Seek to %.2f s\n", (float)t->seek_to / t->rate);
+            }
+            break;
+        case 'a':
+        case 'b':
+            if (args == 2) {
+                long frame = seconds_to_frame(t, seconds);
+                if (cmd == 'a') t->loop_a = frame; else t->loop_b = frame;
+                if (t->loop_b - t->loop_a < 2 * t->xfade_frames) {
+                    printf("Loop too short, need at least %d ms\n", 2 * XFADE_MS);
+                    if (cmd == 'a') t->loop_a = 0; else t->loop_b = t->frames;
+                }
+                t->loop_enabled = 1;
+                printf("Loop %.2f s - %.2f s\n", (float)t->loop_a / t->rate, (float)t->loop_b / t->rate);
+            }
+            break;
+        case 'l':
+            t->loop_enabled = !t->loop_enabled;
+            printf("Looping %s\n", t->loop_enabled ? "on" : "off");
+            break;
+        case 't':
+            printf("Position %.2f s / %.2f s%s\n", (float)t->reported_pos / t->rate,
+                   (float)t->frames / t->rate, t->state == TRANSPORT_PAUSED ? " (paused)" : "");
+            break;
+        case 'q':
+            t->state = TRANSPORT_QUIT;
+            pthread_cond_signal(&t->cond);
+            break;
+        default:
+            print_help();
+            break;
+        }
+        int quit = t->state == TRANSPORT_QUIT;
+        pthread_mutex_unlock(&t->lock);
+        if (quit) {
+            return;
+        }
+    }
+
+    // stdin closed
+    pthread_mutex_lock(&t->lock);
+    t->state = TRANSPORT_QUIT;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+}
+
 int main() {
     snd_pcm_t *capture_handle, *playback_handle;
     int err;
@@ -100,7 +471,7 @@ int main() {
     }
 
     printf("Recording for %d seconds...\n", duration);
-    
+
     if (snd_pcm_readi(capture_handle, buffer, rate * duration) < 0) {
         fprintf(stderr, "Error recording audio\n");
         snd_pcm_close(capture_handle);
@@ -118,41 +489,60 @@ int main() {
         return -1;
     }
 
-    // Loop playback option
-    char loop_choice;
-    do {
-        printf("Playing back recorded audio at volume %.2f...\n", volume);
-        
-        int frames_to_play = rate * duration;
-        int frames_written;
-
-        while (frames_to_play > 0) {
-            frames_written = snd_pcm_writei(playback_handle, buffer, frames_to_play);
-            if (frames_written < 0) {
-                fprintf(stderr, "Error writing audio: %s\n", snd_strerror(frames_written));
-                if (frames_written == -EPIPE) {
-                    // Buffer overrun
-                    fprintf(stderr, "Buffer underrun occurred, preparing the device...\n");
-                    snd_pcm_prepare(playback_handle);
-                } else {
-                    // Other error
-                    snd_pcm_close(playback_handle);
-                    free(buffer);
-                    return -1;
-                }
-            }
-            frames_to_play -= frames_written;
-        }
+    Transport transport = {0};
+    transport.handle = playback_handle;
+    transport.buffer = buffer;
+    transport.channels = channels;
+    transport.rate = rate;
+    transport.frames = (long)rate * duration;
+    transport.xfade_frames = rate * XFADE_MS / 1000;
+    transport.state = TRANSPORT_PLAYING;
+    transport.seek_to = -1;
+    transport.loop_a = 0;
+    transport.loop_b = transport.frames;
+    transport.loop_enabled = 1;
 
-        printf("Playback completed. Press 'q' to quit or any other key to replay: ");
-        scanf(" %c", &loop_choice);
-    } while (loop_choice != 'q');
+    snd_pcm_hw_params_t *params;
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_current(playback_handle, params);
+    snd_pcm_hw_params_get_period_size(params, &transport.period_size, 0);
+    transport.can_pause = snd_pcm_hw_params_can_pause(params);
+    pcm_reconnect_save(&transport.rc, playback_handle, PCM_DEVICE, SND_PCM_STREAM_PLAYBACK);
 
-    snd_pcm_drain(playback_handle);
-    snd_pcm_close(playback_handle);
+    transport.period_buf = malloc(transport.period_size * channels * sizeof(short));
+    if (!transport.period_buf) {
+        fprintf(stderr, "Failed to allocate period buffer\n");
+        snd_pcm_close(playback_handle);
+        free(buffer);
+        return -1;
+    }
+    pthread_mutex_init(&transport.lock, NULL);
+    pthread_cond_init(&transport.cond, NULL);
+
+    printf("Playing back recorded audio at volume %.2f (looping, %s pause)...\n",
+           volume, transport.can_pause ? "hardware" : "software");
+
+    pthread_t playback_thread;
+    if ((err = pthread_create(&playback_thread, NULL, transport_thread, &transport)) != 0) {
+        fprintf(stderr, "Failed to start playback thread\n");
+        snd_pcm_close(playback_handle);
+        free(transport.period_buf);
+        free(buffer);
+        return -1;
+    }
+
+    transport_commands(&transport);
+    pthread_join(playback_thread, NULL);
+
+    // The transport may have reopened the device; close whatever it holds now
+    if (transport.handle) {
+        snd_pcm_drop(transport.handle);
+        snd_pcm_close(transport.handle);
+    }
+    pthread_mutex_destroy(&transport.lock);
+    pthread_cond_destroy(&transport.cond);
+    free(transport.period_buf);
     free(buffer);
 
     return 0;
 }
-
-
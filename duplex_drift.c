@@ -0,0 +1,423 @@
+#include <alsa/asoundlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "audio_drift.h"
+#include "pcm_reconnect.h"
+
+// Full-duplex loopback between two different USB devices. The capture and
+// playback cards each run on their own crystal, so a plain read/write loop
+// slowly fills up or drains its buffer until it xruns. Here the relative
+// rate is measured from snd_pcm_status timestamps on both sides and fed
+// forward into a fine-ratio resampler, and a PI controller on the total
+// latency (ring fill + playback delay) trims what the estimate misses. The
+// loop can run indefinitely with latency held around the target. If either
+// card is unplugged the loop waits for it to come back rather than exiting;
+// name devices as "plughw:CARD=<id>,0" so the name survives re-enumeration.
+//
+// Usage: duplex_drift [-c capture_dev] [-p playback_dev] [-l target_ms] [-g gain]
+
+#define SAMPLE_RATE   44100
+#define CHANNELS      2
+#define PERIOD_FRAMES 256
+#define PERIODS       4
+#define RING_FRAMES   16384          // power of two
+#define DEFAULT_TARGET_MS 30
+#define RECONNECT_TIMEOUT_MS 10000  // how long to wait for an unplugged device to return
+
+typedef struct {
+    int16_t data[RING_FRAMES * CHANNELS];
+    atomic_size_t head;              // written by capture thread
+    atomic_size_t tail;              // written by playback thread
+} FrameRing;
+
+typedef struct {
+    const char *capture_name;
+    const char *playback_name;
+    snd_pcm_t *capture;
+    snd_pcm_t *playback;
+    PcmReconnect capture_rc;
+    PcmReconnect playback_rc;
+    snd_pcm_uframes_t period_size;
+    unsigned int rate;
+    float gain;
+    double target_latency;           // frames
+    FrameRing ring;
+
+    pthread_mutex_t lock;            // protects estimator
+    DriftEstimator estimator;
+    RateController pi;
+
+    // Statistics for the status line
+    volatile double ratio;
+    volatile double latency;
+    volatile long capture_xruns;
+    volatile long playback_xruns;
+    volatile long ring_overflows;
+    volatile long ring_underflows;
+} DuplexState;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_sigint(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static size_t ring_fill(FrameRing *ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+           atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+static size_t ring_write(FrameRing *ring, const int16_t *frames, size_t count) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t space = RING_FRAMES - (head - tail);
+    if (count > space) {
+        count = space;
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t idx = (head + i) & (RING_FRAMES - 1);
+        memcpy(&ring->data[idx * CHANNELS], &frames[i * CHANNELS], CHANNELS * sizeof(int16_t));
+    }
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+}
+
+// Contiguous readable region starting at tail
+static const int16_t *ring_peek(FrameRing *ring, size_t *count) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t idx = tail & (RING_FRAMES - 1);
+    size_t avail = head - tail;
+    if (avail > RING_FRAMES - idx) {
+        avail = RING_FRAMES - idx;
+    }
+    *count = avail;
+    return &ring->data[idx * CHANNELS];
+}
+
+static void ring_consume(FrameRing *ring, size_t count) {
+    atomic_fetch_add_explicit(&ring->tail, count, memory_order_release);
+}
+
+// Wait for an unplugged device to come back; *handle is NULL on failure
+static int reconnect(PcmReconnect *rc, snd_pcm_t **handle) {
+    fprintf(stderr, "\n%s lost, waiting for it to come back...\n", rc->name);
+    int err = pcm_reconnect_reopen(rc, handle, RECONNECT_TIMEOUT_MS);
+    if (err < 0) {
+        fprintf(stderr, "%s did not come back: %s\n", rc->name, snd_strerror(err));
+        return err;
+    }
+    fprintf(stderr, "%s reconnected in %.0f ms\n", rc->name, rc->last_recovery_ms);
+    return 0;
+}
+
+static double ts_seconds(const snd_htimestamp_t *ts) {
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+void apply_volume(short *buffer, int size, float volume) {
+    for (int i = 0; i < size / sizeof(short); i++) {
+        int sample = (int)(buffer[i] * volume);
+        if (sample > 32767) sample = 32767;
+        if (sample < -32768) sample = -32768;
+        buffer[i] = (short)sample;
+    }
+}
+
+int setup_pcm(snd_pcm_t **handle, const char *device, snd_pcm_stream_t stream,
+              unsigned int rate, snd_pcm_uframes_t *period_size) {
+    snd_pcm_hw_params_t *params;
+    snd_pcm_sw_params_t *sw_params;
+    int err;
+
+    if ((err = snd_pcm_open(handle, device, stream, 0)) < 0) {
+        fprintf(stderr, "Cannot open audio device %s: %s\n", device, snd_strerror(err));
+        return err;
+    }
+
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(*handle, params);
+    snd_pcm_hw_params_set_access(*handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    snd_pcm_hw_params_set_format(*handle, params, SND_PCM_FORMAT_S16_LE);
+    snd_pcm_hw_params_set_channels(*handle, params, CHANNELS);
+    snd_pcm_hw_params_set_rate_resample(*handle, params, 0);
+    snd_pcm_hw_params_set_rate_near(*handle, params, &rate, 0);
+    snd_pcm_uframes_t period = *period_size;
+    snd_pcm_hw_params_set_period_size_near(*handle, params, &period, 0);
+    snd_pcm_uframes_t buffer = period * PERIODS;
+    snd_pcm_hw_params_set_buffer_size_near(*handle, params, &buffer);
+
+    if ((err = snd_pcm_hw_params(*handle, params)) < 0) {
+        fprintf(stderr, "Cannot set parameters on %s: %s\n", device, snd_strerror(err));
+        snd_pcm_close(*handle);
+        return err;
+    }
+    snd_pcm_hw_params_get_period_size(params, period_size, 0);
+
+    snd_pcm_sw_params_alloca(&sw_params);
+    snd_pcm_sw_params_current(*handle, sw_params);
+    snd_pcm_sw_params_set_tstamp_mode(*handle, sw_params, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params_set_tstamp_type(*handle, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+    if (stream == SND_PCM_STREAM_PLAYBACK) {
+        snd_pcm_sw_params_set_start_threshold(*handle, sw_params, *period_size * 2);
+    }
+    if ((err = snd_pcm_sw_params(*handle, sw_params)) < 0) {
+        fprintf(stderr, "Cannot set sw parameters on %s: %s\n", device, snd_strerror(err));
+        snd_pcm_close(*handle);
+        return err;
+    }
+    return 0;
+}
+
+void *capture_thread(void *arg) {
+    DuplexState *st = arg;
+    snd_pcm_status_t *status;
+    int16_t *buffer = malloc(st->period_size * CHANNELS * sizeof(int16_t));
+    unsigned long long captured = 0;
+    int err;
+
+    snd_pcm_status_alloca(&status);
+    snd_pcm_start(st->capture);
+
+    while (!stop_requested) {
+        err = snd_pcm_readi(st->capture, buffer, st->period_size);
+        if (err == -EPIPE) {
+            st->capture_xruns++;
+            snd_pcm_prepare(st->capture);
+            snd_pcm_start(st->capture);
+            pthread_mutex_lock(&st->lock);
+            clock_tracker_reset(&st->estimator.capture);
+            pthread_mutex_unlock(&st->lock);
+            continue;
+        } else if (pcm_reconnect_lost(err)) {
+            // The new device has its own clock; start measuring it afresh
+            if (reconnect(&st->capture_rc, &st->capture) < 0) {
+                stop_requested = 1;
+                break;
+            }
+            snd_pcm_start(st->capture);
+            pthread_mutex_lock(&st->lock);
+            clock_tracker_reset(&st->estimator.capture);
+            pthread_mutex_unlock(&st->lock);
+            continue;
+        } else if (err < 0) {
+            fprintf(stderr, "Read error: %s\n", snd_strerror(err));
+            stop_requested = 1;
+            break;
+        }
+        captured += err;
+
+        if (st->gain != 1.0f) {
+            apply_volume(buffer, err * CHANNELS * sizeof(int16_t), st->gain);
+        }
+        if (ring_write(&st->ring, buffer, err) < (size_t)err) {
+            st->ring_overflows++;
+        }
+
+        // Hardware capture position at the status timestamp
+        if (snd_pcm_status(st->capture, status) == 0) {
+            snd_htimestamp_t ts;
+            snd_pcm_status_get_htstamp(status, &ts);
+            double pos = (double)captured + snd_pcm_status_get_avail(status);
+            pthread_mutex_lock(&st->lock);
+            clock_tracker_update(&st->estimator.capture, ts_seconds(&ts), pos);
+            pthread_mutex_unlock(&st->lock);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Pull one period out of the ring through the resampler; silence if the
+// ring runs dry.
+static void render_period(DuplexState *st, FracResampler *rs, int16_t *out) {
+    size_t produced = 0;
+    while (produced < st->period_size) {
+        size_t avail, consumed;
+        const int16_t *in = ring_peek(&st->ring, &avail);
+        if (avail == 0) {
+            st->ring_underflows++;
+            memset(out + produced * CHANNELS, 0, (st->period_size - produced) * CHANNELS * sizeof(int16_t));
+            return;
+        }
+        produced += resampler_process(rs, in, avail, &consumed,
+                                      out + produced * CHANNELS, st->period_size - produced);
+        ring_consume(&st->ring, consumed);
+    }
+}
+
+void *playback_thread(void *arg) {
+    DuplexState *st = arg;
+    snd_pcm_status_t *status;
+    int16_t *buffer = malloc(st->period_size * CHANNELS * sizeof(int16_t));
+    unsigned long long written = 0;
+    double max_latency = st->target_latency + st->period_size * PERIODS;
+    FracResampler rs;
+    int err;
+
+    snd_pcm_status_alloca(&status);
+    resampler_init(&rs, CHANNELS);
+
+    // Let the ring reach the target before the first write
+    while (!stop_requested && ring_fill(&st->ring) < st->target_latency / 2) {
+        usleep(1000);
+    }
+
+    while (!stop_requested) {
+        render_period(st, &rs, buffer);
+
+        snd_pcm_uframes_t left = st->period_size;
+        int16_t *ptr = buffer;
+        while (left > 0 && !stop_requested) {
+            err = snd_pcm_writei(st->playback, ptr, left);
+            if (err == -EPIPE) {
+                st->playback_xruns++;
+                snd_pcm_prepare(st->playback);
+                pthread_mutex_lock(&st->lock);
+                clock_tracker_reset(&st->estimator.playback);
+                pthread_mutex_unlock(&st->lock);
+                continue;
+            } else if (pcm_reconnect_lost(err)) {
+                // Audio queued on the old device is dropped, not replayed:
+                // in a live loop it would only add latency
+                if (reconnect(&st->playback_rc, &st->playback) < 0) {
+                    stop_requested = 1;
+                    break;
+                }
+                pthread_mutex_lock(&st->lock);
+                clock_tracker_reset(&st->estimator.playback);
+                pthread_mutex_unlock(&st->lock);
+                rate_controller_reset(&st->pi);
+                continue;
+            } else if (err < 0) {
+                fprintf(stderr, "Write error: %s\n", snd_strerror(err));
+                stop_requested = 1;
+                break;
+            }
+            written += err;
+            left -= err;
+            ptr += err * CHANNELS;
+        }
+
+        if (stop_requested || snd_pcm_status(st->playback, status) < 0 ||
+            snd_pcm_status_get_state(status) != SND_PCM_STATE_RUNNING) {
+            continue;
+        }
+
+        snd_htimestamp_t ts;
+        snd_pcm_status_get_htstamp(status, &ts);
+        double delay = snd_pcm_status_get_delay(status);
+        double fill = ring_fill(&st->ring);
+        double latency = fill + resampler_latency(&rs) + delay;
+
+        // Hard bound: if something stalled, throw the excess away at once
+        if (latency > max_latency) {
+            double excess = latency - st->target_latency;
+            ring_consume(&st->ring, (size_t)(excess < fill ? excess : fill));
+            rate_controller_reset(&st->pi);
+            latency = st->target_latency;
+        }
+
+        pthread_mutex_lock(&st->lock);
+        clock_tracker_update(&st->estimator.playback, ts_seconds(&ts), (double)written - delay);
+        double drift = drift_estimator_ratio(&st->estimator);
+        pthread_mutex_unlock(&st->lock);
+
+        // Too little buffered means we are consuming too fast
+        rs.ratio = drift * rate_controller_update(&st->pi, st->target_latency - latency);
+        st->ratio = rs.ratio;
+        st->latency = latency;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    static DuplexState st;
+    pthread_t capture_tid, playback_tid;
+    int target_ms = DEFAULT_TARGET_MS;
+    int opt;
+
+    st.capture_name = "default";
+    st.playback_name = "default";
+    st.gain = 1.0f;
+    st.rate = SAMPLE_RATE;
+
+    while ((opt = getopt(argc, argv, "c:p:l:g:")) != -1) {
+        switch (opt) {
+        case 'c': st.capture_name = optarg; break;
+        case 'p': st.playback_name = optarg; break;
+        case 'l': target_ms = atoi(optarg); break;
+        case 'g': st.gain = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-c capture_dev] [-p playback_dev] [-l target_ms] [-g gain]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    snd_pcm_uframes_t capture_period = PERIOD_FRAMES;
+    snd_pcm_uframes_t playback_period = PERIOD_FRAMES;
+    if (setup_pcm(&st.capture, st.capture_name, SND_PCM_STREAM_CAPTURE, st.rate, &capture_period) < 0) {
+        return 1;
+    }
+    if (setup_pcm(&st.playback, st.playback_name, SND_PCM_STREAM_PLAYBACK, st.rate, &playback_period) < 0) {
+        snd_pcm_close(st.capture);
+        return 1;
+    }
+    pcm_reconnect_save(&st.capture_rc, st.capture, st.capture_name, SND_PCM_STREAM_CAPTURE);
+    pcm_reconnect_save(&st.playback_rc, st.playback, st.playback_name, SND_PCM_STREAM_PLAYBACK);
+    st.period_size = playback_period > capture_period ? playback_period : capture_period;
+    st.target_latency = (double)st.rate * target_ms / 1000.0;
+    if (st.target_latency < st.period_size * 3) {
+        st.target_latency = st.period_size * 3;
+    }
+
+    pthread_mutex_init(&st.lock, NULL);
+    drift_estimator_init(&st.estimator, st.rate);
+    // Gains per playback period: 1 frame of latency error moves the rate by ~1 ppm
+    rate_controller_init(&st.pi, 1e-6, 5e-9, 0.001);
+    st.ratio = 1.0;
+
+    signal(SIGINT, handle_sigint);
+
+    printf("Loopback %s -> %s, target latency %.1f ms, Ctrl+C to stop\n",
+           st.capture_name, st.playback_name, st.target_latency * 1000.0 / st.rate);
+
+    pthread_create(&capture_tid, NULL, capture_thread, &st);
+    pthread_create(&playback_tid, NULL, playback_thread, &st);
+
+    while (!stop_requested) {
+        sleep(1);
+        pthread_mutex_lock(&st.lock);
+        double drift = drift_estimator_ratio(&st.estimator);
+        pthread_mutex_unlock(&st.lock);
+        printf("drift %+7.1f ppm, ratio %+7.1f ppm, latency %6.2f ms, xruns %ld/%ld, ring over/under %ld/%ld\n",
+               (drift - 1.0) * 1e6, (st.ratio - 1.0) * 1e6, st.latency * 1000.0 / st.rate,
+               st.capture_xruns, st.playback_xruns, st.ring_overflows, st.ring_underflows);
+    }
+
+    pthread_join(capture_tid, NULL);
+    pthread_join(playback_tid, NULL);
+
+    if (st.capture) {
+        snd_pcm_drop(st.capture);
+        snd_pcm_close(st.capture);
+    }
+    if (st.playback) {
+        snd_pcm_drain(st.playback);
+        snd_pcm_close(st.playback);
+    }
+    pthread_mutex_destroy(&st.lock);
+    return 0;
+}
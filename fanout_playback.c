@@ -0,0 +1,475 @@
+#include <alsa/asoundlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "audio_drift.h"
+#include "pcm_reconnect.h"
+
+// Fan-out playback: render one program once and play it on every matched
+// USB audio card at the same time. Each output runs on its own thread with
+// its own fine-ratio resampler, steered by a PI controller so that what the
+// device actually plays (written position minus measured delay) tracks a
+// shared CLOCK_MONOTONIC timeline. All outputs follow the same host clock,
+// so they stay sample-aligned with each other for as long as they run.
+//
+// Usage: fanout_playback [-f file.raw] [-g gain] [-l] [device ...]
+// Without devices, every card whose USB id is in fanout_ids[] is used.
+//
+// An output that is unplugged waits for its card to come back, reopens it
+// with the same configuration and rejoins the shared timeline; the others
+// keep playing meanwhile.
+
+#define SAMPLE_RATE   44100
+#define CHANNELS      2
+#define DURATION      5      // seconds of test tone when no file is given
+#define FREQ          440    // Hz
+#define PERIOD_FRAMES 512
+#define PERIODS       4
+#define MAX_OUTPUTS   8
+#define STEP_THRESHOLD_MS 20 // larger errors are fixed by a jump, not by resampling
+#define RECONNECT_TIMEOUT_MS 10000
+
+// Same ids as snd_my_audio_ids[] in usb_audio.c
+static const struct { unsigned short vendor, product; } fanout_ids[] = {
+    { 0x0c76, 0x1203 },
+};
+
+typedef struct {
+    const int16_t *frames;
+    long long frame_count;
+    int loop;
+    unsigned int rate;
+    struct timespec t0;          // monotonic time at which source frame 0 is heard
+    pthread_barrier_t start;
+} FanoutSource;
+
+typedef struct {
+    char name[32];
+    snd_pcm_t *handle;
+    pthread_t thread;
+    FanoutSource *src;
+    FracResampler rs;
+    RateController pi;
+    snd_pcm_uframes_t period_size;
+    snd_pcm_uframes_t buffer_size;
+    long long read_pos;          // next source frame fed to the resampler (may be < 0)
+    int16_t *in_buf;
+    int16_t *out_buf;
+    PcmReconnect rc;
+    // Written by the output thread, read by the status printer
+    volatile double ratio;
+    volatile double error;
+    volatile long xruns;
+    volatile long jumps;
+    volatile int finished;
+} FanoutOutput;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_sigint(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+void apply_volume(short *buffer, int size, float volume) {
+    for (int i = 0; i < size / sizeof(short); i++) {
+        int sample = (int)(buffer[i] * volume);
+        if (sample > 32767) sample = 32767;
+        if (sample < -32768) sample = -32768;
+        buffer[i] = (short)sample;
+    }
+}
+
+// Generate test tone
+void generate_sine_wave(int16_t *buffer, int samples) {
+    for (int i = 0; i < samples; i++) {
+        double time = (double)i / SAMPLE_RATE;
+        double value = sin(2.0 * M_PI * FREQ * time);
+        int16_t sample = (int16_t)(value * 32767 * 0.5); // 50% amplitude
+        buffer[i * 2] = sample;     // Left channel
+        buffer[i * 2 + 1] = sample; // Right channel
+    }
+}
+
+static double ts_diff(const struct timespec *a, const struct timespec *b) {
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+// Find every card whose USB id matches fanout_ids[]. Both snd-usb-audio and
+// our own my_usb_audio publish it as "vvvv:pppp" in /proc/asound/cardN/usbid;
+// my_usb_audio only does so from the version that added that proc entry, so
+// cards driven by an older build are not found. Outputs are named by card id
+// rather than number so they can be reopened after a reconnect, when the
+// number may have changed.
+int find_usb_outputs(FanoutOutput *outputs, int max_outputs) {
+    int card = -1;
+    int count = 0;
+
+    while (snd_card_next(&card) == 0 && card >= 0 && count < max_outputs) {
+        char path[64];
+        unsigned int vendor, product;
+        snprintf(path, sizeof(path), "/proc/asound/card%d/usbid", card);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            continue;
+        }
+        int ok = fscanf(f, "%x:%x", &vendor, &product) == 2;
+        fclose(f);
+        if (!ok) {
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(fanout_ids) / sizeof(fanout_ids[0]); i++) {
+            if (fanout_ids[i].vendor == vendor && fanout_ids[i].product == product) {
+                char card_id[20] = "";
+                snprintf(path, sizeof(path), "/proc/asound/card%d/id", card);
+                f = fopen(path, "r");
+                if (f) {
+                    if (fscanf(f, "%19s", card_id) != 1) {
+                        card_id[0] = '\0';
+                    }
+                    fclose(f);
+                }
+                if (card_id[0]) {
+                    snprintf(outputs[count].name, sizeof(outputs[count].name), "plughw:CARD=%s,0", card_id);
+                } else {
+                    snprintf(outputs[count].name, sizeof(outputs[count].name), "plughw:%d,0", card);
+                }
+                count++;
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+int setup_output(FanoutOutput *out, unsigned int rate) {
+    snd_pcm_hw_params_t *params;
+    snd_pcm_sw_params_t *sw_params;
+    int err;
+
+    if ((err = snd_pcm_open(&out->handle, out->name, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", out->name, snd_strerror(err));
+        return err;
+    }
+
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_hw_params_any(out->handle, params);
+    snd_pcm_hw_params_set_access(out->handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    snd_pcm_hw_params_set_format(out->handle, params, SND_PCM_FORMAT_S16_LE);
+    snd_pcm_hw_params_set_channels(out->handle, params, CHANNELS);
+    // Drift is our job; never let the plug layer resample behind our back
+    snd_pcm_hw_params_set_rate_resample(out->handle, params, 0);
+    unsigned int actual_rate = rate;
+    snd_pcm_hw_params_set_rate_near(out->handle, params, &actual_rate, 0);
+    out->period_size = PERIOD_FRAMES;
+    snd_pcm_hw_params_set_period_size_near(out->handle, params, &out->period_size, 0);
+    out->buffer_size = out->period_size * PERIODS;
+    snd_pcm_hw_params_set_buffer_size_near(out->handle, params, &out->buffer_size);
+
+    if ((err = snd_pcm_hw_params(out->handle, params)) < 0) {
+        fprintf(stderr, "Cannot set parameters on %s: %s\n", out->name, snd_strerror(err));
+        snd_pcm_close(out->handle);
+        return err;
+    }
+    if (actual_rate != rate) {
+        fprintf(stderr, "%s does not support %u Hz natively\n", out->name, rate);
+        snd_pcm_close(out->handle);
+        return -EINVAL;
+    }
+    snd_pcm_hw_params_get_period_size(params, &out->period_size, 0);
+    snd_pcm_hw_params_get_buffer_size(params, &out->buffer_size);
+
+    // Monotonic status timestamps so delays can be placed on the shared timeline
+    snd_pcm_sw_params_alloca(&sw_params);
+    snd_pcm_sw_params_current(out->handle, sw_params);
+    snd_pcm_sw_params_set_tstamp_mode(out->handle, sw_params, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params_set_tstamp_type(out->handle, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+    snd_pcm_sw_params_set_start_threshold(out->handle, sw_params, out->buffer_size - out->period_size);
+    if ((err = snd_pcm_sw_params(out->handle, sw_params)) < 0) {
+        fprintf(stderr, "Cannot set sw parameters on %s: %s\n", out->name, snd_strerror(err));
+        snd_pcm_close(out->handle);
+        return err;
+    }
+    pcm_reconnect_save(&out->rc, out->handle, out->name, SND_PCM_STREAM_PLAYBACK);
+
+    out->in_buf = malloc(out->period_size * 2 * CHANNELS * sizeof(int16_t));
+    out->out_buf = malloc(out->period_size * CHANNELS * sizeof(int16_t));
+    if (!out->in_buf || !out->out_buf) {
+        fprintf(stderr, "Cannot allocate buffers for %s\n", out->name);
+        free(out->in_buf);
+        free(out->out_buf);
+        out->in_buf = NULL;
+        out->out_buf = NULL;
+        snd_pcm_close(out->handle);
+        return -ENOMEM;
+    }
+
+    resampler_init(&out->rs, CHANNELS);
+    // Gains are per period: 1 frame of error moves the rate by ~2 ppm
+    rate_controller_init(&out->pi, 2e-6, 2e-8, 0.002);
+    out->ratio = 1.0;
+    return 0;
+}
+
+// Copy source frames [pos, pos + frames) into dst, with silence before the
+// start and after the end (unless looping).
+static void read_source(const FanoutSource *src, long long pos, int16_t *dst, size_t frames) {
+    for (size_t i = 0; i < frames; i++) {
+        long long p = pos + (long long)i;
+        if (src->loop && p >= 0) {
+            p %= src->frame_count;
+        }
+        if (p < 0 || p >= src->frame_count) {
+            memset(dst + i * CHANNELS, 0, CHANNELS * sizeof(int16_t));
+        } else {
+            memcpy(dst + i * CHANNELS, src->frames + p * CHANNELS, CHANNELS * sizeof(int16_t));
+        }
+    }
+}
+
+// Fill out_buf with one period, pulling as much source as the ratio needs
+static void render_period(FanoutOutput *out) {
+    size_t produced = 0;
+    while (produced < out->period_size) {
+        size_t want = out->period_size * 2;
+        size_t consumed;
+        read_source(out->src, out->read_pos, out->in_buf, want);
+        produced += resampler_process(&out->rs, out->in_buf, want, &consumed,
+                                      out->out_buf + produced * CHANNELS,
+                                      out->period_size - produced);
+        out->read_pos += consumed;
+    }
+}
+
+void *output_thread(void *arg) {
+    FanoutOutput *out = arg;
+    FanoutSource *src = out->src;
+    snd_pcm_status_t *status;
+    long long step_threshold = (long long)src->rate * STEP_THRESHOLD_MS / 1000;
+    int err;
+
+    snd_pcm_status_alloca(&status);
+    pthread_barrier_wait(&src->start);
+
+    // Prime with silence up to the start point; the controller takes it from there
+    out->read_pos = -(long long)out->buffer_size;
+
+    while (!stop_requested) {
+        render_period(out);
+
+        snd_pcm_uframes_t left = out->period_size;
+        int16_t *ptr = out->out_buf;
+        while (left > 0) {
+            err = snd_pcm_writei(out->handle, ptr, left);
+            if (err == -EPIPE) {
+                out->xruns++;
+                snd_pcm_prepare(out->handle);
+                continue;
+            } else if (pcm_reconnect_lost(err)) {
+                // Drop the rest of this period; the step below puts the
+                // reopened device back on the shared timeline
+                fprintf(stderr, "%s: device lost, waiting for it...\n", out->name);
+                if ((err = pcm_reconnect_reopen(&out->rc, &out->handle, RECONNECT_TIMEOUT_MS)) < 0) {
+                    fprintf(stderr, "%s: did not come back: %s\n", out->name, snd_strerror(err));
+                    out->finished = 1;
+                    return NULL;
+                }
+                fprintf(stderr, "%s: reconnected in %.0f ms\n", out->name, out->rc.last_recovery_ms);
+                break;
+            } else if (err < 0) {
+                fprintf(stderr, "%s: write error: %s\n", out->name, snd_strerror(err));
+                out->finished = 1;
+                return NULL;
+            }
+            left -= err;
+            ptr += err * CHANNELS;
+        }
+
+        if ((err = snd_pcm_status(out->handle, status)) < 0 ||
+            snd_pcm_status_get_state(status) != SND_PCM_STATE_RUNNING) {
+            continue;
+        }
+
+        // Source position being played right now, at the status timestamp
+        snd_htimestamp_t now;
+        snd_pcm_status_get_htstamp(status, &now);
+        double delay = snd_pcm_status_get_delay(status);
+        double heard = out->read_pos - resampler_latency(&out->rs) - delay * out->rs.ratio;
+        double expected = ts_diff(&now, &src->t0) * src->rate;
+        double error = heard - expected;
+
+        if (fabs(error) > step_threshold) {
+            // Too far off to slew in reasonable time (start-up, xrun): jump
+            out->read_pos -= (long long)llround(error);
+            rate_controller_reset(&out->pi);
+            out->jumps++;
+            error = 0;
+        }
+
+        out->rs.ratio = rate_controller_update(&out->pi, error);
+        out->ratio = out->rs.ratio;
+        out->error = error;
+
+        if (!src->loop && heard >= src->frame_count) {
+            break;
+        }
+    }
+
+    snd_pcm_drain(out->handle);
+    out->finished = 1;
+    return NULL;
+}
+
+int load_source(const char *filename, int16_t **frames, long long *frame_count) {
+    if (!filename) {
+        int samples = SAMPLE_RATE * DURATION;
+        *frames = malloc(samples * CHANNELS * sizeof(int16_t));
+        if (!*frames) {
+            return -1;
+        }
+        generate_sine_wave(*frames, samples);
+        *frame_count = samples;
+        return 0;
+    }
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        printf("Error opening %s\n", filename);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    *frames = malloc(file_size);
+    if (!*frames) {
+        fclose(f);
+        return -1;
+    }
+    size_t read_size = fread(*frames, 1, file_size, f);
+    fclose(f);
+    *frame_count = read_size / (CHANNELS * sizeof(int16_t));
+    return *frame_count > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    FanoutOutput outputs[MAX_OUTPUTS];
+    FanoutSource src;
+    const char *filename = NULL;
+    float gain = 1.0f;
+    int loop = 0;
+    int output_count = 0;
+    int opt;
+
+    memset(outputs, 0, sizeof(outputs));
+    memset(&src, 0, sizeof(src));
+
+    while ((opt = getopt(argc, argv, "f:g:l")) != -1) {
+        switch (opt) {
+        case 'f': filename = optarg; break;
+        case 'g': gain = atof(optarg); break;
+        case 'l': loop = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-f file.raw] [-g gain] [-l] [device ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    for (int i = optind; i < argc && output_count < MAX_OUTPUTS; i++) {
+        snprintf(outputs[output_count].name, sizeof(outputs[output_count].name), "%s", argv[i]);
+        output_count++;
+    }
+    if (output_count == 0) {
+        output_count = find_usb_outputs(outputs, MAX_OUTPUTS);
+    }
+    if (output_count == 0) {
+        fprintf(stderr, "No matching USB audio devices found\n");
+        return 1;
+    }
+
+    // Decode and apply gain exactly once, shared read-only by every output
+    int16_t *frames;
+    if (load_source(filename, &frames, &src.frame_count) < 0) {
+        fprintf(stderr, "Failed to load source audio\n");
+        return 1;
+    }
+    apply_volume(frames, src.frame_count * CHANNELS * sizeof(int16_t), gain);
+    src.frames = frames;
+    src.loop = loop;
+    src.rate = SAMPLE_RATE;
+
+    int opened = 0;
+    for (int i = 0; i < output_count; i++) {
+        if (setup_output(&outputs[i], src.rate) < 0) {
+            continue;
+        }
+        outputs[i].src = &src;
+        if (opened != i) {
+            outputs[opened] = outputs[i];
+        }
+        printf("Output %d: %s (period %lu, buffer %lu)\n", opened, outputs[opened].name,
+               outputs[opened].period_size, outputs[opened].buffer_size);
+        opened++;
+    }
+    if (opened == 0) {
+        free(frames);
+        return 1;
+    }
+
+    signal(SIGINT, handle_sigint);
+
+    // Give every output a full buffer of headroom before frame 0 is due
+    snd_pcm_uframes_t max_buffer = 0;
+    for (int i = 0; i < opened; i++) {
+        if (outputs[i].buffer_size > max_buffer) {
+            max_buffer = outputs[i].buffer_size;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &src.t0);
+    double lead = 2.0 * max_buffer / src.rate;
+    src.t0.tv_sec += (time_t)lead;
+    src.t0.tv_nsec += (long)((lead - (time_t)lead) * 1e9);
+    if (src.t0.tv_nsec >= 1000000000L) {
+        src.t0.tv_sec++;
+        src.t0.tv_nsec -= 1000000000L;
+    }
+
+    pthread_barrier_init(&src.start, NULL, opened);
+    for (int i = 0; i < opened; i++) {
+        pthread_create(&outputs[i].thread, NULL, output_thread, &outputs[i]);
+    }
+
+    printf("Playing on %d outputs%s, Ctrl+C to stop\n", opened, loop ? " (looping)" : "");
+    for (;;) {
+        int running = 0;
+        sleep(1);
+        for (int i = 0; i < opened; i++) {
+            if (!outputs[i].finished) {
+                running++;
+            }
+            printf("%s: %+8.1f ppm, error %+7.1f frames, xruns %ld, jumps %ld, reconnects %ld\n",
+                   outputs[i].name, (outputs[i].ratio - 1.0) * 1e6, outputs[i].error,
+                   outputs[i].xruns, outputs[i].jumps, outputs[i].rc.reconnects);
+        }
+        if (running == 0) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < opened; i++) {
+        pthread_join(outputs[i].thread, NULL);
+        if (outputs[i].handle) {
+            snd_pcm_close(outputs[i].handle);
+        }
+        free(outputs[i].in_buf);
+        free(outputs[i].out_buf);
+    }
+    pthread_barrier_destroy(&src.start);
+    free(frames);
+    return 0;
+}
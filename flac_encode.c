@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Lossless compression for raw recordings such as test_recording.raw
+// (16-bit little-endian interleaved PCM). The output is a standard FLAC
+// stream: each block is decorrelated across channels (left/side,
+// right/side or mid/side when that is cheaper), predicted with the best
+// fixed polynomial predictor and the residual Rice coded with partitioned
+// parameters. Blocks are independent, so they are encoded in parallel on
+// a small thread pool and written in order. A SEEKTABLE is emitted so
+// players can jump into long recordings without scanning.
+//
+// Usage: flac_encode [-r rate] [-c channels] [-j threads] input.raw output.flac
+
+#define DEFAULT_RATE     44100
+#define DEFAULT_CHANNELS 2
+#define MAX_CHANNELS     2
+#define BITS_PER_SAMPLE  16
+#define BLOCK_SIZE       4096
+#define SEEK_INTERVAL    10       // seconds between seek points
+#define MAX_FIXED_ORDER  4
+#define MAX_PARTITION_ORDER 8
+#define MAX_RICE_PARAM   14
+#define WINDOW_PER_THREAD 4       // blocks in flight per worker
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    uint64_t acc;
+    int bits;                     // bits pending in acc
+} BitWriter;
+
+typedef struct {
+    int ready;
+    BitWriter out;
+} EncodedBlock;
+
+typedef struct {
+    const int16_t *samples;
+    uint64_t total_frames;
+    int channels;
+    unsigned int rate;
+    uint64_t block_count;
+    int window;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t next_block;          // next block a worker should take
+    uint64_t written_blocks;      // blocks already flushed by the writer
+    EncodedBlock *slots;          // window entries, indexed by block % window
+} Encoder;
+
+static uint8_t crc8_table[256];
+static uint16_t crc16_table[256];
+
+static void init_crc_tables(void) {
+    for (int i = 0; i < 256; i++) {
+        uint8_t c8 = i;
+        uint16_t c16 = i << 8;
+        for (int b = 0; b < 8; b++) {
+            c8 = (c8 & 0x80) ? (c8 << 1) ^ 0x07 : c8 << 1;
+            c16 = (c16 & 0x8000) ? (c16 << 1) ^ 0x8005 : c16 << 1;
+        }
+        crc8_table[i] = c8;
+        crc16_table[i] = c16;
+    }
+}
+
+static uint8_t crc8(const uint8_t *data, size_t len) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc8_table[crc ^ data[i]];
+    }
+    return crc;
+}
+
+static uint16_t crc16(const uint8_t *data, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ data[i]];
+    }
+    return crc;
+}
+
+static void bw_reserve(BitWriter *bw, size_t extra) {
+    if (bw->size + extra <= bw->capacity) {
+        return;
+    }
+    size_t capacity = bw->capacity ? bw->capacity : 4096;
+    while (capacity < bw->size + extra) {
+        capacity *= 2;
+    }
+    bw->data = realloc(bw->data, capacity);
+    if (!bw->data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    bw->capacity = capacity;
+}
+
+// Append the low 'bits' bits of value, MSB first (bits <= 32)
+static void bw_put(BitWriter *bw, uint32_t value, int bits) {
+    if (bits == 0) {
+        return;
+    }
+    bw->acc = (bw->acc << bits) | (value & (bits == 32 ? 0xffffffffu : ((1u << bits) - 1)));
+    bw->bits += bits;
+    if (bw->bits >= 32) {
+        bw_reserve(bw, 8);
+        while (bw->bits >= 8) {
+            bw->bits -= 8;
+            bw->data[bw->size++] = (uint8_t)(bw->acc >> bw->bits);
+        }
+    }
+}
+
+static void bw_put_signed(BitWriter *bw, int32_t value, int bits) {
+    bw_put(bw, (uint32_t)value, bits);
+}
+
+static void bw_put_zeros(BitWriter *bw, uint32_t count) {
+    while (count >= 32) {
+        bw_put(bw, 0, 32);
+        count -= 32;
+    }
+    bw_put(bw, 0, count);
+}
+
+static void bw_align(BitWriter *bw) {
+    if (bw->bits & 7) {
+        bw_put(bw, 0, 8 - (bw->bits & 7));
+    }
+    bw_reserve(bw, 8);
+    while (bw->bits >= 8) {
+        bw->bits -= 8;
+        bw->data[bw->size++] = (uint8_t)(bw->acc >> bw->bits);
+    }
+}
+
+// Frame/sample numbers use the UTF-8-like variable length coding
+static void bw_put_utf8(BitWriter *bw, uint64_t value) {
+    if (value < 0x80) {
+        bw_put(bw, (uint32_t)value, 8);
+        return;
+    }
+    int extra = 1;
+    while (value >= (1ull << (5 * extra + 6)) && extra < 6) {
+        extra++;
+    }
+    int lead_bits = 6 - extra;
+    uint32_t lead = (0xff00u >> (extra + 1)) & 0xff;
+    bw_put(bw, lead | ((uint32_t)(value >> (6 * extra)) & ((1u << lead_bits) - 1)), 8);
+    for (int i = extra - 1; i >= 0; i--) {
+        bw_put(bw, 0x80 | (uint32_t)((value >> (6 * i)) & 0x3f), 8);
+    }
+}
+
+static inline uint32_t zigzag(int32_t r) {
+    return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+}
+
+// Residual of the fixed polynomial predictor of the given order
+static void fixed_residual(const int32_t *x, int n, int order, int32_t *res) {
+    for (int i = order; i < n; i++) {
+        switch (order) {
+        case 0: res[i] = x[i]; break;
+        case 1: res[i] = x[i] - x[i - 1]; break;
+        case 2: res[i] = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+        case 3: res[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+        default: res[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+        }
+    }
+}
+
+// Pick the fixed order with the smallest total |residual|
+static int best_fixed_order(const int32_t *x, int n, uint64_t *cost) {
+    uint64_t sums[MAX_FIXED_ORDER + 1] = {0};
+    for (int i = MAX_FIXED_ORDER; i < n; i++) {
+        int64_t e0 = x[i];
+        int64_t e1 = e0 - x[i - 1];
+        int64_t e2 = e1 - (x[i - 1] - x[i - 2]);
+        int64_t e3 = e2 - (x[i - 1] - 2 * (int64_t)x[i - 2] + x[i - 3]);
+        int64_t e4 = e3 - (x[i - 1] - 3 * (int64_t)x[i - 2] + 3 * (int64_t)x[i - 3] - x[i - 4]);
+        sums[0] += e0 < 0 ? -e0 : e0;
+        sums[1] += e1 < 0 ? -e1 : e1;
+        sums[2] += e2 < 0 ? -e2 : e2;
+        sums[3] += e3 < 0 ? -e3 : e3;
+        sums[4] += e4 < 0 ? -e4 : e4;
+    }
+    int best = 0;
+    int max_order = n > MAX_FIXED_ORDER ? MAX_FIXED_ORDER : n - 1;
+    for (int o = 1; o <= max_order; o++) {
+        if (sums[o] < sums[best]) {
+            best = o;
+        }
+    }
+    *cost = sums[best];
+    return best;
+}
+
+// Choose partition order and Rice parameters minimizing the exact bit
+// count. Returns the residual size in bits and fills params/order.
+static uint64_t plan_rice(const int32_t *res, int n, int pred_order,
+                          int *partition_order, int *params) {
+    int max_order = 0;
+    while (max_order < MAX_PARTITION_ORDER &&
+           (n % (2 << max_order)) == 0 &&
+           (n >> (max_order + 1)) > pred_order) {
+        max_order++;
+    }
+
+    int parts = 1 << max_order;
+    int part_len = n >> max_order;
+    // cost[p][k] = sum over partition p of (u >> k)
+    static __thread uint64_t cost[1 << MAX_PARTITION_ORDER][MAX_RICE_PARAM + 1];
+    for (int p = 0; p < parts; p++) {
+        int start = p == 0 ? pred_order : p * part_len;
+        int end = (p + 1) * part_len;
+        memset(cost[p], 0, sizeof(cost[p]));
+        for (int i = start; i < end; i++) {
+            uint32_t u = zigzag(res[i]);
+            for (int k = 0; k <= MAX_RICE_PARAM; k++) {
+                cost[p][k] += u >> k;
+            }
+        }
+    }
+
+    uint64_t best_bits = UINT64_MAX;
+    for (int order = max_order; order >= 0; order--) {
+        int count = 1 << order;
+        int len = n >> order;
+        uint64_t bits = 0;
+        int chosen[1 << MAX_PARTITION_ORDER];
+        for (int p = 0; p < count; p++) {
+            int samples = len - (p == 0 ? pred_order : 0);
+            uint64_t best = UINT64_MAX;
+            for (int k = 0; k <= MAX_RICE_PARAM; k++) {
+                uint64_t b = cost[p][k] + (uint64_t)samples * (k + 1);
+                if (b < best) {
+                    best = b;
+                    chosen[p] = k;
+                }
+            }
+            bits += 4 + best;
+        }
+        if (bits < best_bits) {
+            best_bits = bits;
+            *partition_order = order;
+            memcpy(params, chosen, count * sizeof(int));
+        }
+        // Merge pairs of partitions for the next coarser order
+        for (int p = 0; p < count / 2; p++) {
+            for (int k = 0; k <= MAX_RICE_PARAM; k++) {
+                cost[p][k] = cost[2 * p][k] + cost[2 * p + 1][k];
+            }
+        }
+    }
+    return best_bits + 2 + 4;
+}
+
+static void write_subframe(BitWriter *bw, const int32_t *x, int n, int bps, int32_t *res) {
+    int constant = 1;
+    for (int i = 1; i < n && constant; i++) {
+        constant = x[i] == x[0];
+    }
+    if (constant) {
+        bw_put(bw, 0x00, 8);                  // pad, CONSTANT, no wasted bits
+        bw_put_signed(bw, x[0], bps);
+        return;
+    }
+
+    uint64_t estimate;
+    int order = best_fixed_order(x, n, &estimate);
+    fixed_residual(x, n, order, res);
+
+    int partition_order = 0;
+    int params[1 << MAX_PARTITION_ORDER];
+    uint64_t bits = plan_rice(res, n, order, &partition_order, params) + (uint64_t)order * bps;
+
+    if (bits >= (uint64_t)n * bps) {
+        bw_put(bw, 0x02, 8);                  // VERBATIM
+        for (int i = 0; i < n; i++) {
+            bw_put_signed(bw, x[i], bps);
+        }
+        return;
+    }
+
+    bw_put(bw, (0x08 | order) << 1, 8);       // FIXED, order
+    for (int i = 0; i < order; i++) {
+        bw_put_signed(bw, x[i], bps);
+    }
+    bw_put(bw, 0, 2);                         // RICE (4-bit parameters)
+    bw_put(bw, partition_order, 4);
+    int len = n >> partition_order;
+    for (int p = 0; p < (1 << partition_order); p++) {
+        int k = params[p];
+        int start = p == 0 ? order : p * len;
+        int end = (p + 1) * len;
+        bw_put(bw, k, 4);
+        for (int i = start; i < end; i++) {
+            uint32_t u = zigzag(res[i]);
+            bw_put_zeros(bw, u >> k);
+            bw_put(bw, 1, 1);
+            bw_put(bw, u & ((1u << k) - 1), k);
+        }
+    }
+}
+
+static int rate_code(unsigned int rate) {
+    switch (rate) {
+    case 8000: return 4;
+    case 16000: return 5;
+    case 22050: return 6;
+    case 24000: return 7;
+    case 32000: return 8;
+    case 44100: return 9;
+    case 48000: return 10;
+    case 96000: return 11;
+    default: return 0;                        // taken from STREAMINFO
+    }
+}
+
+void encode_block(const Encoder *enc, uint64_t block, BitWriter *bw) {
+    uint64_t first = block * BLOCK_SIZE;
+    int n = (int)(enc->total_frames - first < BLOCK_SIZE ? enc->total_frames - first : BLOCK_SIZE);
+    int channels = enc->channels;
+    int32_t ch[4][BLOCK_SIZE];
+    int32_t res[BLOCK_SIZE];
+
+    for (int i = 0; i < n; i++) {
+        for (int c = 0; c < channels; c++) {
+            ch[c][i] = enc->samples[(first + i) * channels + c];
+        }
+    }
+
+    // Channel assignment: 0/1 = independent, 8 = left/side, 9 = right/side, 10 = mid/side
+    int assignment = channels - 1;
+    const int32_t *sub[2] = { ch[0], ch[1] };
+    int sub_bps[2] = { BITS_PER_SAMPLE, BITS_PER_SAMPLE };
+    if (channels == 2) {
+        for (int i = 0; i < n; i++) {
+            ch[2][i] = ch[0][i] - ch[1][i];            // side
+            ch[3][i] = (ch[0][i] + ch[1][i]) >> 1;     // mid
+        }
+        uint64_t cost[4];
+        for (int c = 0; c < 4; c++) {
+            best_fixed_order(ch[c], n, &cost[c]);
+        }
+        uint64_t independent = cost[0] + cost[1];
+        uint64_t left_side = cost[0] + cost[2];
+        uint64_t right_side = cost[1] + cost[2];
+        uint64_t mid_side = cost[3] + cost[2];
+        uint64_t best = independent;
+        if (left_side < best) {
+            best = left_side;
+            assignment = 8;
+            sub[1] = ch[2];
+            sub_bps[1] = BITS_PER_SAMPLE + 1;
+        }
+        if (right_side < best) {
+            best = right_side;
+            assignment = 9;
+            sub[0] = ch[2];
+            sub[1] = ch[1];
+            sub_bps[0] = BITS_PER_SAMPLE + 1;
+            sub_bps[1] = BITS_PER_SAMPLE;
+        }
+        if (mid_side < best) {
+            assignment = 10;
+            sub[0] = ch[3];
+            sub[1] = ch[2];
+            sub_bps[0] = BITS_PER_SAMPLE;
+            sub_bps[1] = BITS_PER_SAMPLE + 1;
+        }
+    }
+
+    // Frame header
+    int size_code = n == BLOCK_SIZE ? 12 : 7;          // 12: 4096, 7: 16-bit n-1 follows
+    int rcode = rate_code(enc->rate);
+    bw_put(bw, 0xfff8, 16);                            // sync, fixed block size
+    bw_put(bw, size_code, 4);
+    bw_put(bw, rcode, 4);
+    bw_put(bw, assignment, 4);
+    bw_put(bw, 4, 3);                                  // 16 bits per sample
+    bw_put(bw, 0, 1);
+    bw_put_utf8(bw, block);
+    if (size_code == 7) {
+        bw_put(bw, n - 1, 16);
+    }
+    bw_align(bw);
+    bw_put(bw, crc8(bw->data, bw->size), 8);
+
+    for (int c = 0; c < channels; c++) {
+        write_subframe(bw, sub[c], n, sub_bps[c], res);
+    }
+
+    bw_align(bw);
+    uint16_t crc = crc16(bw->data, bw->size);
+    bw_put(bw, crc, 16);
+    bw_align(bw);
+}
+
+void *encode_worker(void *arg) {
+    Encoder *enc = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&enc->lock);
+        while (enc->next_block < enc->block_count &&
+               enc->next_block - enc->written_blocks >= (uint64_t)enc->window) {
+            pthread_cond_wait(&enc->cond, &enc->lock);
+        }
+        if (enc->next_block >= enc->block_count) {
+            pthread_mutex_unlock(&enc->lock);
+            return NULL;
+        }
+        uint64_t block = enc->next_block++;
+        EncodedBlock *slot = &enc->slots[block % enc->window];
+        pthread_mutex_unlock(&enc->lock);
+
+        slot->out.size = 0;
+        slot->out.bits = 0;
+        slot->out.acc = 0;
+        encode_block(enc, block, &slot->out);
+
+        pthread_mutex_lock(&enc->lock);
+        slot->ready = 1;
+        pthread_cond_broadcast(&enc->cond);
+        pthread_mutex_unlock(&enc->lock);
+    }
+}
+
+static void put_be(uint8_t *p, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        p[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+int main(int argc, char **argv) {
+    unsigned int rate = DEFAULT_RATE;
+    int channels = DEFAULT_CHANNELS;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:c:j:")) != -1) {
+        switch (opt) {
+        case 'r': rate = atoi(optarg); break;
+        case 'c': channels = atoi(optarg); break;
+        case 'j': threads = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-r rate] [-c channels] [-j threads] input.raw output.flac\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 2 || channels < 1 || channels > MAX_CHANNELS || rate == 0 || rate > 655350) {
+        fprintf(stderr, "Usage: %s [-r rate] [-c channels] [-j threads] input.raw output.flac\n", argv[0]);
+        return 1;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening input");
+        return 1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    if (st.st_size < (off_t)(channels * sizeof(int16_t))) {
+        fprintf(stderr, "Input is empty\n");
+        close(fd);
+        return 1;
+    }
+    const int16_t *samples = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (samples == MAP_FAILED) {
+        perror("Error mapping input");
+        return 1;
+    }
+    madvise((void *)samples, st.st_size, MADV_SEQUENTIAL);
+
+    FILE *f = fopen(argv[optind + 1], "wb");
+    if (!f) {
+        perror("Error opening output");
+        munmap((void *)samples, st.st_size);
+        return 1;
+    }
+
+    init_crc_tables();
+
+    Encoder enc = {0};
+    enc.samples = samples;
+    enc.channels = channels;
+    enc.rate = rate;
+    enc.total_frames = st.st_size / (channels * sizeof(int16_t));
+    enc.block_count = (enc.total_frames + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    enc.window = threads * WINDOW_PER_THREAD;
+    enc.slots = calloc(enc.window, sizeof(EncodedBlock));
+    pthread_mutex_init(&enc.lock, NULL);
+    pthread_cond_init(&enc.cond, NULL);
+
+    // Metadata: STREAMINFO and SEEKTABLE, patched once the frames are written
+    uint64_t seek_every = (uint64_t)SEEK_INTERVAL * rate / BLOCK_SIZE;
+    if (seek_every == 0) {
+        seek_every = 1;
+    }
+    uint64_t seek_points = (enc.block_count + seek_every - 1) / seek_every;
+    uint8_t streaminfo[4 + 34] = {0};
+    size_t seektable_size = 4 + seek_points * 18;
+    uint8_t *seektable = calloc(1, seektable_size);
+
+    fwrite("fLaC", 1, 4, f);
+    long streaminfo_pos = ftell(f);
+    fwrite(streaminfo, 1, sizeof(streaminfo), f);
+    fwrite(seektable, 1, seektable_size, f);
+    long first_frame_pos = ftell(f);
+
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    for (long i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, encode_worker, &enc);
+    }
+
+    // Write blocks in order as they complete
+    uint32_t min_frame = UINT32_MAX, max_frame = 0;
+    uint64_t out_bytes = 0;
+    for (uint64_t b = 0; b < enc.block_count; b++) {
+        EncodedBlock *slot = &enc.slots[b % enc.window];
+        pthread_mutex_lock(&enc.lock);
+        while (!slot->ready) {
+            pthread_cond_wait(&enc.cond, &enc.lock);
+        }
+        pthread_mutex_unlock(&enc.lock);
+
+        if (b % seek_every == 0) {
+            uint8_t *point = seektable + 4 + (b / seek_every) * 18;
+            uint64_t frames = enc.total_frames - b * BLOCK_SIZE;
+            put_be(point, b * BLOCK_SIZE, 8);
+            put_be(point + 8, out_bytes, 8);
+            put_be(point + 16, frames < BLOCK_SIZE ? frames : BLOCK_SIZE, 2);
+        }
+        fwrite(slot->out.data, 1, slot->out.size, f);
+        out_bytes += slot->out.size;
+        if (slot->out.size < min_frame) min_frame = slot->out.size;
+        if (slot->out.size > max_frame) max_frame = slot->out.size;
+
+        pthread_mutex_lock(&enc.lock);
+        slot->ready = 0;
+        enc.written_blocks++;
+        pthread_cond_broadcast(&enc.cond);
+        pthread_mutex_unlock(&enc.lock);
+    }
+
+    for (long i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // STREAMINFO (MD5 left zero, which means "not computed")
+    uint16_t min_block = enc.block_count > 1 ? BLOCK_SIZE : enc.total_frames;
+    streaminfo[0] = 0x00;
+    put_be(streaminfo + 1, 34, 3);
+    put_be(streaminfo + 4, min_block, 2);
+    put_be(streaminfo + 6, BLOCK_SIZE, 2);
+    put_be(streaminfo + 8, min_frame, 3);
+    put_be(streaminfo + 11, max_frame, 3);
+    uint64_t packed = ((uint64_t)rate << 44) | ((uint64_t)(channels - 1) << 41) |
+                      ((uint64_t)(BITS_PER_SAMPLE - 1) << 36) | enc.total_frames;
+    put_be(streaminfo + 14, packed, 8);
+
+    seektable[0] = 0x80 | 3;                  // last metadata block, SEEKTABLE
+    put_be(seektable + 1, seek_points * 18, 3);
+
+    fseek(f, streaminfo_pos, SEEK_SET);
+    fwrite(streaminfo, 1, sizeof(streaminfo), f);
+    fwrite(seektable, 1, seektable_size, f);
+    fclose(f);
+
+    uint64_t total_out = first_frame_pos + out_bytes;
+    printf("Encoded %llu frames in %llu blocks on %ld threads: %lld -> %llu bytes (%.1f%%)\n",
+           (unsigned long long)enc.total_frames, (unsigned long long)enc.block_count, threads,
+           (long long)st.st_size, (unsigned long long)total_out, 100.0 * total_out / st.st_size);
+
+    for (int i = 0; i < enc.window; i++) {
+        free(enc.slots[i].out.data);
+    }
+    free(enc.slots);
+    free(seektable);
+    free(workers);
+    pthread_mutex_destroy(&enc.lock);
+    pthread_cond_destroy(&enc.cond);
+    munmap((void *)samples, st.st_size);
+    return 0;
+}
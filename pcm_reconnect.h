@@ -0,0 +1,176 @@
+#ifndef PCM_RECONNECT_H
+#define PCM_RECONNECT_H
+
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+// Hotplug recovery for PCM streams. When a USB card is unplugged (or drops
+// off the bus and re-enumerates) every call on the old handle fails with
+// -ENODEV. Instead of exiting, a program keeps a PcmReconnect next to its
+// handle: after configuring the stream it saves the negotiated parameters,
+// and on -ENODEV it closes the dead handle and polls for the device to come
+// back, reapplying the saved parameters as they are without negotiating
+// again. The poll interval starts at a few milliseconds and backs off to
+// PCM_RECONNECT_MAX_BACKOFF_MS, so the stream resumes within that much of
+// the device reappearing.
+//
+// The device name must survive re-enumeration: "default" or
+// "plughw:CARD=<id>,0" do, "plughw:<number>,0" may not.
+
+#define PCM_RECONNECT_MIN_BACKOFF_MS 2
+#define PCM_RECONNECT_MAX_BACKOFF_MS 50
+
+typedef struct {
+    char name[64];
+    snd_pcm_stream_t stream;
+
+    // Capability cache: the configuration the stream was running with
+    snd_pcm_access_t access;
+    snd_pcm_format_t format;
+    unsigned int channels;
+    unsigned int rate;
+    unsigned int rate_resample;
+    snd_pcm_uframes_t period_size;
+    snd_pcm_uframes_t buffer_size;
+    snd_pcm_uframes_t start_threshold;
+    snd_pcm_uframes_t avail_min;
+    snd_pcm_tstamp_t tstamp_mode;
+    snd_pcm_tstamp_type_t tstamp_type;
+
+    // Frames written but not yet heard as of the last pcm_reconnect_track();
+    // these are lost with the device and must be played again.
+    snd_pcm_sframes_t last_delay;
+    long reconnects;
+    double last_recovery_ms;
+} PcmReconnect;
+
+static inline int pcm_reconnect_lost(int err) {
+    return err == -ENODEV;
+}
+
+static inline double pcm_reconnect_ms_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Remember how 'pcm' is configured; call once hw and sw params are set.
+static inline int pcm_reconnect_save(PcmReconnect *rc, snd_pcm_t *pcm, const char *name,
+                                     snd_pcm_stream_t stream) {
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_sw_params_t *sw;
+    int err;
+
+    snprintf(rc->name, sizeof(rc->name), "%s", name);
+    rc->stream = stream;
+
+    snd_pcm_hw_params_alloca(&hw);
+    if ((err = snd_pcm_hw_params_current(pcm, hw)) < 0) {
+        return err;
+    }
+    snd_pcm_hw_params_get_access(hw, &rc->access);
+    snd_pcm_hw_params_get_format(hw, &rc->format);
+    snd_pcm_hw_params_get_channels(hw, &rc->channels);
+    snd_pcm_hw_params_get_rate(hw, &rc->rate, 0);
+    snd_pcm_hw_params_get_rate_resample(pcm, hw, &rc->rate_resample);
+    snd_pcm_hw_params_get_period_size(hw, &rc->period_size, 0);
+    snd_pcm_hw_params_get_buffer_size(hw, &rc->buffer_size);
+
+    snd_pcm_sw_params_alloca(&sw);
+    if ((err = snd_pcm_sw_params_current(pcm, sw)) < 0) {
+        return err;
+    }
+    snd_pcm_sw_params_get_start_threshold(sw, &rc->start_threshold);
+    snd_pcm_sw_params_get_avail_min(sw, &rc->avail_min);
+    snd_pcm_sw_params_get_tstamp_mode(sw, &rc->tstamp_mode);
+    snd_pcm_sw_params_get_tstamp_type(sw, &rc->tstamp_type);
+    rc->last_delay = 0;
+    return 0;
+}
+
+// Apply the saved configuration exactly; any mismatch means the device that
+// came back is not the one we had, and is reported as an error.
+static inline int pcm_reconnect_apply(const PcmReconnect *rc, snd_pcm_t *pcm) {
+    snd_pcm_hw_params_t *hw;
+    snd_pcm_sw_params_t *sw;
+    int err;
+
+    snd_pcm_hw_params_alloca(&hw);
+    if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0 ||
+        (err = snd_pcm_hw_params_set_access(pcm, hw, rc->access)) < 0 ||
+        (err = snd_pcm_hw_params_set_format(pcm, hw, rc->format)) < 0 ||
+        (err = snd_pcm_hw_params_set_channels(pcm, hw, rc->channels)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate_resample(pcm, hw, rc->rate_resample)) < 0 ||
+        (err = snd_pcm_hw_params_set_rate(pcm, hw, rc->rate, 0)) < 0 ||
+        (err = snd_pcm_hw_params_set_period_size(pcm, hw, rc->period_size, 0)) < 0 ||
+        (err = snd_pcm_hw_params_set_buffer_size(pcm, hw, rc->buffer_size)) < 0 ||
+        (err = snd_pcm_hw_params(pcm, hw)) < 0) {
+        return err;
+    }
+
+    snd_pcm_sw_params_alloca(&sw);
+    if ((err = snd_pcm_sw_params_current(pcm, sw)) < 0 ||
+        (err = snd_pcm_sw_params_set_start_threshold(pcm, sw, rc->start_threshold)) < 0 ||
+        (err = snd_pcm_sw_params_set_avail_min(pcm, sw, rc->avail_min)) < 0 ||
+        (err = snd_pcm_sw_params_set_tstamp_mode(pcm, sw, rc->tstamp_mode)) < 0 ||
+        (err = snd_pcm_sw_params_set_tstamp_type(pcm, sw, rc->tstamp_type)) < 0 ||
+        (err = snd_pcm_sw_params(pcm, sw)) < 0) {
+        return err;
+    }
+    return 0;
+}
+
+// Call after each successful write so a disconnect knows how much of what
+// was written never reached the speaker.
+static inline void pcm_reconnect_track(PcmReconnect *rc, snd_pcm_t *pcm) {
+    snd_pcm_sframes_t delay;
+    if (snd_pcm_delay(pcm, &delay) == 0) {
+        rc->last_delay = delay > 0 ? delay : 0;
+    }
+}
+
+// Close the dead handle in *pcm and wait up to timeout_ms for the device to
+// come back. The open is non-blocking so a half-enumerated device cannot
+// stall us; the handle is switched back to blocking once configured.
+// Returns 0 with a prepared stream in *pcm, or a negative error with
+// *pcm == NULL.
+static inline int pcm_reconnect_reopen(PcmReconnect *rc, snd_pcm_t **pcm, int timeout_ms) {
+    struct timespec start;
+    int backoff = PCM_RECONNECT_MIN_BACKOFF_MS;
+    int err;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (*pcm) {
+        snd_pcm_close(*pcm);
+        *pcm = NULL;
+    }
+
+    for (;;) {
+        err = snd_pcm_open(pcm, rc->name, rc->stream, SND_PCM_NONBLOCK);
+        if (err == 0) {
+            if ((err = pcm_reconnect_apply(rc, *pcm)) == 0 &&
+                (err = snd_pcm_nonblock(*pcm, 0)) == 0 &&
+                (err = snd_pcm_prepare(*pcm)) == 0) {
+                rc->reconnects++;
+                rc->last_recovery_ms = pcm_reconnect_ms_since(&start);
+                rc->last_delay = 0;
+                return 0;
+            }
+            snd_pcm_close(*pcm);
+            *pcm = NULL;
+        }
+
+        double elapsed = pcm_reconnect_ms_since(&start);
+        if (elapsed >= timeout_ms) {
+            return err;
+        }
+        struct timespec ts = { 0, (long)backoff * 1000000L };
+        nanosleep(&ts, NULL);
+        backoff = backoff * 2 > PCM_RECONNECT_MAX_BACKOFF_MS ? PCM_RECONNECT_MAX_BACKOFF_MS
+                                                              : backoff * 2;
+    }
+}
+
+#endif // PCM_RECONNECT_H
@@ -0,0 +1,351 @@
+#ifndef PEAK_INDEX_H
+#define PEAK_INDEX_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Multi-resolution level index stored next to a raw recording
+// (<recording>.peaks). Level 0 holds min/max/mean-square per channel for
+// every PEAK_INDEX_BASE_FRAMES frames, and each level above halves the
+// resolution, up to a single entry for the whole file. The index is built
+// while recording: level 0 streams to disk and the coarser levels, which
+// together are no larger than level 0, are appended when the recording
+// ends.
+//
+// Levels for any range come from at most two entries per level, so a query
+// reads a few hundred bytes whatever the file length, and a waveform
+// overview is one query per pixel column.
+//
+// If a coarser level cannot grow, the writer is marked failed: from then on
+// peak_index_add() returns -1 without touching the file, and
+// peak_index_finish() frees everything and returns -1 instead of writing a
+// header. The caller then removes the incomplete file.
+
+#define PEAK_INDEX_MAGIC       "PKIX"
+#define PEAK_INDEX_VERSION     1
+#define PEAK_INDEX_BASE_FRAMES 256
+#define PEAK_INDEX_MAX_LEVELS  40
+#define PEAK_INDEX_MAX_CHANNELS 8
+
+typedef struct {
+    int16_t min;
+    int16_t max;
+    float mean_square;           // normalized to full scale = 1.0
+} PeakEntry;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t channels;
+    uint32_t sample_rate;
+    uint32_t base_frames;
+    uint32_t level_count;
+    uint64_t total_frames;
+    uint64_t level_offset[PEAK_INDEX_MAX_LEVELS];   // byte offset of each level
+    uint64_t level_entries[PEAK_INDEX_MAX_LEVELS];  // entries (per channel group) in each level
+} PeakIndexHeader;
+
+typedef struct {
+    PeakEntry *entries;          // channels entries per position
+    size_t count;
+    size_t capacity;
+} PeakLevel;
+
+typedef struct {
+    FILE *file;
+    PeakIndexHeader header;
+    int channels;
+    PeakEntry current[PEAK_INDEX_MAX_CHANNELS];   // level-0 block being filled
+    double current_sq[PEAK_INDEX_MAX_CHANNELS];
+    size_t current_frames;
+    PeakEntry pending0[PEAK_INDEX_MAX_CHANNELS];  // even level-0 entry waiting for its partner
+    size_t level0_count;
+    PeakLevel levels[PEAK_INDEX_MAX_LEVELS];      // level 1 and up (index 0 unused)
+    int failed;                                   // a level could not grow; the index is incomplete
+} PeakIndexWriter;
+
+typedef struct {
+    int fd;
+    PeakIndexHeader header;
+} PeakIndexReader;
+
+// Frames covered by entry 'index' of 'level' (only the last one is short)
+static inline uint64_t peak_entry_frames(const PeakIndexHeader *h, int level, uint64_t index) {
+    uint64_t span = (uint64_t)h->base_frames << level;
+    uint64_t start = index * span;
+    if (start >= h->total_frames) {
+        return 0;
+    }
+    return h->total_frames - start < span ? h->total_frames - start : span;
+}
+
+// Combine b (covering b_frames) into a (covering a_frames)
+static inline void peak_entry_merge(PeakEntry *a, uint64_t a_frames, const PeakEntry *b, uint64_t b_frames) {
+    if (b_frames == 0) {
+        return;
+    }
+    if (a_frames == 0) {
+        *a = *b;
+        return;
+    }
+    if (b->min < a->min) a->min = b->min;
+    if (b->max > a->max) a->max = b->max;
+    a->mean_square = (float)(((double)a->mean_square * a_frames + (double)b->mean_square * b_frames) /
+                             (a_frames + b_frames));
+}
+
+static inline int peak_level_push(PeakLevel *level, const PeakEntry *entry, int channels) {
+    if (level->count == level->capacity) {
+        size_t capacity = level->capacity ? level->capacity * 2 : 256;
+        PeakEntry *grown = realloc(level->entries, capacity * channels * sizeof(PeakEntry));
+        if (!grown) {
+            return -1;
+        }
+        level->entries = grown;
+        level->capacity = capacity;
+    }
+    memcpy(level->entries + level->count * channels, entry, channels * sizeof(PeakEntry));
+    level->count++;
+    return 0;
+}
+
+static inline void peak_reset_current(PeakIndexWriter *w) {
+    for (int c = 0; c < w->channels; c++) {
+        w->current[c].min = INT16_MAX;
+        w->current[c].max = INT16_MIN;
+        w->current_sq[c] = 0;
+    }
+    w->current_frames = 0;
+}
+
+static inline int peak_index_create(PeakIndexWriter *w, const char *path, int channels, unsigned int rate) {
+    memset(w, 0, sizeof(*w));
+    if (channels < 1 || channels > PEAK_INDEX_MAX_CHANNELS) {
+        return -1;
+    }
+    w->file = fopen(path, "wb");
+    if (!w->file) {
+        return -1;
+    }
+    w->channels = channels;
+    memcpy(w->header.magic, PEAK_INDEX_MAGIC, 4);
+    w->header.version = PEAK_INDEX_VERSION;
+    w->header.channels = channels;
+    w->header.sample_rate = rate;
+    w->header.base_frames = PEAK_INDEX_BASE_FRAMES;
+    w->header.level_offset[0] = sizeof(PeakIndexHeader);
+    // Placeholder header; rewritten by peak_index_finish()
+    fwrite(&w->header, sizeof(w->header), 1, w->file);
+    peak_reset_current(w);
+    return 0;
+}
+
+// Append an entry to level >= 1; every second entry completes a parent
+static inline int peak_index_push(PeakIndexWriter *w, int level, const PeakEntry *entry) {
+    PeakLevel *lv = &w->levels[level];
+    if (peak_level_push(lv, entry, w->channels) < 0) {
+        w->failed = 1;
+        return -1;
+    }
+    if (lv->count % 2 != 0 || level + 1 >= PEAK_INDEX_MAX_LEVELS) {
+        return 0;
+    }
+    uint64_t left = lv->count - 2;
+    PeakEntry parent[PEAK_INDEX_MAX_CHANNELS];
+    for (int c = 0; c < w->channels; c++) {
+        parent[c] = lv->entries[left * w->channels + c];
+        peak_entry_merge(&parent[c], peak_entry_frames(&w->header, level, left),
+                         &lv->entries[(left + 1) * w->channels + c],
+                         peak_entry_frames(&w->header, level, left + 1));
+    }
+    return peak_index_push(w, level + 1, parent);
+}
+
+static inline int peak_index_emit_level0(PeakIndexWriter *w) {
+    int err = 0;
+    PeakEntry entry[PEAK_INDEX_MAX_CHANNELS];
+    for (int c = 0; c < w->channels; c++) {
+        entry[c] = w->current[c];
+        entry[c].mean_square = (float)(w->current_sq[c] / w->current_frames / (32768.0 * 32768.0));
+    }
+    fwrite(entry, sizeof(PeakEntry), w->channels, w->file);
+    w->header.total_frames += w->current_frames;
+    uint64_t index = w->level0_count++;
+
+    if (index % 2 == 0) {
+        memcpy(w->pending0, entry, sizeof(PeakEntry) * w->channels);
+    } else {
+        PeakEntry parent[PEAK_INDEX_MAX_CHANNELS];
+        for (int c = 0; c < w->channels; c++) {
+            parent[c] = w->pending0[c];
+            peak_entry_merge(&parent[c], w->header.base_frames, &entry[c], w->current_frames);
+        }
+        err = peak_index_push(w, 1, parent);
+    }
+    peak_reset_current(w);
+    return err;
+}
+
+// Feed interleaved frames as they are captured/stored
+static inline int peak_index_add(PeakIndexWriter *w, const int16_t *frames, size_t count) {
+    if (w->failed) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        for (int c = 0; c < w->channels; c++) {
+            int16_t s = frames[i * w->channels + c];
+            if (s < w->current[c].min) w->current[c].min = s;
+            if (s > w->current[c].max) w->current[c].max = s;
+            w->current_sq[c] += (double)s * s;
+        }
+        if (++w->current_frames == w->header.base_frames && peak_index_emit_level0(w) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Close the file and free the levels without writing a header
+static inline void peak_index_abort(PeakIndexWriter *w) {
+    fclose(w->file);
+    for (int l = 0; l < PEAK_INDEX_MAX_LEVELS; l++) {
+        free(w->levels[l].entries);
+    }
+}
+
+// Flush the partial block, complete every level and write the header.
+// Cleans up either way; -1 means the file is not a usable index.
+static inline int peak_index_finish(PeakIndexWriter *w) {
+    if (w->failed || (w->current_frames && peak_index_emit_level0(w) < 0)) {
+        peak_index_abort(w);
+        return -1;
+    }
+
+    // An entry left without a partner still gets a parent of its own, so
+    // every level covers the whole recording up to a single root entry.
+    int level = 0;
+    if (w->level0_count > 1) {
+        if (w->level0_count % 2) {
+            peak_index_push(w, 1, w->pending0);
+        }
+        level = 1;
+        while (w->levels[level].count > 1 && level + 1 < PEAK_INDEX_MAX_LEVELS) {
+            PeakLevel *lv = &w->levels[level];
+            if (lv->count % 2) {
+                PeakEntry last[PEAK_INDEX_MAX_CHANNELS];
+                memcpy(last, lv->entries + (lv->count - 1) * w->channels, sizeof(PeakEntry) * w->channels);
+                peak_index_push(w, level + 1, last);
+            }
+            level++;
+        }
+    }
+    if (w->failed) {
+        peak_index_abort(w);
+        return -1;
+    }
+
+    w->header.level_count = level + 1;
+    w->header.level_entries[0] = w->level0_count;
+    uint64_t offset = sizeof(PeakIndexHeader) + w->level0_count * w->channels * sizeof(PeakEntry);
+    for (int l = 1; l <= level; l++) {
+        w->header.level_offset[l] = offset;
+        w->header.level_entries[l] = w->levels[l].count;
+        fwrite(w->levels[l].entries, sizeof(PeakEntry) * w->channels, w->levels[l].count, w->file);
+        offset += w->levels[l].count * w->channels * sizeof(PeakEntry);
+    }
+
+    fseek(w->file, 0, SEEK_SET);
+    fwrite(&w->header, sizeof(w->header), 1, w->file);
+    int err = ferror(w->file) ? -1 : 0;
+    if (fclose(w->file) != 0) {
+        err = -1;
+    }
+    for (int l = 0; l < PEAK_INDEX_MAX_LEVELS; l++) {
+        free(w->levels[l].entries);
+    }
+    return err;
+}
+
+static inline int peak_index_open(PeakIndexReader *r, const char *path) {
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0) {
+        return -1;
+    }
+    if (pread(r->fd, &r->header, sizeof(r->header), 0) != (ssize_t)sizeof(r->header) ||
+        memcmp(r->header.magic, PEAK_INDEX_MAGIC, 4) != 0 ||
+        r->header.version != PEAK_INDEX_VERSION ||
+        r->header.channels < 1 || r->header.channels > PEAK_INDEX_MAX_CHANNELS ||
+        r->header.level_count > PEAK_INDEX_MAX_LEVELS) {
+        close(r->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void peak_index_close(PeakIndexReader *r) {
+    close(r->fd);
+}
+
+// Levels over frames [start, end), rounded out to whole base blocks.
+// Fills one entry per channel and returns the frames covered (0 if none).
+static inline uint64_t peak_index_query(const PeakIndexReader *r, uint64_t start, uint64_t end, PeakEntry *out) {
+    const PeakIndexHeader *h = &r->header;
+    int channels = h->channels;
+    uint64_t covered = 0;
+
+    if (end > h->total_frames) end = h->total_frames;
+    if (start >= end) return 0;
+
+    uint64_t lo = start / h->base_frames;
+    uint64_t hi = (end + h->base_frames - 1) / h->base_frames;
+    for (uint32_t level = 0; lo < hi && level < h->level_count; level++) {
+        uint64_t take[2];
+        int n = 0;
+        if (level + 1 == h->level_count) {
+            // The top level is a single root entry
+            take[n++] = lo;
+            lo = hi;
+        } else {
+            if (lo & 1) take[n++] = lo++;
+            if (hi & 1) take[n++] = --hi;
+        }
+        for (int k = 0; k < n; k++) {
+            PeakEntry entry[PEAK_INDEX_MAX_CHANNELS];
+            off_t pos = h->level_offset[level] + take[k] * channels * sizeof(PeakEntry);
+            if (pread(r->fd, entry, channels * sizeof(PeakEntry), pos) != (ssize_t)(channels * sizeof(PeakEntry))) {
+                return 0;
+            }
+            uint64_t frames = peak_entry_frames(h, level, take[k]);
+            for (int c = 0; c < channels; c++) {
+                peak_entry_merge(&out[c], covered, &entry[c], frames);
+            }
+            covered += frames;
+        }
+        lo >>= 1;
+        hi >>= 1;
+    }
+    return covered;
+}
+
+// Waveform overview: one entry per channel for each of 'columns' columns
+static inline int peak_index_render(const PeakIndexReader *r, uint64_t start, uint64_t end,
+                                    int columns, PeakEntry *out) {
+    if (columns < 1 || end <= start) {
+        return -1;
+    }
+    for (int col = 0; col < columns; col++) {
+        uint64_t a = start + (end - start) * col / columns;
+        uint64_t b = start + (end - start) * (col + 1) / columns;
+        if (b == a) b = a + 1;
+        memset(out + col * r->header.channels, 0, r->header.channels * sizeof(PeakEntry));
+        peak_index_query(r, a, b, out + col * r->header.channels);
+    }
+    return 0;
+}
+
+#endif
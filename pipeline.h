@@ -0,0 +1,407 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+// Threaded block pipeline: capture -> processing stages -> writer.
+//
+// A fixed pool of period-sized blocks is allocated up front and circulates
+// through the stages; nothing is allocated while running. Neighbouring
+// stages are joined by single-producer/single-consumer lock-free queues.
+// The pool size is the backpressure: when every block is in flight the
+// source waits for the sink to hand one back (and counts the stall).
+//
+// A stage may run several worker threads. Blocks are dealt to workers
+// round-robin by sequence number and the next stage collects them in the
+// same order, so each worker-to-worker link is still SPSC and output order
+// is preserved without locks or reordering buffers. The first stage (the
+// source) always has one worker.
+//
+// Each stage records how long blocks waited in its input queue and how long
+// it spent on them, plus end-to-end latency at the last stage.
+
+#define PIPELINE_MAX_STAGES  8
+#define PIPELINE_MAX_WORKERS 8
+
+// Block flags
+#define PIPELINE_BLOCK_IDLE  0x1   // gated off (e.g. silence); stages with skip_idle ignore it
+#define PIPELINE_BLOCK_ONSET 0x2   // first active block after idle ones
+
+typedef struct {
+    int16_t *data;
+    size_t frames;                 // valid frames in data
+    uint64_t seq;
+    unsigned int flags;
+    uint64_t created_ns;           // when the source started filling it
+    uint64_t enqueued_ns;          // when the previous stage handed it on
+} PipelineBlock;
+
+typedef struct PipelineStage PipelineStage;
+
+// Return 0 to pass the block on. A source returns 1 at end of stream.
+// Any negative value stops the pipeline.
+typedef int (*PipelineStageFn)(PipelineStage *stage, PipelineBlock *block, int worker);
+
+typedef struct {
+    uint64_t blocks;
+    uint64_t busy_ns;
+    uint64_t busy_max_ns;
+    uint64_t wait_ns;
+    uint64_t wait_max_ns;
+    uint64_t latency_ns;           // end to end, last stage only
+    uint64_t latency_max_ns;
+    uint64_t stall_ns;             // source only: time waiting for a free block
+} PipelineStageStats;
+
+typedef struct {
+    PipelineBlock **slots;
+    size_t mask;
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+} PipelineQueue;
+
+typedef struct Pipeline Pipeline;
+
+struct PipelineStage {
+    const char *name;
+    PipelineStageFn process;
+    void *ctx;
+    int workers;
+    int skip_idle;
+    Pipeline *pipeline;
+    int index;
+    PipelineStageStats stats[PIPELINE_MAX_WORKERS];
+    pthread_t threads[PIPELINE_MAX_WORKERS];
+};
+
+struct Pipeline {
+    int channels;
+    size_t block_frames;
+    size_t block_count;
+    PipelineBlock *blocks;
+    int16_t *storage;
+
+    PipelineStage stages[PIPELINE_MAX_STAGES];
+    int stage_count;
+    // links[i][a][b]: worker a of stage i -> worker b of stage i + 1
+    PipelineQueue links[PIPELINE_MAX_STAGES - 1][PIPELINE_MAX_WORKERS][PIPELINE_MAX_WORKERS];
+    // Last stage worker b -> source, returning used blocks
+    PipelineQueue free_queues[PIPELINE_MAX_WORKERS];
+
+    atomic_uint_fast64_t end_seq;  // number of blocks produced once the source stops
+    atomic_int stop;
+    atomic_int error;
+};
+
+static inline uint64_t pipeline_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline int pipeline_queue_init(PipelineQueue *q, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    q->slots = calloc(size, sizeof(PipelineBlock *));
+    q->mask = size - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return q->slots ? 0 : -1;
+}
+
+static inline void pipeline_queue_push(PipelineQueue *q, PipelineBlock *block) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    // Capacity is at least the pool size, so this can never overflow
+    q->slots[head & q->mask] = block;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+}
+
+static inline PipelineBlock *pipeline_queue_pop(PipelineQueue *q) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&q->head, memory_order_acquire)) {
+        return NULL;
+    }
+    PipelineBlock *block = q->slots[tail & q->mask];
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return block;
+}
+
+// Spin briefly, then yield, then sleep; keeps idle stages off the CPU
+static inline void pipeline_backoff(int *spins) {
+    if (*spins < 64) {
+        (*spins)++;
+    } else if (*spins < 128) {
+        (*spins)++;
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, 50000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static inline Pipeline *pipeline_create(int channels, size_t block_frames, size_t block_count) {
+    Pipeline *p = calloc(1, sizeof(Pipeline));
+    if (!p) {
+        return NULL;
+    }
+    p->channels = channels;
+    p->block_frames = block_frames;
+    p->block_count = block_count;
+    p->blocks = calloc(block_count, sizeof(PipelineBlock));
+    p->storage = malloc(block_count * block_frames * channels * sizeof(int16_t));
+    if (!p->blocks || !p->storage) {
+        free(p->blocks);
+        free(p->storage);
+        free(p);
+        return NULL;
+    }
+    for (size_t i = 0; i < block_count; i++) {
+        p->blocks[i].data = p->storage + i * block_frames * channels;
+    }
+    atomic_init(&p->end_seq, UINT64_MAX);
+    atomic_init(&p->stop, 0);
+    atomic_init(&p->error, 0);
+    return p;
+}
+
+static inline PipelineStage *pipeline_add_stage(Pipeline *p, const char *name, PipelineStageFn process,
+                                                void *ctx, int workers) {
+    if (p->stage_count >= PIPELINE_MAX_STAGES) {
+        return NULL;
+    }
+    if (workers < 1) workers = 1;
+    if (workers > PIPELINE_MAX_WORKERS) workers = PIPELINE_MAX_WORKERS;
+    if (p->stage_count == 0) workers = 1;
+
+    PipelineStage *stage = &p->stages[p->stage_count];
+    memset(stage, 0, sizeof(*stage));
+    stage->name = name;
+    stage->process = process;
+    stage->ctx = ctx;
+    stage->workers = workers;
+    stage->pipeline = p;
+    stage->index = p->stage_count++;
+    return stage;
+}
+
+// Ask the source to finish; blocks already in flight are still drained
+static inline void pipeline_stop(Pipeline *p) {
+    atomic_store(&p->stop, 1);
+}
+
+static inline void pipeline_account(PipelineStageStats *st, PipelineBlock *block, uint64_t start, uint64_t end) {
+    uint64_t wait = start - block->enqueued_ns;
+    uint64_t busy = end - start;
+    st->blocks++;
+    st->wait_ns += wait;
+    st->busy_ns += busy;
+    if (wait > st->wait_max_ns) st->wait_max_ns = wait;
+    if (busy > st->busy_max_ns) st->busy_max_ns = busy;
+}
+
+static inline void *pipeline_source_thread(void *arg) {
+    PipelineStage *stage = arg;
+    Pipeline *p = stage->pipeline;
+    PipelineStage *next = &p->stages[1];
+    PipelineStageStats *st = &stage->stats[0];
+    PipelineStage *last = &p->stages[p->stage_count - 1];
+    size_t unused = 0;             // blocks never handed out yet
+    int free_rr = 0;
+    uint64_t seq;
+
+    for (seq = 0; !atomic_load(&p->stop); seq++) {
+        PipelineBlock *block = NULL;
+        if (unused < p->block_count) {
+            block = &p->blocks[unused++];
+        } else {
+            uint64_t stall_start = pipeline_now_ns();
+            int spins = 0;
+            while (!block && !atomic_load(&p->stop)) {
+                for (int i = 0; i < last->workers && !block; i++) {
+                    block = pipeline_queue_pop(&p->free_queues[(free_rr + i) % last->workers]);
+                }
+                if (!block) {
+                    pipeline_backoff(&spins);
+                }
+            }
+            free_rr = (free_rr + 1) % last->workers;
+            st->stall_ns += pipeline_now_ns() - stall_start;
+            if (!block) {
+                break;
+            }
+        }
+
+        block->seq = seq;
+        block->flags = 0;
+        block->frames = 0;
+        block->created_ns = pipeline_now_ns();
+        int ret = stage->process(stage, block, 0);
+        if (ret != 0) {
+            if (ret < 0) {
+                atomic_store(&p->error, ret);
+            }
+            break;
+        }
+        uint64_t end = pipeline_now_ns();
+        block->enqueued_ns = block->created_ns;
+        pipeline_account(st, block, block->created_ns, end);
+
+        block->enqueued_ns = end;
+        pipeline_queue_push(&p->links[0][0][seq % next->workers], block);
+    }
+
+    atomic_store(&p->end_seq, seq);
+    return NULL;
+}
+
+typedef struct {
+    PipelineStage *stage;
+    int worker;
+} PipelineWorkerArg;
+
+static inline void *pipeline_worker_thread(void *arg) {
+    PipelineWorkerArg *wa = arg;
+    PipelineStage *stage = wa->stage;
+    int worker = wa->worker;
+    Pipeline *p = stage->pipeline;
+    PipelineStage *prev = &p->stages[stage->index - 1];
+    int is_last = stage->index == p->stage_count - 1;
+    PipelineStage *next = is_last ? NULL : &p->stages[stage->index + 1];
+    PipelineStageStats *st = &stage->stats[worker];
+
+    for (uint64_t seq = worker; ; seq += stage->workers) {
+        PipelineQueue *in = &p->links[stage->index - 1][seq % prev->workers][worker];
+        PipelineBlock *block;
+        int spins = 0;
+        while (!(block = pipeline_queue_pop(in))) {
+            if (seq >= atomic_load(&p->end_seq)) {
+                return NULL;
+            }
+            pipeline_backoff(&spins);
+        }
+
+        uint64_t start = pipeline_now_ns();
+        if (!(stage->skip_idle && (block->flags & PIPELINE_BLOCK_IDLE)) && !atomic_load(&p->error)) {
+            int ret = stage->process(stage, block, worker);
+            if (ret < 0) {
+                atomic_store(&p->error, ret);
+                pipeline_stop(p);
+            }
+        }
+        uint64_t end = pipeline_now_ns();
+        pipeline_account(st, block, start, end);
+
+        if (is_last) {
+            uint64_t latency = end - block->created_ns;
+            st->latency_ns += latency;
+            if (latency > st->latency_max_ns) st->latency_max_ns = latency;
+            pipeline_queue_push(&p->free_queues[worker], block);
+        } else {
+            block->enqueued_ns = end;
+            pipeline_queue_push(&p->links[stage->index][worker][seq % next->workers], block);
+        }
+    }
+}
+
+// Start every stage and wait until the stream has drained.
+// Returns 0 or the first negative stage result.
+static inline int pipeline_run(Pipeline *p) {
+    PipelineWorkerArg args[PIPELINE_MAX_STAGES][PIPELINE_MAX_WORKERS];
+
+    if (p->stage_count < 2) {
+        return -1;
+    }
+    for (int i = 0; i < p->stage_count - 1; i++) {
+        for (int a = 0; a < p->stages[i].workers; a++) {
+            for (int b = 0; b < p->stages[i + 1].workers; b++) {
+                if (pipeline_queue_init(&p->links[i][a][b], p->block_count) < 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    for (int b = 0; b < p->stages[p->stage_count - 1].workers; b++) {
+        if (pipeline_queue_init(&p->free_queues[b], p->block_count) < 0) {
+            return -1;
+        }
+    }
+
+    // Start from the sink so consumers are ready before data flows
+    for (int i = p->stage_count - 1; i > 0; i--) {
+        for (int w = 0; w < p->stages[i].workers; w++) {
+            args[i][w].stage = &p->stages[i];
+            args[i][w].worker = w;
+            pthread_create(&p->stages[i].threads[w], NULL, pipeline_worker_thread, &args[i][w]);
+        }
+    }
+    pthread_create(&p->stages[0].threads[0], NULL, pipeline_source_thread, &p->stages[0]);
+
+    for (int i = 0; i < p->stage_count; i++) {
+        for (int w = 0; w < p->stages[i].workers; w++) {
+            pthread_join(p->stages[i].threads[w], NULL);
+        }
+    }
+    return atomic_load(&p->error);
+}
+
+static inline void pipeline_report(const Pipeline *p, FILE *out) {
+    fprintf(out, "%-10s %7s %8s %10s %10s %10s %10s\n",
+            "stage", "workers", "blocks", "busy avg", "busy max", "wait avg", "wait max");
+    for (int i = 0; i < p->stage_count; i++) {
+        const PipelineStage *stage = &p->stages[i];
+        PipelineStageStats total = {0};
+        for (int w = 0; w < stage->workers; w++) {
+            const PipelineStageStats *st = &stage->stats[w];
+            total.blocks += st->blocks;
+            total.busy_ns += st->busy_ns;
+            total.wait_ns += st->wait_ns;
+            total.latency_ns += st->latency_ns;
+            total.stall_ns += st->stall_ns;
+            if (st->busy_max_ns > total.busy_max_ns) total.busy_max_ns = st->busy_max_ns;
+            if (st->wait_max_ns > total.wait_max_ns) total.wait_max_ns = st->wait_max_ns;
+            if (st->latency_max_ns > total.latency_max_ns) total.latency_max_ns = st->latency_max_ns;
+        }
+        double n = total.blocks ? (double)total.blocks : 1.0;
+        fprintf(out, "%-10s %7d %8llu %8.1fus %8.1fus %8.1fus %8.1fus\n",
+                stage->name, stage->workers, (unsigned long long)total.blocks,
+                total.busy_ns / n / 1e3, total.busy_max_ns / 1e3,
+                total.wait_ns / n / 1e3, total.wait_max_ns / 1e3);
+        if (i == 0 && total.stall_ns) {
+            fprintf(out, "%-10s backpressure stall %.1f ms total\n", "", total.stall_ns / 1e6);
+        }
+        if (i == p->stage_count - 1) {
+            fprintf(out, "end-to-end latency avg %.2f ms, max %.2f ms\n",
+                    total.latency_ns / n / 1e6, total.latency_max_ns / 1e6);
+        }
+    }
+}
+
+static inline void pipeline_destroy(Pipeline *p) {
+    if (!p) {
+        return;
+    }
+    for (int i = 0; i < PIPELINE_MAX_STAGES - 1; i++) {
+        for (int a = 0; a < PIPELINE_MAX_WORKERS; a++) {
+            for (int b = 0; b < PIPELINE_MAX_WORKERS; b++) {
+                free(p->links[i][a][b].slots);
+            }
+        }
+    }
+    for (int b = 0; b < PIPELINE_MAX_WORKERS; b++) {
+        free(p->free_queues[b].slots);
+    }
+    free(p->blocks);
+    free(p->storage);
+    free(p);
+}
+
+#endif
@@ -5,18 +5,22 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "audio_stats.h"
+#include "pcm_reconnect.h"
+#include "peak_index.h"
+#include "vad.h"
+
 #define SAMPLE_RATE 44100
 #define CHANNELS    2
 #define DURATION    5  // seconds
 #define FREQ        440 // Hz (A4 note)
 #define BUFFER_SIZE 1024
-
-typedef struct {
-    double peak_amplitude;
-    double average_amplitude;
-    int clipping_count;
-    double rms_level;
-} AudioStats;
+#define PERIOD_FRAMES   1024 // capture block size, also the VAD decision unit
+#define VAD_PREROLL_MS  250  // audio kept ahead of each onset
+#define VAD_HANGOVER_MS 400  // keep recording this long after activity stops
+#define VAD_USE_ZCR     1
+#define OVERVIEW_COLUMNS 10  // waveform overview printed after recording
+#define RECONNECT_TIMEOUT_MS 10000 // how long to wait for an unplugged device to return
 
 // Initialize ALSA mixer
 int setup_mixer_controls() {
@@ -53,6 +57,11 @@ int setup_mixer_controls() {
     snd_mixer_selem_id_set_name(sid, "Master");
     
     elem = snd_mixer_find_selem(mixer, sid);
+    if (!elem) {
+        // USB cards expose their Feature Unit gain as "PCM" instead
+        snd_mixer_selem_id_set_name(sid, "PCM");
+        elem = snd_mixer_find_selem(mixer, sid);
+    }
     if (elem) {
         long min, max;
         snd_mixer_selem_get_playback_volume_range(elem, &min, &max);
@@ -63,6 +72,18 @@ int setup_mixer_controls() {
     return 0;
 }
 
+// Wait for an unplugged device to come back; *handle is NULL on failure
+static int reconnect(PcmReconnect *rc, snd_pcm_t **handle) {
+    printf("Device lost, waiting for it to come back...\n");
+    int err = pcm_reconnect_reopen(rc, handle, RECONNECT_TIMEOUT_MS);
+    if (err < 0) {
+        printf("Device did not come back: %s\n", snd_strerror(err));
+        return err;
+    }
+    printf("Reconnected in %.0f ms\n", rc->last_recovery_ms);
+    return 0;
+}
+
 // Generate test tone
 void generate_sine_wave(int16_t *buffer, int samples) {
     for (int i = 0; i < samples; i++) {
@@ -100,6 +121,8 @@ int test_playback() {
         snd_pcm_close(handle);
         return err;
     }
+    PcmReconnect rc = {0};
+    pcm_reconnect_save(&rc, handle, "default", SND_PCM_STREAM_PLAYBACK);
     
     int samples = SAMPLE_RATE * DURATION;
     int16_t *buffer = malloc(samples * CHANNELS * sizeof(int16_t));
@@ -113,21 +136,35 @@ int test_playback() {
         if (err == -EPIPE) {
             printf("Buffer underrun, recovering...\n");
             snd_pcm_prepare(handle);
+            continue;
+        } else if (pcm_reconnect_lost(err)) {
+            // Replay whatever was still queued on the device that went away
+            long unheard = rc.last_delay;
+            if (reconnect(&rc, &handle) < 0) {
+                break;
+            }
+            frames = frames + unheard > samples ? samples : frames + unheard;
+            continue;
         } else if (err < 0) {
             printf("Write error: %s\n", snd_strerror(err));
             break;
         }
         frames -= err;
+        pcm_reconnect_track(&rc, handle);
     }
     
     free(buffer);
+    if (!handle) {
+        return -ENODEV;
+    }
     snd_pcm_drain(handle);
     snd_pcm_close(handle);
     return 0;
 }
 
-// Test recording functionality
-int test_recording(const char *filename) {
+// Test recording functionality. Level statistics for everything stored
+// are accumulated into *stats as each period is written.
+int test_recording(const char *filename, AudioStatsAccumulator *stats) {
     printf("\n=== Testing Recording ===\n");
     snd_pcm_t *handle;
     int err;
@@ -153,84 +190,116 @@ int test_recording(const char *filename) {
         return err;
     }
     
+    PcmReconnect rc = {0};
+    pcm_reconnect_save(&rc, handle, "default", SND_PCM_STREAM_CAPTURE);
+    
     printf("Recording for %d seconds...\n", DURATION);
     printf("Please make some noise!\n");
     
-    int samples = SAMPLE_RATE * DURATION;
-    int16_t *buffer = malloc(samples * CHANNELS * sizeof(int16_t));
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        printf("Error opening %s\n", filename);
+        snd_pcm_close(handle);
+        return -1;
+    }
+
+    // Only blocks the VAD marks as active (plus pre-roll) reach the file
+    Vad vad;
+    if (vad_init(&vad, CHANNELS, SAMPLE_RATE, VAD_PREROLL_MS, VAD_HANGOVER_MS) < 0) {
+        printf("Failed to allocate VAD pre-roll\n");
+        fclose(f);
+        snd_pcm_close(handle);
+        return -1;
+    }
+    vad.use_zcr = VAD_USE_ZCR;
+
+    // Level pyramid built alongside the stored audio
+    char index_filename[256];
+    snprintf(index_filename, sizeof(index_filename), "%s.peaks", filename);
+    PeakIndexWriter peaks;
+    if (peak_index_create(&peaks, index_filename, CHANNELS, SAMPLE_RATE) < 0) {
+        printf("Error opening %s\n", index_filename);
+        vad_free(&vad);
+        fclose(f);
+        snd_pcm_close(handle);
+        return -1;
+    }
+
+    int16_t *buffer = malloc(PERIOD_FRAMES * CHANNELS * sizeof(int16_t));
+    int16_t *preroll = malloc((vad.preroll_capacity + 1) * CHANNELS * sizeof(int16_t));
     
-    int frames = samples;
+    int frames = SAMPLE_RATE * DURATION;
     while (frames > 0) {
-        err = snd_pcm_readi(handle, buffer + (samples - frames) * CHANNELS, frames);
+        int chunk = frames < PERIOD_FRAMES ? frames : PERIOD_FRAMES;
+        err = snd_pcm_readi(handle, buffer, chunk);
         if (err == -EPIPE) {
             printf("Buffer overrun, recovering...\n");
             snd_pcm_prepare(handle);
+            continue;
+        } else if (pcm_reconnect_lost(err)) {
+            // Audio from while the device was gone is simply missing
+            if (reconnect(&rc, &handle) < 0) {
+                break;
+            }
+            continue;
         } else if (err < 0) {
             printf("Read error: %s\n", snd_strerror(err));
             break;
         }
         frames -= err;
+
+        switch (vad_process(&vad, buffer, err)) {
+        case VAD_ONSET: {
+            size_t n = vad_take_preroll(&vad, preroll);
+            fwrite(preroll, sizeof(int16_t), n * CHANNELS, f);
+            fwrite(buffer, sizeof(int16_t), err * CHANNELS, f);
+            peak_index_add(&peaks, preroll, n);
+            peak_index_add(&peaks, buffer, err);
+            audio_stats_accumulate(stats, preroll, n * CHANNELS);
+            audio_stats_accumulate(stats, buffer, err * CHANNELS);
+            break;
+        }
+        case VAD_ACTIVE:
+            fwrite(buffer, sizeof(int16_t), err * CHANNELS, f);
+            peak_index_add(&peaks, buffer, err);
+            audio_stats_accumulate(stats, buffer, err * CHANNELS);
+            break;
+        case VAD_SILENT:
+            break;
+        }
     }
     
-    FILE *f = fopen(filename, "wb");
-    if (f) {
-        fwrite(buffer, sizeof(int16_t), samples * CHANNELS, f);
-        fclose(f);
-        printf("Recording saved to %s\n", filename);
+    fclose(f);
+    // A failed index stops growing as soon as it fails; drop what is there
+    if (peak_index_finish(&peaks) < 0) {
+        printf("Error writing %s, index dropped\n", index_filename);
+        unlink(index_filename);
     }
+    printf("Recording saved to %s (%.1f of %.1f seconds active)\n", filename,
+           (double)vad.frames_passed / SAMPLE_RATE, (double)vad.frames_in / SAMPLE_RATE);
     
+    vad_free(&vad);
+    free(preroll);
     free(buffer);
+    if (!handle) {
+        return -ENODEV;
+    }
     snd_pcm_drain(handle);
     snd_pcm_close(handle);
     return 0;
 }
 
-// Analyze recorded audio
-AudioStats analyze_audio(int16_t *buffer, size_t buffer_size) {
-    AudioStats stats = {0};
-    double sum = 0;
-    double squared_sum = 0;
-    
-    for (size_t i = 0; i < buffer_size; i++) {
-        double amplitude = fabs((double)buffer[i] / 32768.0);
-        sum += amplitude;
-        squared_sum += amplitude * amplitude;
-        
-        if (amplitude > stats.peak_amplitude) {
-            stats.peak_amplitude = amplitude;
-        }
-        
-        if (abs(buffer[i]) >= 32767) {
-            stats.clipping_count++;
-        }
-    }
-    
-    stats.average_amplitude = sum / buffer_size;
-    stats.rms_level = sqrt(squared_sum / buffer_size);
-    
-    return stats;
-}
-
-// Verify and analyze recording
-int process_recording(const char *filename) {
+// Report the statistics gathered while recording, then verify playback
+int process_recording(const char *filename, const AudioStatsAccumulator *acc) {
     printf("\n=== Processing Recording ===\n");
-    
-    FILE *f = fopen(filename, "rb");
-    if (!f) {
-        printf("Error opening recorded file\n");
-        return -1;
+
+    // With VAD gating nothing is stored if nothing was heard
+    if (acc->count == 0) {
+        printf("No active audio was stored, nothing to analyze\n");
+        return 0;
     }
     
-    fseek(f, 0, SEEK_END);
-    long file_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    int16_t *buffer = malloc(file_size);
-    size_t read_size = fread(buffer, 1, file_size, f);
-    fclose(f);
-    
-    // Analyze audio
-    AudioStats stats = analyze_audio(buffer, read_size / sizeof(int16_t));
+    AudioStats stats = audio_stats_result(acc);
     
     // Print analysis
     printf("\nAudio Analysis Results:\n");
@@ -239,21 +308,26 @@ int process_recording(const char *filename) {
     printf("RMS Level: %.2f dB\n", 20 * log10(stats.rms_level));
     printf("Clipping Detected: %d instances\n", stats.clipping_count);
     
-    // Save metadata
-    char metadata_filename[256];
-    snprintf(metadata_filename, sizeof(metadata_filename), "%s.meta", filename);
-    f = fopen(metadata_filename, "w");
-    if (f) {
-        fprintf(f, "Recording Metadata:\n");
-        fprintf(f, "Sample Rate: %d Hz\n", SAMPLE_RATE);
-        fprintf(f, "Channels: %d\n", CHANNELS);
-        fprintf(f, "Duration: %d seconds\n", DURATION);
-        fprintf(f, "Peak Level: %.2f dB\n", 20 * log10(stats.peak_amplitude));
-        fprintf(f, "Average Level: %.2f dB\n", 20 * log10(stats.average_amplitude));
-        fprintf(f, "RMS Level: %.2f dB\n", 20 * log10(stats.rms_level));
-        fprintf(f, "Clipping Instances: %d\n", stats.clipping_count);
-        fclose(f);
-        printf("\nMetadata saved to %s\n", metadata_filename);
+    // Levels come from the .peaks index written during recording
+    char index_filename[256];
+    snprintf(index_filename, sizeof(index_filename), "%s.peaks", filename);
+    PeakIndexReader index;
+    if (peak_index_open(&index, index_filename) == 0) {
+        uint64_t total = index.header.total_frames;
+        printf("\nLevel overview from %s (%.2f seconds, %u levels):\n", index_filename,
+               (double)total / index.header.sample_rate, index.header.level_count);
+        PeakEntry overview[OVERVIEW_COLUMNS * CHANNELS];
+        if (total && peak_index_render(&index, 0, total, OVERVIEW_COLUMNS, overview) == 0) {
+            for (int col = 0; col < OVERVIEW_COLUMNS; col++) {
+                PeakEntry *e = &overview[col * CHANNELS];
+                int peak = abs(e->min) > abs(e->max) ? abs(e->min) : abs(e->max);
+                printf("  %5.2fs  peak %7.2f dB  RMS %7.2f dB\n",
+                       (double)total * col / OVERVIEW_COLUMNS / index.header.sample_rate,
+                       20 * log10(peak / 32768.0 + 1e-12), 10 * log10(e->mean_square + 1e-12));
+            }
+        }
+        peak_index_close(&index);
+        printf("\nIndex saved to %s\n", index_filename);
     }
     
     // Playback verification
@@ -263,7 +337,6 @@ int process_recording(const char *filename) {
     
     if ((err = snd_pcm_open(&handle, "default", SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
         printf("Playback open error: %s\n", snd_strerror(err));
-        free(buffer);
         return -1;
     }
     
@@ -280,28 +353,58 @@ int process_recording(const char *filename) {
     if ((err = snd_pcm_hw_params(handle, params)) < 0) {
         printf("Hardware parameter setting failed: %s\n", snd_strerror(err));
         snd_pcm_close(handle);
-        free(buffer);
         return -1;
     }
+    PcmReconnect rc = {0};
+    pcm_reconnect_save(&rc, handle, "default", SND_PCM_STREAM_PLAYBACK);
     
-    printf("Playing back recording...\n");
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        printf("Error opening recorded file\n");
+        snd_pcm_close(handle);
+        return -1;
+    }
     
-    size_t frames = read_size / (CHANNELS * sizeof(int16_t));
-    size_t pos = 0;
+    printf("Playing back recording...\n");
     
-    while (pos < frames) {
-        err = snd_pcm_writei(handle, buffer + pos * CHANNELS, frames - pos);
-        if (err == -EPIPE) {
-            printf("Buffer underrun, recovering...\n");
-            snd_pcm_prepare(handle);
-        } else if (err < 0) {
-            printf("Write error: %s\n", snd_strerror(err));
+    // Stream the file a period at a time; nothing needs it all in memory
+    int16_t *buffer = malloc(PERIOD_FRAMES * CHANNELS * sizeof(int16_t));
+    size_t frames;
+    while ((frames = fread(buffer, CHANNELS * sizeof(int16_t), PERIOD_FRAMES, f)) > 0) {
+        size_t pos = 0;
+        while (pos < frames) {
+            err = snd_pcm_writei(handle, buffer + pos * CHANNELS, frames - pos);
+            if (err == -EPIPE) {
+                printf("Buffer underrun, recovering...\n");
+                snd_pcm_prepare(handle);
+                continue;
+            } else if (pcm_reconnect_lost(err)) {
+                // Seek back over what was still queued and read it again
+                long unheard = rc.last_delay + (long)(frames - pos);
+                if (reconnect(&rc, &handle) < 0) {
+                    break;
+                }
+                long done = ftell(f) / (long)(CHANNELS * sizeof(int16_t));
+                fseek(f, -(unheard < done ? unheard : done) * (long)(CHANNELS * sizeof(int16_t)), SEEK_CUR);
+                pos = frames;
+                break;
+            } else if (err < 0) {
+                printf("Write error: %s\n", snd_strerror(err));
+                break;
+            }
+            pos += err;
+            pcm_reconnect_track(&rc, handle);
+        }
+        if (pos < frames) {
             break;
         }
-        pos += err;
     }
     
+    fclose(f);
     free(buffer);
+    if (!handle) {
+        return -1;
+    }
     snd_pcm_drain(handle);
     snd_pcm_close(handle);
     return 0;
@@ -329,13 +432,14 @@ int main() {
     
     // Test recording
     const char *recording_file = "test_recording.raw";
-    if (test_recording(recording_file) < 0) {
+    AudioStatsAccumulator stats = {0};
+    if (test_recording(recording_file, &stats) < 0) {
         printf("Recording test failed\n");
         return 1;
     }
     
     // Process and verify recording
-    if (process_recording(recording_file) < 0) {
+    if (process_recording(recording_file, &stats) < 0) {
         printf("Recording processing failed\n");
         return 1;
     }
@@ -343,7 +447,7 @@ int main() {
     printf("\n=== Test Suite Complete ===\n");
     printf("Files generated:\n");
     printf("1. %s (Raw audio data)\n", recording_file);
-    printf("2. %s.meta (Recording metadata)\n", recording_file);
+    printf("2. %s.peaks (Peak/RMS level index)\n", recording_file);
     
     return 0;
 }
@@ -1,34 +1,2070 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/ctype.h>
 #include <linux/init.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/usb.h>
+#include <linux/usb/audio.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
 #include <sound/core.h>
+#include <sound/control.h>
+#include <sound/info.h>
 #include <sound/initval.h>
 #include <sound/pcm.h>
+#include <sound/pcm_params.h>
+#include <sound/tlv.h>
+
+#define CREATE_TRACE_POINTS
+#include "usb_audio_trace.h"
 
 MODULE_AUTHOR("Shivam");
 MODULE_DESCRIPTION("USB Audio Driver for Waveshare USB Audio on Raspberry Pi 4");
 MODULE_LICENSE("GPL");
 
+/*
+ * Streaming engine
+ *
+ * Each direction owns a ring of isochronous URBs that is allocated once at
+ * probe time (transfer buffers from usb_alloc_coherent(), so no mapping
+ * happens per submit) and kept in flight while the stream runs: every
+ * completion refills its URB and resubmits it from interrupt context.
+ * nrpacks trades latency against interrupt rate: each URB carries nrpacks
+ * packets (1 ms each at full speed), so completions arrive every nrpacks ms
+ * and nurbs * nrpacks ms of audio is queued at the controller.
+ */
+
+#define MY_AUDIO_MAX_URBS   16
+#define MY_AUDIO_MAX_PACKS  48
+#define MY_AUDIO_SYNC_URBS  2
+#define MY_AUDIO_MAX_FORMATS 16
+#define MY_AUDIO_MAX_RATES  16
+#define MY_HIST_BUCKETS     18      /* log2 microseconds, last bucket open-ended */
+
+static int nrpacks = 8;
+module_param(nrpacks, int, 0444);
+MODULE_PARM_DESC(nrpacks, "Isochronous packets per URB (1-48)");
+
+static int nurbs = 4;
+module_param(nurbs, int, 0444);
+MODULE_PARM_DESC(nurbs, "URBs kept in flight per stream (2-16)");
+
+/* Several devices can be attached at once; each takes the next enabled slot */
+static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;
+module_param_array(index, int, NULL, 0444);
+MODULE_PARM_DESC(index, "Index value for the USB audio card.");
+
+static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;
+module_param_array(id, charp, NULL, 0444);
+MODULE_PARM_DESC(id, "ID string for the USB audio card.");
+
+static bool enable[SNDRV_CARDS] = SNDRV_DEFAULT_ENABLE_PNP;
+module_param_array(enable, bool, NULL, 0444);
+MODULE_PARM_DESC(enable, "Enable the USB audio card.");
+
+struct my_audio;
+struct my_stream;
+
+/* One altsetting of a streaming interface, as its descriptors describe it */
+struct my_format {
+    int altsetting;
+    unsigned int ep;
+    unsigned int maxpacksize;
+    unsigned int datainterval;
+    unsigned int channels;
+    unsigned int sample_bytes;      /* bSubframeSize */
+    unsigned int bits;              /* bBitResolution */
+    snd_pcm_format_t pcm_format;
+    unsigned int nr_rates;          /* 0: continuous from rate_min to rate_max */
+    unsigned int rates[MY_AUDIO_MAX_RATES];
+    unsigned int rate_min;
+    unsigned int rate_max;
+    unsigned int sync_ep;           /* feedback endpoint, 0 if none */
+    unsigned int sync_maxpacksize;
+    unsigned int sync_interval;
+};
+
+struct my_urb {
+    struct my_stream *stream;
+    struct urb *urb;
+    unsigned int index;
+    unsigned int frames;            /* playback frames carried by this URB */
+    ktime_t submitted;
+};
+
+/*
+ * Data path statistics, shown in debugfs. Latency is submit to
+ * completion of each URB; jitter is how far the time between consecutive
+ * completions strays from the nominal nrpacks packet intervals.
+ */
+struct my_stream_stats {
+    u64 urbs_submitted;
+    u64 urbs_completed;
+    u64 submit_errors;
+    u64 urb_errors;                 /* completions with a non-zero status */
+    u64 packet_errors;              /* packets the controller failed or missed */
+    u64 periods;
+    u64 xruns;                      /* ring under/overruns seen at URB level */
+    s64 max_latency_us;
+    s64 max_jitter_us;
+    u64 latency_hist[MY_HIST_BUCKETS];
+    u64 jitter_hist[MY_HIST_BUCKETS];
+};
+
+struct my_stream {
+    struct my_audio *chip;
+    int direction;                  /* SNDRV_PCM_STREAM_PLAYBACK or _CAPTURE */
+    struct usb_interface *intf;     /* claimed audio streaming interface */
+    int iface;
+    struct my_format formats[MY_AUDIO_MAX_FORMATS];
+    unsigned int nr_formats;
+    unsigned int rate_list[MY_AUDIO_MAX_FORMATS * MY_AUDIO_MAX_RATES];
+    struct snd_pcm_hw_constraint_list rate_constraint;
+    bool continuous_rates;
+
+    /* The format chosen by hw_params; the fields below follow it */
+    const struct my_format *cur;
+    int altsetting;
+    unsigned int ep;
+    unsigned int pipe;
+    unsigned int maxpacksize;
+    unsigned int datainterval;      /* log2 of the packet interval */
+    unsigned int packs_per_sec;
+
+    unsigned int channels;
+    unsigned int sample_bytes;
+    unsigned int frame_bytes;
+    unsigned int rate;
+
+    /* Frames per packet as 16.16 fixed point; the phase carries the
+     * fraction so 44.1 kHz alternates 44- and 45-frame packets */
+    unsigned int freqn;
+    unsigned int phase;
+
+    /* Asynchronous playback: the device reports the rate it really
+     * consumes on a feedback endpoint, and freqn is steered towards it */
+    unsigned int sync_ep;           /* 0 if there is no feedback endpoint */
+    unsigned int sync_pipe;
+    unsigned int sync_maxpacksize;
+    unsigned int sync_interval;
+    struct my_urb sync_urbs[MY_AUDIO_SYNC_URBS];
+    unsigned long sync_active;
+    unsigned int freqn_nominal;
+    unsigned int freqm;             /* last accepted feedback, 16.16 frames per packet */
+    int fb_shift;                   /* feedback format, -1 until detected */
+    unsigned long long fb_count;
+    unsigned long long fb_rejected;
+
+    unsigned int nurbs;
+    unsigned int nrpacks;
+    unsigned int buf_packsize;      /* URB buffers fit the largest altsetting */
+    unsigned int sync_bufsize;
+    struct my_urb urbs[MY_AUDIO_MAX_URBS];
+    unsigned long active_urbs;      /* bit per URB owned by the host controller */
+    bool running;
+    bool configured;                /* altsetting selected and rate programmed */
+    spinlock_t lock;
+
+    /* ALSA side: the URB buffers are filled from / drained into the
+     * runtime's ring directly at hwptr */
+    struct snd_pcm_substream *substream;
+    unsigned int hwptr;             /* byte offset in the ring */
+    unsigned int transfer_done;     /* frames since the last period boundary */
+    unsigned int queued_frames;     /* playback frames submitted but not completed */
+    int last_frame;                 /* USB frame number of the last completion */
+
+    unsigned long long packets;
+    unsigned long long frames;
+    struct my_stream_stats stats;
+    ktime_t last_complete;
+};
+
+struct my_audio {
+    int slot;
+    struct usb_device *udev;
+    struct usb_interface *ctrl_intf;
+    struct snd_card *card;
+    struct snd_pcm *pcm;
+    struct my_stream streams[2];
+    bool disconnected;
+    struct mutex mixer_mutex;       /* mixer control caches and their USB requests */
+    struct dentry *debugfs_dir;
+};
+
+static struct usb_driver snd_my_audio_driver;
+
+static struct dentry *my_debugfs_root;
+
+/* Attached devices by slot; probe and disconnect serialize on the mutex */
+static DEFINE_MUTEX(my_register_mutex);
+static struct my_audio *my_chips[SNDRV_CARDS];
+
+/*
+ * What each slot last served: the device key (serial number, or bus and
+ * port path when there is none) and the card number it got. A device that
+ * is unplugged and plugged back in gets the same slot, card number and id,
+ * so applications can reopen it by name while it re-enumerates.
+ */
+static char my_slot_keys[SNDRV_CARDS][48];
+static int my_slot_cards[SNDRV_CARDS] = { [0 ... SNDRV_CARDS - 1] = -1 };
+
+/* Find a class-specific interface descriptor of the given subtype */
+static void *my_find_cs_desc(unsigned char *buf, int len, u8 subtype)
+{
+    while (len >= 3) {
+        struct usb_descriptor_header *hdr = (void *)buf;
+
+        if (hdr->bLength < 3 || hdr->bLength > len)
+            break;
+        if (hdr->bDescriptorType == USB_DT_CS_INTERFACE && buf[2] == subtype)
+            return buf;
+        len -= hdr->bLength;
+        buf += hdr->bLength;
+    }
+    return NULL;
+}
+
+/*
+ * An asynchronous OUT endpoint paces itself from the device clock and
+ * names an isochronous IN endpoint (bSynchAddress) that reports how many
+ * frames per packet the device actually consumes.
+ */
+static void my_format_find_sync_ep(struct my_audio *chip, struct my_format *f,
+                                   struct usb_host_interface *alt)
+{
+    struct usb_endpoint_descriptor *epd = &alt->endpoint[0].desc;
+    struct usb_endpoint_descriptor *sync;
+    unsigned int addr;
+
+    f->sync_ep = 0;
+    if (!usb_endpoint_dir_out(epd) ||
+        (epd->bmAttributes & USB_ENDPOINT_SYNCTYPE) != USB_ENDPOINT_SYNC_ASYNC ||
+        alt->desc.bNumEndpoints < 2)
+        return;
+
+    sync = &alt->endpoint[1].desc;
+    if (!usb_endpoint_xfer_isoc(sync) || !usb_endpoint_dir_in(sync))
+        return;
+    addr = epd->bLength >= USB_DT_ENDPOINT_AUDIO_SIZE && epd->bSynchAddress ?
+           epd->bSynchAddress : sync->bEndpointAddress;
+    if (addr != sync->bEndpointAddress)
+        return;
+
+    f->sync_ep = usb_endpoint_num(sync);
+    f->sync_maxpacksize = max(usb_endpoint_maxp(sync), 4);
+    /* Full speed feedback comes every 2^bRefresh ms, high speed uses bInterval */
+    if (chip->udev->speed == USB_SPEED_FULL && sync->bLength >= USB_DT_ENDPOINT_AUDIO_SIZE &&
+        sync->bRefresh)
+        f->sync_interval = 1 << min_t(int, sync->bRefresh, 9);
+    else
+        f->sync_interval = 1 << (sync->bInterval ? min(sync->bInterval - 1, 15) : 0);
+}
+
+static unsigned int my_tsamfreq(const u8 *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+/*
+ * Parse one altsetting: isochronous data endpoint, PCM type I format with
+ * 16-, 24- or 32-bit subframes, and its discrete rate list or continuous
+ * rate range.
+ */
+static int my_format_parse(struct my_audio *chip, struct my_format *f,
+                           struct usb_host_interface *alt)
+{
+    struct uac_format_type_i_discrete_descriptor *fmt;
+    struct uac1_as_header_descriptor *hdr;
+    struct usb_endpoint_descriptor *epd;
+    unsigned int n, i;
+
+    if (alt->desc.bNumEndpoints < 1)
+        return -EINVAL;
+    epd = &alt->endpoint[0].desc;
+    if (!usb_endpoint_xfer_isoc(epd))
+        return -EINVAL;
+    hdr = my_find_cs_desc(alt->extra, alt->extralen, UAC_AS_GENERAL);
+    if (hdr && hdr->bLength >= sizeof(*hdr) &&
+        le16_to_cpu(hdr->wFormatTag) != UAC_FORMAT_TYPE_I_PCM)
+        return -EINVAL;
+    fmt = my_find_cs_desc(alt->extra, alt->extralen, UAC_FORMAT_TYPE);
+    if (!fmt || fmt->bLength < sizeof(*fmt) || fmt->bFormatType != UAC_FORMAT_TYPE_I ||
+        !fmt->bNrChannels)
+        return -EINVAL;
+
+    switch (fmt->bSubframeSize) {
+    case 2:
+        f->pcm_format = SNDRV_PCM_FORMAT_S16_LE;
+        break;
+    case 3:
+        f->pcm_format = SNDRV_PCM_FORMAT_S24_3LE;
+        break;
+    case 4:
+        /* Samples are MSB-aligned; the low bits beyond bBitResolution are 0 */
+        f->pcm_format = SNDRV_PCM_FORMAT_S32_LE;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    n = fmt->bSamFreqType;
+    if (fmt->bLength < sizeof(*fmt) + 3 * max(n, 2u))
+        return -EINVAL;
+    if (n == 0) {
+        f->nr_rates = 0;
+        f->rate_min = my_tsamfreq(fmt->tSamFreq[0]);
+        f->rate_max = my_tsamfreq(fmt->tSamFreq[1]);
+    } else {
+        f->nr_rates = min(n, (unsigned int)MY_AUDIO_MAX_RATES);
+        f->rate_min = UINT_MAX;
+        f->rate_max = 0;
+        for (i = 0; i < f->nr_rates; i++) {
+            f->rates[i] = my_tsamfreq(fmt->tSamFreq[i]);
+            f->rate_min = min(f->rate_min, f->rates[i]);
+            f->rate_max = max(f->rate_max, f->rates[i]);
+        }
+    }
+    if (!f->rate_min || f->rate_min > f->rate_max)
+        return -EINVAL;
+
+    f->altsetting = alt->desc.bAlternateSetting;
+    f->ep = usb_endpoint_num(epd);
+    f->maxpacksize = usb_endpoint_maxp(epd) * usb_endpoint_maxp_mult(epd);
+    f->datainterval = epd->bInterval ? min(epd->bInterval - 1, 3) : 0;
+    f->channels = fmt->bNrChannels;
+    f->sample_bytes = fmt->bSubframeSize;
+    f->bits = fmt->bBitResolution ? fmt->bBitResolution : f->sample_bytes * 8;
+    my_format_find_sync_ep(chip, f, alt);
+    return 0;
+}
+
+static bool my_format_has_rate(const struct my_format *f, unsigned int rate)
+{
+    unsigned int i;
+
+    if (!f->nr_rates)
+        return rate >= f->rate_min && rate <= f->rate_max;
+    for (i = 0; i < f->nr_rates; i++)
+        if (f->rates[i] == rate)
+            return true;
+    return false;
+}
+
+/* Direction of the first isochronous data endpoint in any altsetting */
+static int my_intf_direction(struct usb_interface *intf)
+{
+    unsigned int i;
+
+    for (i = 0; i < intf->num_altsetting; i++) {
+        struct usb_host_interface *alt = &intf->altsetting[i];
+
+        if (alt->desc.bNumEndpoints >= 1 && usb_endpoint_xfer_isoc(&alt->endpoint[0].desc))
+            return usb_endpoint_dir_in(&alt->endpoint[0].desc) ? SNDRV_PCM_STREAM_CAPTURE
+                                                               : SNDRV_PCM_STREAM_PLAYBACK;
+    }
+    return -EINVAL;
+}
+
+/* Collect every usable altsetting of a streaming interface into s */
+static int my_stream_parse_formats(struct my_stream *s, struct usb_interface *intf)
+{
+    unsigned int i, j, k;
+
+    s->nr_formats = 0;
+    for (i = 0; i < intf->num_altsetting && s->nr_formats < MY_AUDIO_MAX_FORMATS; i++) {
+        struct usb_host_interface *alt = &intf->altsetting[i];
+        struct my_format *f = &s->formats[s->nr_formats];
+
+        if (my_format_parse(s->chip, f, alt) < 0 ||
+            usb_endpoint_dir_in(&alt->endpoint[0].desc) != (s->direction == SNDRV_PCM_STREAM_CAPTURE))
+            continue;
+        s->nr_formats++;
+    }
+    if (!s->nr_formats)
+        return -EINVAL;
+    s->iface = intf->altsetting[0].desc.bInterfaceNumber;
+
+    /* Sorted union of the discrete rates, for the hw rate constraint */
+    s->continuous_rates = false;
+    k = 0;
+    for (i = 0; i < s->nr_formats; i++) {
+        const struct my_format *f = &s->formats[i];
+
+        if (!f->nr_rates)
+            s->continuous_rates = true;
+        for (j = 0; j < f->nr_rates; j++) {
+            unsigned int rate = f->rates[j];
+            unsigned int pos = 0;
+
+            while (pos < k && s->rate_list[pos] < rate)
+                pos++;
+            if (pos < k && s->rate_list[pos] == rate)
+                continue;
+            memmove(&s->rate_list[pos + 1], &s->rate_list[pos], (k - pos) * sizeof(rate));
+            s->rate_list[pos] = rate;
+            k++;
+        }
+    }
+    s->rate_constraint.count = k;
+    s->rate_constraint.list = s->rate_list;
+    s->rate_constraint.mask = 0;
+    return 0;
+}
+
+/*
+ * Point the stream (and its preallocated URBs) at a format and rate.
+ * Called with the stream stopped.
+ */
+static void my_stream_set_format(struct my_stream *s, const struct my_format *f, unsigned int rate)
+{
+    struct usb_device *udev = s->chip->udev;
+    unsigned int i;
+
+    s->cur = f;
+    s->altsetting = f->altsetting;
+    s->ep = f->ep;
+    s->pipe = s->direction == SNDRV_PCM_STREAM_CAPTURE ? usb_rcvisocpipe(udev, f->ep)
+                                                       : usb_sndisocpipe(udev, f->ep);
+    s->maxpacksize = f->maxpacksize;
+    s->datainterval = f->datainterval;
+    s->packs_per_sec = (udev->speed == USB_SPEED_FULL ? 1000 : 8000) >> f->datainterval;
+    s->channels = f->channels;
+    s->sample_bytes = f->sample_bytes;
+    s->frame_bytes = f->channels * f->sample_bytes;
+    s->rate = rate;
+
+    s->sync_ep = f->sync_ep;
+    s->sync_maxpacksize = f->sync_maxpacksize;
+    s->sync_interval = f->sync_interval;
+    s->sync_pipe = f->sync_ep ? usb_rcvisocpipe(udev, f->sync_ep) : 0;
+
+    for (i = 0; i < s->nurbs; i++) {
+        struct urb *urb = s->urbs[i].urb;
+
+        if (!urb)
+            continue;
+        urb->pipe = s->pipe;
+        urb->interval = 1 << s->datainterval;
+    }
+    for (i = 0; s->sync_ep && i < MY_AUDIO_SYNC_URBS; i++) {
+        struct urb *urb = s->sync_urbs[i].urb;
+
+        if (!urb)
+            continue;
+        urb->pipe = s->sync_pipe;
+        urb->interval = s->sync_interval;
+        urb->transfer_buffer_length = s->sync_maxpacksize;
+        urb->iso_frame_desc[0].length = s->sync_maxpacksize;
+    }
+}
+
+static const struct my_format *my_stream_find_format(struct my_stream *s, snd_pcm_format_t format,
+                                                     unsigned int channels, unsigned int rate)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nr_formats; i++) {
+        const struct my_format *f = &s->formats[i];
+
+        if (f->pcm_format == format && f->channels == channels && my_format_has_rate(f, rate))
+            return f;
+    }
+    return NULL;
+}
+
+/* UAC1 SET_CUR sampling frequency on the data endpoint */
+static int my_stream_set_rate(struct my_stream *s)
+{
+    struct usb_device *udev = s->chip->udev;
+    unsigned int ep = s->ep | (s->direction == SNDRV_PCM_STREAM_CAPTURE ? USB_DIR_IN : 0);
+    u8 *data;
+    int err;
+
+    data = kmalloc(3, GFP_KERNEL);
+    if (!data)
+        return -ENOMEM;
+    data[0] = s->rate;
+    data[1] = s->rate >> 8;
+    data[2] = s->rate >> 16;
+    err = usb_control_msg(udev, usb_sndctrlpipe(udev, 0), UAC_SET_CUR,
+                          USB_TYPE_CLASS | USB_RECIP_ENDPOINT | USB_DIR_OUT,
+                          UAC_EP_CS_ATTR_SAMPLE_RATE << 8, ep, data, 3, 1000);
+    kfree(data);
+    /* Fixed-rate devices may stall this request; that is not fatal */
+    if (err < 0 && err != -EPIPE)
+        return err;
+    return 0;
+}
+
+static int my_stream_card(struct my_stream *s)
+{
+    return s->chip->card->number;
+}
+
+static void my_hist_add(u64 *hist, s64 us)
+{
+    hist[us <= 0 ? 0 : min(fls64(us), MY_HIST_BUCKETS - 1)]++;
+}
+
+/* Frames in the next playback packet */
+static unsigned int my_stream_next_packet_frames(struct my_stream *s)
+{
+    s->phase += s->freqn;
+    return s->phase >> 16;
+}
+
+/* Count frames against the period size; true when a boundary is crossed */
+static bool my_stream_advance(struct my_stream *s, struct snd_pcm_runtime *runtime,
+                              unsigned int frames)
+{
+    s->frames += frames;
+    s->transfer_done += frames;
+    if (s->transfer_done < runtime->period_size)
+        return false;
+    s->transfer_done %= runtime->period_size;
+    return true;
+}
+
+/*
+ * Copy between the ALSA ring and a URB buffer at s->hwptr. The hw
+ * constraints keep the ring larger than a URB, but wrap as often as it
+ * takes anyway so no size can reach past either end of dma_area.
+ */
+static void my_ring_to_urb(struct my_stream *s, unsigned char *area, unsigned int buffer_bytes,
+                           unsigned char *dst, unsigned int len)
+{
+    while (len) {
+        unsigned int n = min(len, buffer_bytes - s->hwptr);
+
+        memcpy(dst, area + s->hwptr, n);
+        dst += n;
+        len -= n;
+        s->hwptr = (s->hwptr + n) % buffer_bytes;
+    }
+}
+
+static void my_urb_to_ring(struct my_stream *s, unsigned char *area, unsigned int buffer_bytes,
+                           const unsigned char *src, unsigned int len)
+{
+    while (len) {
+        unsigned int n = min(len, buffer_bytes - s->hwptr);
+
+        memcpy(area + s->hwptr, src, n);
+        src += n;
+        len -= n;
+        s->hwptr = (s->hwptr + n) % buffer_bytes;
+    }
+}
+
+/*
+ * Lay out the packets of a playback URB and copy the next bytes of the
+ * ALSA ring straight into its transfer buffer. Called with s->lock held;
+ * returns true if a period was consumed.
+ */
+static bool my_stream_prepare_playback(struct my_stream *s, struct my_urb *u)
+{
+    struct urb *urb = u->urb;
+    struct snd_pcm_runtime *runtime = s->substream->runtime;
+    unsigned int buffer_bytes = frames_to_bytes(runtime, runtime->buffer_size);
+    unsigned int offset = 0;
+    int i;
+
+    for (i = 0; i < urb->number_of_packets; i++) {
+        unsigned int frames = my_stream_next_packet_frames(s);
+        unsigned int bytes = min(frames * s->frame_bytes, s->maxpacksize);
+
+        urb->iso_frame_desc[i].offset = offset;
+        urb->iso_frame_desc[i].length = bytes;
+        s->phase &= 0xffff;
+        offset += bytes;
+        trace_my_usb_audio_packet(my_stream_card(s), s->direction, i, bytes, 0);
+    }
+    urb->transfer_buffer_length = offset;
+    s->packets += urb->number_of_packets;
+
+    /* Frames the application has written ahead of us; less than this URB
+     * means stale ring data is about to be sent */
+    if (snd_pcm_playback_hw_avail(runtime) < runtime->buffer_size) {
+        snd_pcm_uframes_t appl = runtime->control->appl_ptr % runtime->buffer_size;
+        snd_pcm_uframes_t pos = bytes_to_frames(runtime, s->hwptr);
+        long ahead = (appl + runtime->buffer_size - pos) % runtime->buffer_size;
+
+        if (ahead < offset / s->frame_bytes) {
+            s->stats.xruns++;
+            trace_my_usb_audio_xrun(my_stream_card(s), s->direction, ahead, offset / s->frame_bytes);
+        }
+    }
+
+    my_ring_to_urb(s, runtime->dma_area, buffer_bytes, urb->transfer_buffer, offset);
+
+    u->frames = offset / s->frame_bytes;
+    s->queued_frames += u->frames;
+    return my_stream_advance(s, runtime, u->frames);
+}
+
+/* A playback URB has been sent; its frames are no longer queued */
+static void my_stream_retire_playback(struct my_stream *s, struct my_urb *u)
+{
+    int i;
+
+    for (i = 0; i < u->urb->number_of_packets; i++) {
+        if (!u->urb->iso_frame_desc[i].status)
+            continue;
+        s->stats.packet_errors++;
+        trace_my_usb_audio_packet(my_stream_card(s), s->direction, i,
+                                  u->urb->iso_frame_desc[i].length,
+                                  u->urb->iso_frame_desc[i].status);
+    }
+    s->queued_frames -= min(s->queued_frames, u->frames);
+    s->last_frame = usb_get_current_frame_number(s->chip->udev);
+}
+
+/*
+ * Copy the packets of a completed capture URB into the ALSA ring.
+ * Called with s->lock held; returns true if a period was filled.
+ */
+static bool my_stream_retire_capture(struct my_stream *s, struct my_urb *u)
+{
+    struct urb *urb = u->urb;
+    struct snd_pcm_runtime *runtime = s->substream->runtime;
+    unsigned int buffer_bytes = frames_to_bytes(runtime, runtime->buffer_size);
+    unsigned int total = 0;
+    int i;
+
+    for (i = 0; i < urb->number_of_packets; i++) {
+        unsigned char *src = urb->transfer_buffer + urb->iso_frame_desc[i].offset;
+        unsigned int bytes = urb->iso_frame_desc[i].actual_length;
+
+        trace_my_usb_audio_packet(my_stream_card(s), s->direction, i, bytes,
+                                  urb->iso_frame_desc[i].status);
+        if (urb->iso_frame_desc[i].status)
+            s->stats.packet_errors++;
+        if (urb->iso_frame_desc[i].status || !bytes)
+            continue;
+        bytes -= bytes % s->frame_bytes;
+        my_urb_to_ring(s, runtime->dma_area, buffer_bytes, src, bytes);
+        total += bytes;
+    }
+    s->packets += urb->number_of_packets;
+    s->last_frame = usb_get_current_frame_number(s->chip->udev);
+
+    /* Unread frames the application had before this URB; overwriting
+     * past them loses data it has not read yet */
+    if (snd_pcm_capture_avail(runtime) < runtime->buffer_size) {
+        snd_pcm_uframes_t appl = runtime->control->appl_ptr % runtime->buffer_size;
+        snd_pcm_uframes_t pos = bytes_to_frames(runtime, s->hwptr);
+        long unread = (pos + 2 * runtime->buffer_size - appl - total / s->frame_bytes) %
+                      runtime->buffer_size;
+
+        if (unread + total / s->frame_bytes > runtime->buffer_size) {
+            s->stats.xruns++;
+            trace_my_usb_audio_xrun(my_stream_card(s), s->direction,
+                                    runtime->buffer_size - unread, total / s->frame_bytes);
+        }
+    }
+    return my_stream_advance(s, runtime, total / s->frame_bytes);
+}
+
+static void my_stream_prepare_capture(struct my_stream *s, struct urb *urb)
+{
+    int i;
+
+    for (i = 0; i < urb->number_of_packets; i++) {
+        urb->iso_frame_desc[i].offset = i * s->maxpacksize;
+        urb->iso_frame_desc[i].length = s->maxpacksize;
+    }
+    urb->transfer_buffer_length = urb->number_of_packets * s->maxpacksize;
+}
+
+/*
+ * Feedback is frames per (micro)frame: 10.14 in three bytes at full speed
+ * and 16.16 in four at high speed, though devices get this wrong often
+ * enough that the format is detected from the first value by picking the
+ * shift that lands near the nominal rate. Accepted values move freqn a
+ * quarter of the way each time, so packet sizes change by at most a frame
+ * at a time instead of jumping on a noisy report.
+ */
+static void my_stream_handle_feedback(struct my_stream *s, const u8 *buf, unsigned int len)
+{
+    unsigned int nominal = s->freqn_nominal >> s->datainterval;
+    u32 raw, f;
+
+    if (len < 3)
+        return;
+    raw = len >= 4 ? get_unaligned_le32(buf) : (buf[0] | buf[1] << 8 | buf[2] << 16);
+    if (!raw)
+        return;
+
+    if (s->fb_shift < 0) {
+        static const int shifts[] = { 2, 0, 4, -2 };
+        unsigned int best = UINT_MAX;
+        unsigned int i;
+
+        for (i = 0; i < ARRAY_SIZE(shifts); i++) {
+            u32 v = shifts[i] >= 0 ? raw << shifts[i] : raw >> -shifts[i];
+            unsigned int diff = v > nominal ? v - nominal : nominal - v;
+
+            if (diff < best) {
+                best = diff;
+                s->fb_shift = shifts[i];
+            }
+        }
+    }
+    f = s->fb_shift >= 0 ? raw << s->fb_shift : raw >> -s->fb_shift;
+    f <<= s->datainterval;
+
+    /* A real clock is within a fraction of a percent; ignore garbage */
+    if (f < s->freqn_nominal - s->freqn_nominal / 8 ||
+        f > s->freqn_nominal + s->freqn_nominal / 8) {
+        s->fb_rejected++;
+        return;
+    }
+    s->freqm = f;
+    s->freqn += ((int)f - (int)s->freqn) / 4;
+    s->fb_count++;
+    trace_my_usb_audio_feedback(my_stream_card(s), raw, s->freqm, s->freqn);
+}
+
+static void my_sync_urb_complete(struct urb *urb)
+{
+    struct my_urb *u = urb->context;
+    struct my_stream *s = u->stream;
+    unsigned long flags;
+    int err;
+
+    spin_lock_irqsave(&s->lock, flags);
+    if (!s->running || urb->status == -ENOENT || urb->status == -ECONNRESET ||
+        urb->status == -ESHUTDOWN || urb->status == -ENODEV) {
+        clear_bit(u->index, &s->sync_active);
+        spin_unlock_irqrestore(&s->lock, flags);
+        return;
+    }
+
+    if (!urb->iso_frame_desc[0].status)
+        my_stream_handle_feedback(s, urb->transfer_buffer + urb->iso_frame_desc[0].offset,
+                                  urb->iso_frame_desc[0].actual_length);
+
+    urb->iso_frame_desc[0].offset = 0;
+    urb->iso_frame_desc[0].length = s->sync_maxpacksize;
+    err = usb_submit_urb(urb, GFP_ATOMIC);
+    if (err < 0) {
+        clear_bit(u->index, &s->sync_active);
+        printk_ratelimited(KERN_ERR "my_usb_audio: feedback URB resubmit failed (%d)\n", err);
+    }
+    spin_unlock_irqrestore(&s->lock, flags);
+}
+
+/* Submit a data URB; called with s->lock held */
+static int my_stream_submit(struct my_stream *s, struct my_urb *u)
+{
+    int err;
+
+    u->submitted = ktime_get();
+    set_bit(u->index, &s->active_urbs);
+    err = usb_submit_urb(u->urb, GFP_ATOMIC);
+    trace_my_usb_audio_urb_submit(my_stream_card(s), s->direction, u->index,
+                                  u->urb->transfer_buffer_length, err);
+    if (err < 0) {
+        clear_bit(u->index, &s->active_urbs);
+        s->stats.submit_errors++;
+        return err;
+    }
+    s->stats.urbs_submitted++;
+    return 0;
+}
+
+/* Completion timing for the latency and jitter histograms */
+static void my_stream_account_completion(struct my_stream *s, struct my_urb *u)
+{
+    ktime_t now = ktime_get();
+    s64 latency = ktime_us_delta(now, u->submitted);
+    s64 interval = s->last_complete ? ktime_us_delta(now, s->last_complete) : 0;
+
+    s->last_complete = now;
+    s->stats.urbs_completed++;
+    if (u->urb->status)
+        s->stats.urb_errors++;
+    my_hist_add(s->stats.latency_hist, latency);
+    s->stats.max_latency_us = max(s->stats.max_latency_us, latency);
+    if (interval) {
+        s64 nominal = div_u64((u64)s->nrpacks * USEC_PER_SEC, s->packs_per_sec);
+        s64 jitter = abs(interval - nominal);
+
+        my_hist_add(s->stats.jitter_hist, jitter);
+        s->stats.max_jitter_us = max(s->stats.max_jitter_us, jitter);
+    }
+    trace_my_usb_audio_urb_complete(my_stream_card(s), s->direction, u->index, u->urb->status,
+                                    u->urb->actual_length, latency, interval);
+}
+
+static void my_urb_complete(struct urb *urb)
+{
+    struct my_urb *u = urb->context;
+    struct my_stream *s = u->stream;
+    unsigned long flags;
+    bool elapsed;
+    int err;
+
+    spin_lock_irqsave(&s->lock, flags);
+    if (!s->running || urb->status == -ENOENT || urb->status == -ECONNRESET ||
+        urb->status == -ESHUTDOWN || urb->status == -ENODEV) {
+        clear_bit(u->index, &s->active_urbs);
+        spin_unlock_irqrestore(&s->lock, flags);
+        return;
+    }
+    my_stream_account_completion(s, u);
+
+    if (s->direction == SNDRV_PCM_STREAM_CAPTURE) {
+        elapsed = my_stream_retire_capture(s, u);
+        my_stream_prepare_capture(s, urb);
+    } else {
+        my_stream_retire_playback(s, u);
+        elapsed = my_stream_prepare_playback(s, u);
+    }
+
+    err = my_stream_submit(s, u);
+    if (elapsed) {
+        s->stats.periods++;
+        trace_my_usb_audio_period_elapsed(my_stream_card(s), s->direction, s->hwptr, s->frames);
+    }
+    spin_unlock_irqrestore(&s->lock, flags);
+
+    /* Outside the lock: these call back into the pointer and trigger callbacks */
+    if (err < 0) {
+        printk_ratelimited(KERN_ERR "my_usb_audio: URB resubmit failed (%d)\n", err);
+        snd_pcm_stop_xrun(s->substream);
+    } else if (elapsed) {
+        snd_pcm_period_elapsed(s->substream);
+    }
+}
+
+static void my_stream_free_urbs(struct my_stream *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nurbs; i++) {
+        struct urb *urb = s->urbs[i].urb;
+
+        if (!urb)
+            continue;
+        usb_free_coherent(s->chip->udev, s->nrpacks * s->buf_packsize,
+                          urb->transfer_buffer, urb->transfer_dma);
+        usb_free_urb(urb);
+        s->urbs[i].urb = NULL;
+    }
+    for (i = 0; i < MY_AUDIO_SYNC_URBS; i++) {
+        struct urb *urb = s->sync_urbs[i].urb;
+
+        if (!urb)
+            continue;
+        usb_free_coherent(s->chip->udev, s->sync_bufsize,
+                          urb->transfer_buffer, urb->transfer_dma);
+        usb_free_urb(urb);
+        s->sync_urbs[i].urb = NULL;
+    }
+}
+
+/*
+ * Preallocate the URB ring. Buffers are sized for full packets of the
+ * largest altsetting, so switching formats never reallocates.
+ */
+static int my_stream_alloc_urbs(struct my_stream *s)
+{
+    bool need_sync = false;
+    unsigned int i;
+
+    s->nurbs = clamp(nurbs, 2, MY_AUDIO_MAX_URBS);
+    s->nrpacks = clamp(nrpacks, 1, MY_AUDIO_MAX_PACKS);
+    s->buf_packsize = 0;
+    s->sync_bufsize = 4;
+    for (i = 0; i < s->nr_formats; i++) {
+        s->buf_packsize = max(s->buf_packsize, s->formats[i].maxpacksize);
+        if (s->formats[i].sync_ep) {
+            need_sync = true;
+            s->sync_bufsize = max(s->sync_bufsize, s->formats[i].sync_maxpacksize);
+        }
+    }
+
+    for (i = 0; i < s->nurbs; i++) {
+        struct my_urb *u = &s->urbs[i];
+        struct urb *urb;
+
+        u->stream = s;
+        u->index = i;
+        urb = usb_alloc_urb(s->nrpacks, GFP_KERNEL);
+        if (!urb)
+            goto fail;
+        urb->transfer_buffer = usb_alloc_coherent(s->chip->udev, s->nrpacks * s->buf_packsize,
+                                                  GFP_KERNEL, &urb->transfer_dma);
+        if (!urb->transfer_buffer) {
+            usb_free_urb(urb);
+            goto fail;
+        }
+        urb->dev = s->chip->udev;
+        urb->pipe = s->pipe;
+        urb->transfer_flags = URB_ISO_ASAP | URB_NO_TRANSFER_DMA_MAP;
+        urb->number_of_packets = s->nrpacks;
+        urb->interval = 1 << s->datainterval;
+        urb->context = u;
+        urb->complete = my_urb_complete;
+        u->urb = urb;
+    }
+
+    /* One-packet URBs for the feedback endpoint, if any */
+    for (i = 0; need_sync && i < MY_AUDIO_SYNC_URBS; i++) {
+        struct my_urb *u = &s->sync_urbs[i];
+        struct urb *urb;
+
+        u->stream = s;
+        u->index = i;
+        urb = usb_alloc_urb(1, GFP_KERNEL);
+        if (!urb)
+            goto fail;
+        urb->transfer_buffer = usb_alloc_coherent(s->chip->udev, s->sync_bufsize,
+                                                  GFP_KERNEL, &urb->transfer_dma);
+        if (!urb->transfer_buffer) {
+            usb_free_urb(urb);
+            goto fail;
+        }
+        urb->dev = s->chip->udev;
+        urb->pipe = s->sync_pipe;
+        urb->transfer_flags = URB_ISO_ASAP | URB_NO_TRANSFER_DMA_MAP;
+        urb->number_of_packets = 1;
+        urb->interval = s->sync_interval;
+        urb->transfer_buffer_length = s->sync_maxpacksize;
+        urb->iso_frame_desc[0].offset = 0;
+        urb->iso_frame_desc[0].length = s->sync_maxpacksize;
+        urb->context = u;
+        urb->complete = my_sync_urb_complete;
+        u->urb = urb;
+    }
+    return 0;
+
+fail:
+    my_stream_free_urbs(s);
+    return -ENOMEM;
+}
+
+/* Select the altsetting and program the rate; may sleep */
+static int my_stream_configure(struct my_stream *s)
+{
+    int err;
+
+    if (s->configured)
+        return 0;
+    err = usb_set_interface(s->chip->udev, s->iface, s->altsetting);
+    if (err < 0)
+        return err;
+    err = my_stream_set_rate(s);
+    if (err < 0)
+        return err;
+    s->freqn_nominal = div_u64(((u64)s->rate << 16), s->packs_per_sec);
+    s->freqn = s->freqn_nominal;
+    s->freqm = s->freqn_nominal;
+    s->fb_shift = -1;
+    s->configured = true;
+    return 0;
+}
+
+/* Back to the zero-bandwidth altsetting; may sleep */
+static void my_stream_deconfigure(struct my_stream *s)
+{
+    if (!s->configured)
+        return;
+    if (!s->chip->disconnected)
+        usb_set_interface(s->chip->udev, s->iface, 0);
+    s->configured = false;
+}
+
+/* Stop resubmitting and cancel URBs; safe in atomic context */
+static void my_stream_stop(struct my_stream *s)
+{
+    unsigned long flags;
+    unsigned int i;
+
+    spin_lock_irqsave(&s->lock, flags);
+    s->running = false;
+    spin_unlock_irqrestore(&s->lock, flags);
+    for (i = 0; i < s->nurbs; i++)
+        if (s->urbs[i].urb && test_bit(i, &s->active_urbs))
+            usb_unlink_urb(s->urbs[i].urb);
+    for (i = 0; i < MY_AUDIO_SYNC_URBS; i++)
+        if (s->sync_urbs[i].urb && test_bit(i, &s->sync_active))
+            usb_unlink_urb(s->sync_urbs[i].urb);
+}
+
+/* Put every URB in flight; called from the trigger, so atomic */
+static int my_stream_start(struct my_stream *s)
+{
+    unsigned long flags;
+    bool elapsed = false;
+    unsigned int i;
+    int err = 0;
+
+    if (!s->configured || s->chip->disconnected)
+        return -ENODEV;
+
+    spin_lock_irqsave(&s->lock, flags);
+    s->phase = 0;
+    s->running = true;
+    s->last_complete = 0;
+    s->last_frame = usb_get_current_frame_number(s->chip->udev);
+    for (i = 0; i < s->nurbs; i++) {
+        struct my_urb *u = &s->urbs[i];
+
+        if (s->direction == SNDRV_PCM_STREAM_CAPTURE)
+            my_stream_prepare_capture(s, u->urb);
+        else if (my_stream_prepare_playback(s, u))
+            elapsed = true;
+        err = my_stream_submit(s, u);
+        if (err < 0)
+            break;
+    }
+    for (i = 0; !err && s->sync_ep && i < MY_AUDIO_SYNC_URBS; i++) {
+        set_bit(i, &s->sync_active);
+        err = usb_submit_urb(s->sync_urbs[i].urb, GFP_ATOMIC);
+        if (err < 0)
+            clear_bit(i, &s->sync_active);
+    }
+    if (!err && elapsed) {
+        s->stats.periods++;
+        trace_my_usb_audio_period_elapsed(my_stream_card(s), s->direction, s->hwptr, s->frames);
+    }
+    spin_unlock_irqrestore(&s->lock, flags);
+
+    if (err < 0) {
+        printk(KERN_ERR "my_usb_audio: URB submit failed (%d)\n", err);
+        my_stream_stop(s);
+        return err;
+    }
+    /* With a small buffer the initial fill can already cover a period.
+     * We are inside the trigger, so the stream lock is held. */
+    if (elapsed)
+        snd_pcm_period_elapsed_under_stream_lock(s->substream);
+    return 0;
+}
+
+/* Wait until the host controller has handed back every URB */
+static void my_stream_sync_stop(struct my_stream *s)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nurbs; i++)
+        if (s->urbs[i].urb)
+            usb_kill_urb(s->urbs[i].urb);
+    for (i = 0; i < MY_AUDIO_SYNC_URBS; i++)
+        if (s->sync_urbs[i].urb)
+            usb_kill_urb(s->sync_urbs[i].urb);
+    s->active_urbs = 0;
+    s->sync_active = 0;
+}
+
+/*
+ * PCM device
+ *
+ * The runtime buffer is plain vmalloc memory managed by the ALSA core, so
+ * it can be mmapped by userspace; URB completions copy between it and the
+ * coherent URB buffers, and the pointer callback reports the exact ring
+ * position plus, for playback, how much of what was queued has not been
+ * played yet.
+ */
+
+static const struct snd_pcm_hardware my_pcm_hardware = {
+    .info = SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_MMAP_VALID |
+            SNDRV_PCM_INFO_INTERLEAVED | SNDRV_PCM_INFO_BLOCK_TRANSFER |
+            SNDRV_PCM_INFO_BATCH,
+    .formats = SNDRV_PCM_FMTBIT_S16_LE,
+    .buffer_bytes_max = 1024 * 1024,
+    .period_bytes_min = 64,
+    .period_bytes_max = 512 * 1024,
+    .periods_min = 2,
+    .periods_max = 1024,
+};
+
+/*
+ * hw rules: each parameter is limited to what the altsettings still
+ * compatible with the other two allow, so e.g. choosing 96 kHz leaves only
+ * the sample formats and channel counts some altsetting offers at 96 kHz.
+ */
+static bool my_format_matches(const struct my_format *f, struct snd_pcm_hw_params *params,
+                              bool check_format, bool check_channels, bool check_rate)
+{
+    struct snd_interval *ch = hw_param_interval(params, SNDRV_PCM_HW_PARAM_CHANNELS);
+    struct snd_interval *rate = hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE);
+    unsigned int i;
+
+    if (check_format &&
+        !snd_mask_test_format(hw_param_mask(params, SNDRV_PCM_HW_PARAM_FORMAT), f->pcm_format))
+        return false;
+    if (check_channels && (f->channels < ch->min || f->channels > ch->max))
+        return false;
+    if (!check_rate)
+        return true;
+    if (!f->nr_rates)
+        return f->rate_min <= rate->max && f->rate_max >= rate->min;
+    for (i = 0; i < f->nr_rates; i++)
+        if (f->rates[i] >= rate->min && f->rates[i] <= rate->max)
+            return true;
+    return false;
+}
+
+static int my_hw_rule_rate(struct snd_pcm_hw_params *params, struct snd_pcm_hw_rule *rule)
+{
+    struct my_stream *s = rule->private;
+    struct snd_interval *it = hw_param_interval(params, SNDRV_PCM_HW_PARAM_RATE);
+    struct snd_interval range = { .min = UINT_MAX, .max = 0, .integer = 1 };
+    unsigned int i, j;
+
+    for (i = 0; i < s->nr_formats; i++) {
+        const struct my_format *f = &s->formats[i];
+
+        if (!my_format_matches(f, params, true, true, false))
+            continue;
+        if (!f->nr_rates) {
+            range.min = min(range.min, max(f->rate_min, it->min));
+            range.max = max(range.max, min(f->rate_max, it->max));
+            continue;
+        }
+        for (j = 0; j < f->nr_rates; j++) {
+            if (f->rates[j] < it->min || f->rates[j] > it->max)
+                continue;
+            range.min = min(range.min, f->rates[j]);
+            range.max = max(range.max, f->rates[j]);
+        }
+    }
+    if (range.min > range.max) {
+        it->empty = 1;
+        return -EINVAL;
+    }
+    return snd_interval_refine(it, &range);
+}
+
+static int my_hw_rule_channels(struct snd_pcm_hw_params *params, struct snd_pcm_hw_rule *rule)
+{
+    struct my_stream *s = rule->private;
+    struct snd_interval *it = hw_param_interval(params, SNDRV_PCM_HW_PARAM_CHANNELS);
+    struct snd_interval range = { .min = UINT_MAX, .max = 0, .integer = 1 };
+    unsigned int i;
+
+    for (i = 0; i < s->nr_formats; i++) {
+        const struct my_format *f = &s->formats[i];
+
+        if (!my_format_matches(f, params, true, false, true))
+            continue;
+        range.min = min(range.min, f->channels);
+        range.max = max(range.max, f->channels);
+    }
+    if (range.min > range.max) {
+        it->empty = 1;
+        return -EINVAL;
+    }
+    return snd_interval_refine(it, &range);
+}
+
+static int my_hw_rule_format(struct snd_pcm_hw_params *params, struct snd_pcm_hw_rule *rule)
+{
+    struct my_stream *s = rule->private;
+    struct snd_mask formats;
+    unsigned int i;
+
+    snd_mask_none(&formats);
+    for (i = 0; i < s->nr_formats; i++)
+        if (my_format_matches(&s->formats[i], params, false, true, true))
+            snd_mask_set_format(&formats, s->formats[i].pcm_format);
+    return snd_mask_refine(hw_param_mask(params, SNDRV_PCM_HW_PARAM_FORMAT), &formats);
+}
+
+static int my_pcm_open(struct snd_pcm_substream *substream)
+{
+    struct my_audio *chip = snd_pcm_substream_chip(substream);
+    struct my_stream *s = &chip->streams[substream->stream];
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    unsigned int i, j;
+    int err;
+
+    if (chip->disconnected)
+        return -ENODEV;
+
+    /* Union of every altsetting; the rules narrow it down */
+    runtime->hw = my_pcm_hardware;
+    runtime->hw.formats = 0;
+    runtime->hw.rates = s->continuous_rates ? SNDRV_PCM_RATE_CONTINUOUS : 0;
+    runtime->hw.rate_min = UINT_MAX;
+    runtime->hw.rate_max = 0;
+    runtime->hw.channels_min = UINT_MAX;
+    runtime->hw.channels_max = 0;
+    for (i = 0; i < s->nr_formats; i++) {
+        const struct my_format *f = &s->formats[i];
+
+        runtime->hw.formats |= pcm_format_to_bits(f->pcm_format);
+        runtime->hw.rate_min = min(runtime->hw.rate_min, f->rate_min);
+        runtime->hw.rate_max = max(runtime->hw.rate_max, f->rate_max);
+        runtime->hw.channels_min = min(runtime->hw.channels_min, f->channels);
+        runtime->hw.channels_max = max(runtime->hw.channels_max, f->channels);
+        for (j = 0; j < f->nr_rates; j++)
+            runtime->hw.rates |= snd_pcm_rate_to_rate_bit(f->rates[j]);
+        /* 24 valid bits in a 32-bit subframe and the like */
+        if (f->bits < f->sample_bytes * 8) {
+            err = snd_pcm_hw_constraint_msbits(runtime, 0, f->sample_bytes * 8, f->bits);
+            if (err < 0)
+                return err;
+        }
+    }
+
+    if (!s->continuous_rates) {
+        err = snd_pcm_hw_constraint_list(runtime, 0, SNDRV_PCM_HW_PARAM_RATE, &s->rate_constraint);
+        if (err < 0)
+            return err;
+    }
+    err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_RATE, my_hw_rule_rate, s,
+                              SNDRV_PCM_HW_PARAM_FORMAT, SNDRV_PCM_HW_PARAM_CHANNELS, -1);
+    if (err < 0)
+        return err;
+    err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_CHANNELS, my_hw_rule_channels, s,
+                              SNDRV_PCM_HW_PARAM_FORMAT, SNDRV_PCM_HW_PARAM_RATE, -1);
+    if (err < 0)
+        return err;
+    err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_FORMAT, my_hw_rule_format, s,
+                              SNDRV_PCM_HW_PARAM_CHANNELS, SNDRV_PCM_HW_PARAM_RATE, -1);
+    if (err < 0)
+        return err;
+
+    /*
+     * The ring must hold every URB in flight and a period at least one
+     * URB, or completions would lap the application within one callback.
+     */
+    err = snd_pcm_hw_constraint_minmax(runtime, SNDRV_PCM_HW_PARAM_BUFFER_BYTES,
+                                       s->nurbs * s->nrpacks * s->buf_packsize, UINT_MAX);
+    if (err < 0)
+        return err;
+    err = snd_pcm_hw_constraint_minmax(runtime, SNDRV_PCM_HW_PARAM_PERIOD_BYTES,
+                                       s->nrpacks * s->buf_packsize, UINT_MAX);
+    if (err < 0)
+        return err;
+
+    s->substream = substream;
+    return 0;
+}
+
+static int my_pcm_close(struct snd_pcm_substream *substream)
+{
+    struct my_audio *chip = snd_pcm_substream_chip(substream);
+
+    chip->streams[substream->stream].substream = NULL;
+    return 0;
+}
+
+/* Switch the stream to the altsetting that carries the chosen parameters */
+static int my_pcm_hw_params(struct snd_pcm_substream *substream, struct snd_pcm_hw_params *params)
+{
+    struct my_audio *chip = snd_pcm_substream_chip(substream);
+    struct my_stream *s = &chip->streams[substream->stream];
+    const struct my_format *f;
+
+    if (chip->disconnected)
+        return -ENODEV;
+    f = my_stream_find_format(s, params_format(params), params_channels(params), params_rate(params));
+    if (!f)
+        return -EINVAL;
+    if (f != s->cur || params_rate(params) != s->rate) {
+        my_stream_deconfigure(s);
+        my_stream_set_format(s, f, params_rate(params));
+    }
+    return 0;
+}
+
+static int my_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+    struct my_audio *chip = snd_pcm_substream_chip(substream);
+
+    my_stream_deconfigure(&chip->streams[substream->stream]);
+    return 0;
+}
+
+static int my_pcm_prepare(struct snd_pcm_substream *substream)
+{
+    struct my_audio *chip = snd_pcm_substream_chip(substream);
+    struct my_stream *s = &chip->streams[substream->stream];
+    int err;
+
+    if (chip->disconnected)
+        return -ENODEV;
+    err = my_stream_configure(s);
+    if (err < 0)
+        return err;
+    s->hwptr = 0;
+    s->transfer_done = 0;
+    s->queued_frames = 0;
+    return 0;
+}
+
+static int my_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+    struct my_audio *chip = snd_pcm_substream_chip(substream);
+    struct my_stream *s = &chip->streams[substream->stream];
+
+    switch (cmd) {
+    case SNDRV_PCM_TRIGGER_START:
+        return my_stream_start(s);
+    case SNDRV_PCM_TRIGGER_STOP:
+        my_stream_stop(s);
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+/* Waits for unlinked URBs before prepare/hw_free/close reuse the stream */
+static int my_pcm_sync_stop(struct snd_pcm_substream *substream)
+{
+    struct my_audio *chip = snd_pcm_substream_chip(substream);
+
+    my_stream_sync_stop(&chip->streams[substream->stream]);
+    return 0;
+}
+
+static snd_pcm_uframes_t my_pcm_pointer(struct snd_pcm_substream *substream)
+{
+    struct my_audio *chip = snd_pcm_substream_chip(substream);
+    struct my_stream *s = &chip->streams[substream->stream];
+    struct snd_pcm_runtime *runtime = substream->runtime;
+    unsigned long flags;
+    unsigned int hwptr;
+
+    if (chip->disconnected)
+        return SNDRV_PCM_POS_XRUN;
+
+    spin_lock_irqsave(&s->lock, flags);
+    hwptr = s->hwptr;
+    if (s->direction == SNDRV_PCM_STREAM_PLAYBACK) {
+        /* Queued frames minus what the device has played since the last
+         * completion, estimated from the 1 ms USB frame counter */
+        int ms = (usb_get_current_frame_number(chip->udev) - s->last_frame) & 0x3ff;
+        unsigned int played = ms * s->rate / 1000;
+
+        runtime->delay = s->queued_frames > played ? s->queued_frames - played : 0;
+    }
+    spin_unlock_irqrestore(&s->lock, flags);
+    return bytes_to_frames(runtime, hwptr);
+}
+
+static const struct snd_pcm_ops my_pcm_ops = {
+    .open = my_pcm_open,
+    .close = my_pcm_close,
+    .hw_params = my_pcm_hw_params,
+    .hw_free = my_pcm_hw_free,
+    .prepare = my_pcm_prepare,
+    .trigger = my_pcm_trigger,
+    .sync_stop = my_pcm_sync_stop,
+    .pointer = my_pcm_pointer,
+};
+
+static int my_audio_create_pcm(struct my_audio *chip)
+{
+    struct snd_pcm *pcm;
+    int playback = chip->streams[SNDRV_PCM_STREAM_PLAYBACK].intf != NULL;
+    int capture = chip->streams[SNDRV_PCM_STREAM_CAPTURE].intf != NULL;
+    int err;
+
+    err = snd_pcm_new(chip->card, "My USB Audio", 0, playback, capture, &pcm);
+    if (err < 0)
+        return err;
+    pcm->private_data = chip;
+    strscpy(pcm->name, "My USB Audio", sizeof(pcm->name));
+    if (playback)
+        snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &my_pcm_ops);
+    if (capture)
+        snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &my_pcm_ops);
+    snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_VMALLOC, NULL, 0, 0);
+    chip->pcm = pcm;
+    return 0;
+}
+
+/*
+ * Mixer
+ *
+ * Volume and mute controls of the device's Feature Units, so gain is
+ * applied on the device. Volumes are in 1/256 dB steps of the unit's
+ * resolution and carry a min/max dB TLV, which lets alsamixer and
+ * snd_mixer_selem_*_dB() show and set real decibels.
+ */
+
+#define MY_MIXER_MAX_CHANNELS 8
+
+struct my_mixer_elem {
+    struct my_audio *chip;
+    u8 unit_id;
+    u8 control;                                 /* UAC_FU_MUTE or UAC_FU_VOLUME */
+    int channels;
+    u8 channel_nr[MY_MIXER_MAX_CHANNELS];       /* UAC channel number, 0 = master */
+    int min, max, res;                          /* volume, 1/256 dB */
+    int cache[MY_MIXER_MAX_CHANNELS];
+    unsigned int tlv[4];
+};
+
+static int my_mixer_get_raw(struct my_mixer_elem *e, u8 request, int ch, int *value)
+{
+    struct usb_device *udev = e->chip->udev;
+    int ifnum = e->chip->ctrl_intf->cur_altsetting->desc.bInterfaceNumber;
+    int len = e->control == UAC_FU_MUTE ? 1 : 2;
+    u8 *buf;
+    int err;
+
+    buf = kmalloc(2, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    err = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0), request,
+                          USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_DIR_IN,
+                          e->control << 8 | ch, e->unit_id << 8 | ifnum, buf, len, 1000);
+    if (err == len) {
+        *value = len == 1 ? buf[0] : (s16)(buf[0] | buf[1] << 8);
+        err = 0;
+    } else if (err >= 0) {
+        err = -EIO;
+    }
+    kfree(buf);
+    return err;
+}
+
+static int my_mixer_set_raw(struct my_mixer_elem *e, int ch, int value)
+{
+    struct usb_device *udev = e->chip->udev;
+    int ifnum = e->chip->ctrl_intf->cur_altsetting->desc.bInterfaceNumber;
+    int len = e->control == UAC_FU_MUTE ? 1 : 2;
+    u8 *buf;
+    int err;
+
+    buf = kmalloc(2, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    buf[0] = value;
+    buf[1] = value >> 8;
+    err = usb_control_msg(udev, usb_sndctrlpipe(udev, 0), UAC_SET_CUR,
+                          USB_TYPE_CLASS | USB_RECIP_INTERFACE | USB_DIR_OUT,
+                          e->control << 8 | ch, e->unit_id << 8 | ifnum, buf, len, 1000);
+    kfree(buf);
+    return err < 0 ? err : 0;
+}
+
+static int my_mixer_info(struct snd_kcontrol *kctl, struct snd_ctl_elem_info *uinfo)
+{
+    struct my_mixer_elem *e = kctl->private_data;
+
+    uinfo->count = e->channels;
+    if (e->control == UAC_FU_MUTE) {
+        uinfo->type = SNDRV_CTL_ELEM_TYPE_BOOLEAN;
+        uinfo->value.integer.min = 0;
+        uinfo->value.integer.max = 1;
+    } else {
+        uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+        uinfo->value.integer.min = 0;
+        uinfo->value.integer.max = (e->max - e->min) / e->res;
+    }
+    return 0;
+}
+
+/* Switch controls are "on" when not muted */
+static int my_mixer_get(struct snd_kcontrol *kctl, struct snd_ctl_elem_value *ucontrol)
+{
+    struct my_mixer_elem *e = kctl->private_data;
+    int i;
+
+    mutex_lock(&e->chip->mixer_mutex);
+    for (i = 0; i < e->channels; i++) {
+        if (e->control == UAC_FU_MUTE)
+            ucontrol->value.integer.value[i] = !e->cache[i];
+        else
+            ucontrol->value.integer.value[i] = (e->cache[i] - e->min) / e->res;
+    }
+    mutex_unlock(&e->chip->mixer_mutex);
+    return 0;
+}
+
+static int my_mixer_put(struct snd_kcontrol *kctl, struct snd_ctl_elem_value *ucontrol)
+{
+    struct my_mixer_elem *e = kctl->private_data;
+    int changed = 0;
+    int i, err = 0;
+
+    if (e->chip->disconnected)
+        return -ENODEV;
+    for (i = 0; i < e->channels; i++) {
+        long v = ucontrol->value.integer.value[i];
+
+        if (e->control != UAC_FU_MUTE && (v < 0 || v > (e->max - e->min) / e->res))
+            return -EINVAL;
+    }
+
+    /* Two writers must not interleave their requests and cache updates */
+    mutex_lock(&e->chip->mixer_mutex);
+    for (i = 0; i < e->channels; i++) {
+        long v = ucontrol->value.integer.value[i];
+        int raw = e->control == UAC_FU_MUTE ? !v : e->min + v * e->res;
+
+        if (raw == e->cache[i])
+            continue;
+        err = my_mixer_set_raw(e, e->channel_nr[i], raw);
+        if (err < 0)
+            break;
+        e->cache[i] = raw;
+        changed = 1;
+    }
+    mutex_unlock(&e->chip->mixer_mutex);
+    return err < 0 ? err : changed;
+}
+
+static void my_mixer_free(struct snd_kcontrol *kctl)
+{
+    kfree(kctl->private_data);
+}
+
+/* Walk the class-specific descriptors of the audio control interface */
+#define for_each_ac_desc(chip, p, end) \
+    for (p = (chip)->ctrl_intf->altsetting[0].extra, \
+         end = p + (chip)->ctrl_intf->altsetting[0].extralen; \
+         p + 3 <= end && p[0] >= 3 && p + p[0] <= end; p += p[0]) \
+        if (p[1] == USB_DT_CS_INTERFACE)
+
+enum { MY_MIXER_PLAYBACK, MY_MIXER_CAPTURE, MY_MIXER_MONITOR, MY_MIXER_PATHS };
+
+static const char *const my_mixer_path_names[MY_MIXER_PATHS] = {
+    [MY_MIXER_PLAYBACK] = "PCM Playback",
+    [MY_MIXER_CAPTURE] = "Mic Capture",
+    [MY_MIXER_MONITOR] = "Mic Playback",
+};
+
+/*
+ * Classify a Feature Unit by the path it sits on: fed by the USB streaming
+ * terminal it is the playback gain, feeding it it is the capture gain,
+ * and anything else is a monitor (sidetone) path.
+ */
+static int my_mixer_fu_path(struct my_audio *chip, struct uac_feature_unit_descriptor *fu)
+{
+    u8 *p, *end;
+
+    for_each_ac_desc(chip, p, end) {
+        if (p[2] == UAC_INPUT_TERMINAL && p[0] >= 6 && p[3] == fu->bSourceID &&
+            get_unaligned_le16(p + 4) == UAC_TERMINAL_STREAMING)
+            return MY_MIXER_PLAYBACK;
+        if (p[2] == UAC_OUTPUT_TERMINAL && p[0] >= 8 && p[7] == fu->bUnitID &&
+            get_unaligned_le16(p + 4) == UAC_TERMINAL_STREAMING)
+            return MY_MIXER_CAPTURE;
+    }
+    return MY_MIXER_MONITOR;
+}
+
+/* 'index' tells apart units that share a path name, e.g. two monitor paths */
+static int my_mixer_add(struct my_audio *chip, struct uac_feature_unit_descriptor *fu, int path,
+                        unsigned int index, u8 control, const u8 *channel_nr, int channels)
+{
+    struct snd_kcontrol_new tmpl = {
+        .iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+        .access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+        .info = my_mixer_info,
+        .get = my_mixer_get,
+        .put = my_mixer_put,
+    };
+    struct my_mixer_elem *e;
+    struct snd_kcontrol *kctl;
+    char name[SNDRV_CTL_ELEM_ID_NAME_MAXLEN];
+    int i, err;
+
+    e = kzalloc(sizeof(*e), GFP_KERNEL);
+    if (!e)
+        return -ENOMEM;
+    e->chip = chip;
+    e->unit_id = fu->bUnitID;
+    e->control = control;
+    e->channels = channels;
+    memcpy(e->channel_nr, channel_nr, channels);
+
+    if (control == UAC_FU_VOLUME) {
+        if (my_mixer_get_raw(e, UAC_GET_MIN, channel_nr[0], &e->min) < 0 ||
+            my_mixer_get_raw(e, UAC_GET_MAX, channel_nr[0], &e->max) < 0 ||
+            e->max <= e->min) {
+            kfree(e);
+            return -EINVAL;
+        }
+        if (my_mixer_get_raw(e, UAC_GET_RES, channel_nr[0], &e->res) < 0 || e->res <= 0)
+            e->res = 1;
+        /* TLV values are in 1/100 dB */
+        e->tlv[0] = SNDRV_CTL_TLVT_DB_MINMAX;
+        e->tlv[1] = 2 * sizeof(unsigned int);
+        e->tlv[2] = e->min * 100 / 256;
+        e->tlv[3] = e->max * 100 / 256;
+        tmpl.access |= SNDRV_CTL_ELEM_ACCESS_TLV_READ;
+    }
+    for (i = 0; i < channels; i++)
+        if (my_mixer_get_raw(e, UAC_GET_CUR, channel_nr[i], &e->cache[i]) < 0)
+            e->cache[i] = control == UAC_FU_VOLUME ? e->max : 0;
+
+    snprintf(name, sizeof(name), "%s %s", my_mixer_path_names[path],
+             control == UAC_FU_VOLUME ? "Volume" : "Switch");
+    tmpl.name = name;
+    tmpl.index = index;
+    kctl = snd_ctl_new1(&tmpl, e);
+    if (!kctl) {
+        kfree(e);
+        return -ENOMEM;
+    }
+    kctl->private_free = my_mixer_free;
+    if (control == UAC_FU_VOLUME)
+        kctl->tlv.p = e->tlv;
+    err = snd_ctl_add(chip->card, kctl);
+    if (err < 0)
+        return err;
+
+    if (control == UAC_FU_VOLUME)
+        printk(KERN_INFO "my_usb_audio: unit %d: \"%s\",%u, %d channel(s), %d..%d dB/256 step %d\n",
+               fu->bUnitID, name, index, channels, e->min, e->max, e->res);
+    return 0;
+}
+
+/* One volume and one switch control per Feature Unit that has them */
+static void my_audio_create_mixer(struct my_audio *chip)
+{
+    static const u8 controls[] = { UAC_FU_MUTE, UAC_FU_VOLUME };
+    unsigned int used[MY_MIXER_PATHS][ARRAY_SIZE(controls)] = {};
+    u8 *p, *end;
+
+    for_each_ac_desc(chip, p, end) {
+        struct uac_feature_unit_descriptor *fu = (void *)p;
+        int csize, nch, c, i, path, err;
+
+        if (p[2] != UAC_FEATURE_UNIT || p[0] < 7)
+            continue;
+        csize = fu->bControlSize;
+        if (!csize)
+            continue;
+        /* bLength = 7 + (channels + 1) * bControlSize */
+        nch = min((p[0] - 7) / csize - 1, MY_MIXER_MAX_CHANNELS);
+        path = my_mixer_fu_path(chip, fu);
+
+        for (i = 0; i < ARRAY_SIZE(controls); i++) {
+            u8 bit = 1 << (controls[i] - 1);
+            u8 channel_nr[MY_MIXER_MAX_CHANNELS];
+            int channels = 0;
+
+            /* Per-channel controls win over the master one */
+            for (c = 1; c <= nch; c++)
+                if (fu->bmaControls[c * csize] & bit)
+                    channel_nr[channels++] = c;
+            if (!channels && (fu->bmaControls[0] & bit))
+                channel_nr[channels++] = 0;
+            if (!channels)
+                continue;
+            err = my_mixer_add(chip, fu, path, used[path][i], controls[i], channel_nr, channels);
+            if (err < 0)
+                printk(KERN_WARNING "my_usb_audio: unit %d: cannot add %s %s (%d)\n",
+                       fu->bUnitID, my_mixer_path_names[path],
+                       controls[i] == UAC_FU_VOLUME ? "Volume" : "Switch", err);
+            else
+                used[path][i]++;
+        }
+    }
+}
+
+/* Claim an audio streaming interface and set up its stream */
+static int my_audio_add_stream(struct my_audio *chip, struct usb_interface *intf)
+{
+    int direction = my_intf_direction(intf);
+    struct my_stream *s;
+    unsigned int i;
+    int err;
+
+    if (direction < 0)
+        return -EINVAL;
+    s = &chip->streams[direction];
+    if (s->intf)
+        return -EBUSY;
+    s->direction = direction;
+    if (my_stream_parse_formats(s, intf) < 0)
+        return -EINVAL;
+
+    err = usb_driver_claim_interface(&snd_my_audio_driver, intf, chip);
+    if (err < 0)
+        return err;
+    s->intf = intf;
+    spin_lock_init(&s->lock);
+    err = my_stream_alloc_urbs(s);
+    if (err < 0) {
+        usb_set_intfdata(intf, NULL);
+        usb_driver_release_interface(&snd_my_audio_driver, intf);
+        s->intf = NULL;
+        return err;
+    }
+    my_stream_set_format(s, &s->formats[0], s->formats[0].rate_max);
+    /* Zero bandwidth until a PCM is prepared */
+    usb_set_interface(chip->udev, s->iface, 0);
+
+    for (i = 0; i < s->nr_formats; i++) {
+        const struct my_format *f = &s->formats[i];
+
+        printk(KERN_INFO "my_usb_audio: %s interface %d alt %d: %u ch, %u/%u bit, %u-%u Hz (%u rates), ep %u%s\n",
+               s->direction == SNDRV_PCM_STREAM_PLAYBACK ? "playback" : "capture",
+               s->iface, f->altsetting, f->channels, f->bits, f->sample_bytes * 8,
+               f->rate_min, f->rate_max, f->nr_rates, f->ep,
+               f->sync_ep ? ", async feedback" : "");
+    }
+    return 0;
+}
+
+static void my_audio_remove_stream(struct my_stream *s)
+{
+    if (!s->intf)
+        return;
+    my_stream_stop(s);
+    my_stream_sync_stop(s);
+    my_stream_free_urbs(s);
+    s->configured = false;
+    s->intf = NULL;
+}
+
+/*
+ * debugfs: my_usb_audio/cardN/{playback,capture} show the data path
+ * counters and the completion latency/jitter histograms. Writing
+ * anything to a file clears its counters.
+ */
+static void my_hist_show(struct seq_file *m, const char *title, const u64 *hist)
+{
+    int b;
+
+    seq_printf(m, "\n%s\n", title);
+    for (b = 0; b < MY_HIST_BUCKETS; b++) {
+        if (!hist[b])
+            continue;
+        if (b == 0)
+            seq_printf(m, "  %8s us  %llu\n", "0", hist[b]);
+        else if (b == MY_HIST_BUCKETS - 1)
+            seq_printf(m, "  >= %5llu us  %llu\n", 1ULL << (b - 1), hist[b]);
+        else
+            seq_printf(m, "  %8llu us  %llu\n", 1ULL << (b - 1), hist[b]);
+    }
+}
+
+static int my_stream_stats_show(struct seq_file *m, void *v)
+{
+    struct my_stream *s = m->private;
+    struct my_stream_stats *st;
+    unsigned long long packets, frames;
+    unsigned int fb_count, fb_rejected, freqn;
+    unsigned long flags;
+
+    /* Copy out so the histograms are consistent with the counters */
+    st = kmalloc(sizeof(*st), GFP_KERNEL);
+    if (!st)
+        return -ENOMEM;
+    spin_lock_irqsave(&s->lock, flags);
+    *st = s->stats;
+    packets = s->packets;
+    frames = s->frames;
+    fb_count = s->fb_count;
+    fb_rejected = s->fb_rejected;
+    freqn = s->freqn;
+    spin_unlock_irqrestore(&s->lock, flags);
+
+    seq_printf(m, "running            %d\n", s->running);
+    seq_printf(m, "rate               %u\n", s->rate);
+    seq_printf(m, "urbs_submitted     %llu\n", st->urbs_submitted);
+    seq_printf(m, "urbs_completed     %llu\n", st->urbs_completed);
+    seq_printf(m, "submit_errors      %llu\n", st->submit_errors);
+    seq_printf(m, "urb_errors         %llu\n", st->urb_errors);
+    seq_printf(m, "packet_errors      %llu\n", st->packet_errors);
+    seq_printf(m, "packets            %llu\n", packets);
+    seq_printf(m, "frames             %llu\n", frames);
+    seq_printf(m, "periods            %llu\n", st->periods);
+    seq_printf(m, "xruns              %llu\n", st->xruns);
+    seq_printf(m, "max_latency_us     %lld\n", st->max_latency_us);
+    seq_printf(m, "max_jitter_us      %lld\n", st->max_jitter_us);
+    if (s->sync_ep)
+        seq_printf(m, "feedback           %u accepted, %u rejected, freqn %u.%04u\n",
+                   fb_count, fb_rejected, freqn >> 16, (freqn & 0xffff) * 10000 >> 16);
+    my_hist_show(m, "completion latency (submit to complete):", st->latency_hist);
+    my_hist_show(m, "completion jitter (|interval - nominal|):", st->jitter_hist);
+    kfree(st);
+    return 0;
+}
+
+static int my_stream_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, my_stream_stats_show, inode->i_private);
+}
+
+static ssize_t my_stream_stats_write(struct file *file, const char __user *buf,
+                                     size_t count, loff_t *ppos)
+{
+    struct my_stream *s = ((struct seq_file *)file->private_data)->private;
+    unsigned long flags;
+
+    spin_lock_irqsave(&s->lock, flags);
+    memset(&s->stats, 0, sizeof(s->stats));
+    s->last_complete = 0;
+    spin_unlock_irqrestore(&s->lock, flags);
+    return count;
+}
+
+static const struct file_operations my_stream_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = my_stream_stats_open,
+    .read = seq_read,
+    .write = my_stream_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void my_audio_create_debugfs(struct my_audio *chip)
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), "card%d", chip->card->number);
+    chip->debugfs_dir = debugfs_create_dir(name, my_debugfs_root);
+    if (chip->streams[SNDRV_PCM_STREAM_PLAYBACK].intf)
+        debugfs_create_file("playback", 0600, chip->debugfs_dir,
+                            &chip->streams[SNDRV_PCM_STREAM_PLAYBACK], &my_stream_stats_fops);
+    if (chip->streams[SNDRV_PCM_STREAM_CAPTURE].intf)
+        debugfs_create_file("capture", 0600, chip->debugfs_dir,
+                            &chip->streams[SNDRV_PCM_STREAM_CAPTURE], &my_stream_stats_fops);
+}
+
+static void my_audio_device_key(struct usb_device *udev, char *buf, size_t len)
+{
+    u16 vid = le16_to_cpu(udev->descriptor.idVendor);
+    u16 pid = le16_to_cpu(udev->descriptor.idProduct);
+
+    if (udev->serial && *udev->serial)
+        snprintf(buf, len, "%04x:%04x:%s", vid, pid, udev->serial);
+    else
+        snprintf(buf, len, "%04x:%04x@%d-%s", vid, pid, udev->bus->busnum, udev->devpath);
+}
+
+/* Called with my_register_mutex held */
+static int my_audio_pick_slot(const char *key)
+{
+    int slot;
+
+    /* The slot this device had before */
+    for (slot = 0; slot < SNDRV_CARDS; slot++)
+        if (enable[slot] && !my_chips[slot] && !strcmp(my_slot_keys[slot], key))
+            return slot;
+    /* One nobody has used, so other devices keep theirs */
+    for (slot = 0; slot < SNDRV_CARDS; slot++)
+        if (enable[slot] && !my_chips[slot] && !my_slot_keys[slot][0])
+            return slot;
+    for (slot = 0; slot < SNDRV_CARDS; slot++)
+        if (enable[slot] && !my_chips[slot])
+            return slot;
+    return -1;
+}
+
+/*
+ * /proc/asound/cardN/usbid, in the same "vvvv:pppp" form snd-usb-audio
+ * uses, so tools that look cards up by USB id find ours too.
+ */
+static void my_audio_proc_usbid(struct snd_info_entry *entry, struct snd_info_buffer *buffer)
+{
+    struct my_audio *chip = entry->private_data;
+
+    snd_iprintf(buffer, "%04x:%04x\n", le16_to_cpu(chip->udev->descriptor.idVendor),
+                le16_to_cpu(chip->udev->descriptor.idProduct));
+}
+
+/*
+ * Default card id when none was given: the tail of the serial number, or
+ * the port path, so it names this physical device rather than the model.
+ */
+static void my_audio_card_id(struct usb_device *udev, char *buf, size_t len)
+{
+    const char *src = udev->serial && *udev->serial ? udev->serial : udev->devpath;
+    size_t n = strlen(src);
+    size_t i, pos;
+
+    pos = strscpy(buf, udev->serial && *udev->serial ? "WS" : "WSp", len);
+    if (n > len - 1 - pos)
+        src += n - (len - 1 - pos);
+    for (i = 0; src[i] && pos < len - 1; i++)
+        buf[pos++] = isalnum(src[i]) ? src[i] : '_';
+    buf[pos] = '\0';
+}
+
 static struct usb_device_id snd_my_audio_ids[] = {
     { .match_flags = USB_DEVICE_ID_MATCH_VENDOR | USB_DEVICE_ID_MATCH_PRODUCT,
       .idVendor = 0x0c76, /* Replace with your Waveshare device's vendor ID */
       .idProduct = 0x1203, /* Replace with your Waveshare device's product ID */
     },
+    /* Other UAC1 devices can be added at runtime through
+     * /sys/bus/usb/drivers/my_usb_audio/new_id */
     { } /* Terminating entry */
 };
 MODULE_DEVICE_TABLE(usb, snd_my_audio_ids);
 
+/*
+ * Bound to the audio control interface; the streaming interfaces of the
+ * same device are claimed from here and exposed as one card.
+ */
 static int snd_my_audio_probe(struct usb_interface *intf,
-                               const struct usb_device_id *id)
+                               const struct usb_device_id *usb_id)
 {
+    struct usb_device *udev = interface_to_usbdev(intf);
+    struct usb_host_config *config = udev->actconfig;
+    struct snd_card *card;
+    struct my_audio *chip;
+    char key[sizeof(my_slot_keys[0])];
+    char card_id[16];
+    int slot, i, err;
+
+    if (intf->cur_altsetting->desc.bInterfaceClass != USB_CLASS_AUDIO ||
+        intf->cur_altsetting->desc.bInterfaceSubClass != USB_SUBCLASS_AUDIOCONTROL)
+        return -ENODEV;
+
     printk(KERN_INFO "My USB Audio device (%04x:%04x) plugged\n",
-           id->idVendor, id->idProduct);
+           le16_to_cpu(udev->descriptor.idVendor), le16_to_cpu(udev->descriptor.idProduct));
+
+    my_audio_device_key(udev, key, sizeof(key));
+    mutex_lock(&my_register_mutex);
+    slot = my_audio_pick_slot(key);
+    if (slot < 0) {
+        printk(KERN_ERR "my_usb_audio: no free card slot\n");
+        mutex_unlock(&my_register_mutex);
+        return -ENODEV;
+    }
+
+    /*
+     * Ask for the card number this device had last time; that fails while
+     * an application still holds the old card open, and then any free
+     * number will do.
+     */
+    err = -ENODEV;
+    if (index[slot] < 0 && my_slot_cards[slot] >= 0 && !strcmp(my_slot_keys[slot], key))
+        err = snd_card_new(&intf->dev, my_slot_cards[slot], id[slot], THIS_MODULE,
+                           sizeof(*chip), &card);
+    if (err < 0)
+        err = snd_card_new(&intf->dev, index[slot], id[slot], THIS_MODULE, sizeof(*chip), &card);
+    if (err < 0) {
+        mutex_unlock(&my_register_mutex);
+        return err;
+    }
+    chip = card->private_data;
+    chip->slot = slot;
+    chip->card = card;
+    chip->udev = udev;
+    chip->ctrl_intf = intf;
+    mutex_init(&chip->mixer_mutex);
+    chip->streams[SNDRV_PCM_STREAM_PLAYBACK].chip = chip;
+    chip->streams[SNDRV_PCM_STREAM_CAPTURE].chip = chip;
+
+    for (i = 0; i < config->desc.bNumInterfaces; i++) {
+        struct usb_interface *as = config->interface[i];
+
+        if (as == intf ||
+            as->altsetting[0].desc.bInterfaceClass != USB_CLASS_AUDIO ||
+            as->altsetting[0].desc.bInterfaceSubClass != USB_SUBCLASS_AUDIOSTREAMING)
+            continue;
+        if (usb_interface_claimed(as))
+            continue;
+        if (my_audio_add_stream(chip, as) < 0)
+            printk(KERN_INFO "my_usb_audio: skipping interface %d\n",
+                   as->altsetting[0].desc.bInterfaceNumber);
+    }
+
+    if (!chip->streams[0].intf && !chip->streams[1].intf) {
+        err = -ENODEV;
+        goto fail;
+    }
+
+    strscpy(card->driver, "MyUSBAudio", sizeof(card->driver));
+    strscpy(card->shortname, "Waveshare USB Audio", sizeof(card->shortname));
+    i = snprintf(card->longname, sizeof(card->longname), "%s %04x:%04x at ", card->shortname,
+                 le16_to_cpu(udev->descriptor.idVendor), le16_to_cpu(udev->descriptor.idProduct));
+    usb_make_path(udev, card->longname + i, sizeof(card->longname) - i);
+    if (!id[slot]) {
+        my_audio_card_id(udev, card_id, sizeof(card_id));
+        snd_card_set_id(card, card_id);
+    }
+
+    err = my_audio_create_pcm(chip);
+    if (err < 0)
+        goto fail;
+    my_audio_create_mixer(chip);
+    snd_card_ro_proc_new(card, "usbid", chip, my_audio_proc_usbid);
+    strscpy(card->mixername, card->shortname, sizeof(card->mixername));
+    err = snd_card_register(card);
+    if (err < 0)
+        goto fail;
+
+    my_audio_create_debugfs(chip);
+    usb_set_intfdata(intf, chip);
+    my_chips[slot] = chip;
+    strscpy(my_slot_keys[slot], key, sizeof(my_slot_keys[slot]));
+    my_slot_cards[slot] = card->number;
+    mutex_unlock(&my_register_mutex);
+    printk(KERN_INFO "my_usb_audio: %s is card %d (%s)\n", key, card->number, card->id);
     return 0;
+
+fail:
+    for (i = 0; i < 2; i++) {
+        struct usb_interface *as = chip->streams[i].intf;
+
+        if (as) {
+            my_audio_remove_stream(&chip->streams[i]);
+            usb_set_intfdata(as, NULL);
+            usb_driver_release_interface(&snd_my_audio_driver, as);
+        }
+    }
+    snd_card_free(card);
+    mutex_unlock(&my_register_mutex);
+    return err;
 }
 
+/*
+ * Called for the control interface and for each claimed streaming
+ * interface, in any order. The first call disconnects the card so open
+ * PCMs see -ENODEV; a streaming interface only stops its URBs, and the
+ * control interface releases whatever is left. The card (and the chip
+ * inside it) is freed once the last file handle is closed.
+ */
 static void snd_my_audio_disconnect(struct usb_interface *intf)
 {
+    struct my_audio *chip = usb_get_intfdata(intf);
+    int i;
+
+    if (!chip)
+        return;
+    usb_set_intfdata(intf, NULL);
+
+    if (!chip->disconnected) {
+        chip->disconnected = true;
+        snd_card_disconnect(chip->card);
+    }
+
+    if (intf != chip->ctrl_intf) {
+        for (i = 0; i < 2; i++)
+            if (chip->streams[i].intf == intf)
+                my_audio_remove_stream(&chip->streams[i]);
+        return;
+    }
+
+    /* Before the card goes: the files point into the chip */
+    debugfs_remove_recursive(chip->debugfs_dir);
+    for (i = 0; i < 2; i++) {
+        struct usb_interface *as = chip->streams[i].intf;
+
+        if (as) {
+            my_audio_remove_stream(&chip->streams[i]);
+            usb_set_intfdata(as, NULL);
+            usb_driver_release_interface(&snd_my_audio_driver, as);
+        }
+    }
+    mutex_lock(&my_register_mutex);
+    my_chips[chip->slot] = NULL;
+    mutex_unlock(&my_register_mutex);
+    snd_card_free_when_closed(chip->card);
     printk(KERN_INFO "My USB Audio device unplugged\n");
 }
 
@@ -41,14 +2077,21 @@ static struct usb_driver snd_my_audio_driver = {
 
 static int __init snd_my_audio_init(void)
 {
+int err;
+
 printk(KERN_INFO "INIT function\n");
-return usb_register(&snd_my_audio_driver);
+my_debugfs_root = debugfs_create_dir("my_usb_audio", NULL);
+err = usb_register(&snd_my_audio_driver);
+if (err)
+    debugfs_remove_recursive(my_debugfs_root);
+return err;
 }
 
 static void __exit snd_my_audio_exit(void)
 {
    printk(KERN_INFO "EXIT function\n"); 
 usb_deregister(&snd_my_audio_driver);
+debugfs_remove_recursive(my_debugfs_root);
 }
 
 module_init(snd_my_audio_init);
@@ -0,0 +1,154 @@
+/*
+ * Tracepoints for the usb_audio.c data path. Enable them with
+ *
+ *   echo 1 > /sys/kernel/tracing/events/my_usb_audio/enable
+ *
+ * or record them with perf (perf record -e 'my_usb_audio:*'). The Kbuild
+ * file next to this header puts this directory on the include path
+ * (CFLAGS_usb_audio.o := -I$(src)) so define_trace.h can find it.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM my_usb_audio
+
+#if !defined(_USB_AUDIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _USB_AUDIO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(my_usb_audio_urb_submit,
+    TP_PROTO(int card, int stream, unsigned int urb, unsigned int bytes, int err),
+    TP_ARGS(card, stream, urb, bytes, err),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, stream)
+        __field(unsigned int, urb)
+        __field(unsigned int, bytes)
+        __field(int, err)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->stream = stream;
+        __entry->urb = urb;
+        __entry->bytes = bytes;
+        __entry->err = err;
+    ),
+    TP_printk("card=%d %s urb=%u bytes=%u err=%d", __entry->card,
+              __entry->stream ? "capture" : "playback", __entry->urb,
+              __entry->bytes, __entry->err)
+);
+
+TRACE_EVENT(my_usb_audio_urb_complete,
+    TP_PROTO(int card, int stream, unsigned int urb, int status,
+             unsigned int bytes, s64 latency_us, s64 interval_us),
+    TP_ARGS(card, stream, urb, status, bytes, latency_us, interval_us),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, stream)
+        __field(unsigned int, urb)
+        __field(int, status)
+        __field(unsigned int, bytes)
+        __field(s64, latency_us)
+        __field(s64, interval_us)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->stream = stream;
+        __entry->urb = urb;
+        __entry->status = status;
+        __entry->bytes = bytes;
+        __entry->latency_us = latency_us;
+        __entry->interval_us = interval_us;
+    ),
+    TP_printk("card=%d %s urb=%u status=%d bytes=%u latency=%lldus interval=%lldus",
+              __entry->card, __entry->stream ? "capture" : "playback", __entry->urb,
+              __entry->status, __entry->bytes, __entry->latency_us, __entry->interval_us)
+);
+
+TRACE_EVENT(my_usb_audio_packet,
+    TP_PROTO(int card, int stream, unsigned int packet, unsigned int bytes, int status),
+    TP_ARGS(card, stream, packet, bytes, status),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, stream)
+        __field(unsigned int, packet)
+        __field(unsigned int, bytes)
+        __field(int, status)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->stream = stream;
+        __entry->packet = packet;
+        __entry->bytes = bytes;
+        __entry->status = status;
+    ),
+    TP_printk("card=%d %s packet=%u bytes=%u status=%d", __entry->card,
+              __entry->stream ? "capture" : "playback", __entry->packet,
+              __entry->bytes, __entry->status)
+);
+
+TRACE_EVENT(my_usb_audio_period_elapsed,
+    TP_PROTO(int card, int stream, unsigned int hwptr, unsigned long long frames),
+    TP_ARGS(card, stream, hwptr, frames),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, stream)
+        __field(unsigned int, hwptr)
+        __field(unsigned long long, frames)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->stream = stream;
+        __entry->hwptr = hwptr;
+        __entry->frames = frames;
+    ),
+    TP_printk("card=%d %s hwptr=%u frames=%llu", __entry->card,
+              __entry->stream ? "capture" : "playback", __entry->hwptr, __entry->frames)
+);
+
+/* Playback ran ahead of the application, or capture overwrote unread data */
+TRACE_EVENT(my_usb_audio_xrun,
+    TP_PROTO(int card, int stream, long avail, unsigned int frames),
+    TP_ARGS(card, stream, avail, frames),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(int, stream)
+        __field(long, avail)
+        __field(unsigned int, frames)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->stream = stream;
+        __entry->avail = avail;
+        __entry->frames = frames;
+    ),
+    TP_printk("card=%d %s avail=%ld frames=%u", __entry->card,
+              __entry->stream ? "overrun" : "underrun", __entry->avail, __entry->frames)
+);
+
+TRACE_EVENT(my_usb_audio_feedback,
+    TP_PROTO(int card, unsigned int raw, unsigned int freqm, unsigned int freqn),
+    TP_ARGS(card, raw, freqm, freqn),
+    TP_STRUCT__entry(
+        __field(int, card)
+        __field(unsigned int, raw)
+        __field(unsigned int, freqm)
+        __field(unsigned int, freqn)
+    ),
+    TP_fast_assign(
+        __entry->card = card;
+        __entry->raw = raw;
+        __entry->freqm = freqm;
+        __entry->freqn = freqn;
+    ),
+    TP_printk("card=%d raw=0x%x freqm=%u.%04u freqn=%u.%04u", __entry->card, __entry->raw,
+              __entry->freqm >> 16, (__entry->freqm & 0xffff) * 10000 >> 16,
+              __entry->freqn >> 16, (__entry->freqn & 0xffff) * 10000 >> 16)
+);
+
+#endif /* _USB_AUDIO_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE usb_audio_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,220 @@
+#ifndef VAD_H
+#define VAD_H
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Block-level voice/activity detection for interleaved S16 audio. Each
+// block is classified from its RMS energy with separate open and close
+// thresholds (hysteresis) plus a hangover, so speech pauses do not chop
+// the stream. The thresholds float above a tracked noise floor so a noisy
+// room does not keep the gate open. The floor is the quietest block of the
+// last couple of seconds (minimum statistics), taken from every block.
+// While the gate is closed it follows that minimum directly; while it is
+// open it may only rise by VAD_FLOOR_RISE_DB_PER_SEC, so a held note or
+// steady music stays gated open for many seconds, while background that
+// never stops (hum, machinery) still becomes the floor eventually and
+// closes the gate. An optional zero-crossing check keeps
+// quiet broadband hiss (high ZCR) from opening the gate. While the gate
+// is closed the last few hundred ms are kept in a pre-roll ring, which the
+// caller emits on an onset so word starts are not clipped.
+
+#define VAD_FLOOR_WINDOW_MS 2000
+#define VAD_FLOOR_SUBWINDOWS 8
+#define VAD_FLOOR_RISE_DB_PER_SEC 4.0
+
+typedef enum {
+    VAD_SILENT,     // drop the block
+    VAD_ONSET,      // emit the pre-roll, then the block
+    VAD_ACTIVE      // emit the block
+} VadDecision;
+
+typedef struct {
+    int channels;
+    double on_db;               // open when RMS is above this (dBFS) ...
+    double off_db;              // ... and close when below this
+    double floor_margin_db;     // thresholds never go below noise floor + margin
+    double noise_floor_db;
+
+    // Minimum statistics: the minimum of each completed sub-window, and of
+    // the one being filled
+    double sub_min_db[VAD_FLOOR_SUBWINDOWS];
+    int sub_count;
+    int sub_next;
+    double cur_min_db;
+    long sub_frames;
+    long sub_left;
+    int hangover_frames;
+    int use_zcr;
+    double zcr_max;             // crossings per frame above which quiet audio is noise
+
+    int active;
+    int hang_left;
+
+    int16_t *preroll;           // ring of the most recent silent frames
+    size_t preroll_capacity;
+    size_t preroll_fill;
+    size_t preroll_head;
+
+    // Counters for the caller's report
+    unsigned long long frames_in;
+    unsigned long long frames_passed;
+} Vad;
+
+static inline int vad_init(Vad *vad, int channels, unsigned int rate,
+                           int preroll_ms, int hangover_ms) {
+    memset(vad, 0, sizeof(*vad));
+    vad->channels = channels;
+    vad->on_db = -45.0;
+    vad->off_db = -52.0;
+    vad->floor_margin_db = 10.0;
+    vad->noise_floor_db = -90.0;
+    vad->hangover_frames = rate * hangover_ms / 1000;
+    vad->sub_frames = (long)rate * VAD_FLOOR_WINDOW_MS / 1000 / VAD_FLOOR_SUBWINDOWS;
+    vad->sub_left = vad->sub_frames;
+    vad->cur_min_db = 0.0;
+    vad->zcr_max = 0.35;
+    vad->preroll_capacity = rate * preroll_ms / 1000;
+    if (vad->preroll_capacity) {
+        vad->preroll = malloc(vad->preroll_capacity * channels * sizeof(int16_t));
+        if (!vad->preroll) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline void vad_free(Vad *vad) {
+    free(vad->preroll);
+    vad->preroll = NULL;
+}
+
+static inline void vad_preroll_push(Vad *vad, const int16_t *block, size_t frames) {
+    if (!vad->preroll_capacity) {
+        return;
+    }
+    if (frames > vad->preroll_capacity) {
+        block += (frames - vad->preroll_capacity) * vad->channels;
+        frames = vad->preroll_capacity;
+    }
+    for (size_t i = 0; i < frames; i++) {
+        memcpy(vad->preroll + vad->preroll_head * vad->channels,
+               block + i * vad->channels, vad->channels * sizeof(int16_t));
+        vad->preroll_head = (vad->preroll_head + 1) % vad->preroll_capacity;
+    }
+    vad->preroll_fill += frames;
+    if (vad->preroll_fill > vad->preroll_capacity) {
+        vad->preroll_fill = vad->preroll_capacity;
+    }
+}
+
+// Copy the pre-roll (oldest first) into dst, which must hold
+// preroll_capacity frames. Returns the number of frames copied and
+// empties the ring.
+static inline size_t vad_take_preroll(Vad *vad, int16_t *dst) {
+    size_t frames = vad->preroll_fill;
+    size_t start = (vad->preroll_head + vad->preroll_capacity - frames) % (vad->preroll_capacity ? vad->preroll_capacity : 1);
+    for (size_t i = 0; i < frames; i++) {
+        size_t idx = (start + i) % vad->preroll_capacity;
+        memcpy(dst + i * vad->channels, vad->preroll + idx * vad->channels,
+               vad->channels * sizeof(int16_t));
+    }
+    vad->preroll_fill = 0;
+    vad->frames_passed += frames;
+    return frames;
+}
+
+// Feed one block level into the minimum statistics. Until the first
+// sub-window completes the floor keeps its initial value.
+static inline void vad_track_floor(Vad *vad, double db, size_t frames) {
+    if (db < vad->cur_min_db) {
+        vad->cur_min_db = db;
+    }
+    vad->sub_left -= frames;
+    if (vad->sub_left > 0) {
+        return;
+    }
+    vad->sub_min_db[vad->sub_next] = vad->cur_min_db;
+    vad->sub_next = (vad->sub_next + 1) % VAD_FLOOR_SUBWINDOWS;
+    if (vad->sub_count < VAD_FLOOR_SUBWINDOWS) {
+        vad->sub_count++;
+    }
+    vad->cur_min_db = 0.0;
+    vad->sub_left = vad->sub_frames;
+
+    double floor_db = vad->sub_min_db[0];
+    for (int i = 1; i < vad->sub_count; i++) {
+        if (vad->sub_min_db[i] < floor_db) {
+            floor_db = vad->sub_min_db[i];
+        }
+    }
+    // With the gate open the minimum may be the signal itself: let the
+    // floor fall at once but rise only slowly
+    double max_rise = VAD_FLOOR_RISE_DB_PER_SEC * VAD_FLOOR_WINDOW_MS / 1000.0 / VAD_FLOOR_SUBWINDOWS;
+    if (vad->active && floor_db > vad->noise_floor_db + max_rise) {
+        floor_db = vad->noise_floor_db + max_rise;
+    }
+    vad->noise_floor_db = floor_db;
+}
+
+static inline VadDecision vad_process(Vad *vad, const int16_t *block, size_t frames) {
+    int64_t energy = 0;
+    int crossings = 0;
+    size_t samples = frames * vad->channels;
+
+    if (frames == 0) {
+        return vad->active ? VAD_ACTIVE : VAD_SILENT;
+    }
+    for (size_t i = 0; i < samples; i++) {
+        energy += (int32_t)block[i] * block[i];
+    }
+    for (size_t i = 1; i < frames; i++) {
+        crossings += (block[i * vad->channels] ^ block[(i - 1) * vad->channels]) < 0;
+    }
+
+    double ms = (double)energy / samples / (32768.0 * 32768.0);
+    double db = 10.0 * log10(ms + 1e-12);
+    double zcr = (double)crossings / frames;
+    vad_track_floor(vad, db, frames);
+    double on_db = vad->on_db;
+    double off_db = vad->off_db;
+    if (vad->noise_floor_db + vad->floor_margin_db > on_db) {
+        on_db = vad->noise_floor_db + vad->floor_margin_db;
+        off_db = on_db - (vad->on_db - vad->off_db);
+    }
+
+    vad->frames_in += frames;
+
+    if (!vad->active) {
+        int loud = db > on_db;
+        // Quiet but noisy-looking blocks need a clear margin to open
+        if (loud && vad->use_zcr && zcr > vad->zcr_max && db < on_db + 10.0) {
+            loud = 0;
+        }
+        if (!loud) {
+            vad_preroll_push(vad, block, frames);
+            return VAD_SILENT;
+        }
+        vad->active = 1;
+        vad->hang_left = vad->hangover_frames;
+        vad->frames_passed += frames;
+        return VAD_ONSET;
+    }
+
+    if (db < off_db) {
+        vad->hang_left -= frames;
+        if (vad->hang_left <= 0) {
+            vad->active = 0;
+            vad_preroll_push(vad, block, frames);
+            return VAD_SILENT;
+        }
+    } else {
+        vad->hang_left = vad->hangover_frames;
+    }
+    vad->frames_passed += frames;
+    return VAD_ACTIVE;
+}
+
+#endif